@@ -0,0 +1,389 @@
+#include "shell.h"
+#include <pty.h>
+
+#define BENCH_MIN_NS 200000000LL // Each benchmark runs for at least this long
+#define BENCH_LINE_SIZE 8192
+#define BENCH_VARIABLES 100
+#define BENCH_MAX_DEPTH 16
+#define BENCH_BLOB_SIZE 65536
+#define BENCH_GLOB_FILES 50000
+#define BENCH_GLOB_TEMPLATE "/tmp/shell_bench.XXXXXX"
+
+// Structure for one benchmark: run() performs iterations operations
+typedef struct {
+    const char* name;
+    void (*run)(long iterations, const void* arg);
+    const void* arg;
+    size_t bytes; // Input bytes per operation, to report throughput; 0 if not meaningful
+} Benchmark;
+
+// Global state shared by the benchmarks
+static Arena bench_arena;
+static VariableSystem bench_vars;
+static JobSystem bench_jobs;
+static CompletionSystem bench_completions;
+static ShellContext bench_ctx = {&bench_jobs, &bench_completions, &bench_vars};
+static char long_line[BENCH_LINE_SIZE];
+static char quoted_line[BENCH_LINE_SIZE];
+static char variable_line[BENCH_LINE_SIZE];
+static char spawn_lines[BENCH_MAX_DEPTH + 1][BENCH_LINE_SIZE];
+static char json_line[BENCH_BLOB_SIZE];
+static char base64_line[BENCH_BLOB_SIZE];
+static char shell_path[PATH_MAX];
+static char glob_dir[sizeof(BENCH_GLOB_TEMPLATE)];
+static volatile long bench_sink;
+
+// Helper function to read the monotonic clock in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Helper function to build the command lines the benchmarks work on
+static void init_bench_lines(void) {
+    // 200 plain words
+    size_t used = snprintf(long_line, sizeof(long_line), "echo");
+    for (int i = 0; i < 200; i++) {
+        used += snprintf(long_line + used, sizeof(long_line) - used, " word%d", i);
+    }
+
+    // Quoting of every kind, repeated
+    used = snprintf(quoted_line, sizeof(quoted_line), "echo");
+    for (int i = 0; i < 40; i++) {
+        used += snprintf(quoted_line + used, sizeof(quoted_line) - used, " 'single %d' \"double \\\"%d\\\"\" esc\\ aped%d", i, i, i);
+    }
+
+    // One reference to each of BENCH_VARIABLES variables, in both spellings
+    used = snprintf(variable_line, sizeof(variable_line), "echo");
+    for (int i = 0; i < BENCH_VARIABLES; i++) {
+        used += snprintf(variable_line + used, sizeof(variable_line) - used, i % 2 ? " $VAR%d" : " ${VAR%d}x", i);
+    }
+
+    // A pasted curl command with a single-quoted JSON payload of ~64KB
+    used = snprintf(json_line, sizeof(json_line), "curl -X POST -d '[");
+    for (int i = 0; used + 64 < sizeof(json_line); i++) {
+        used += snprintf(json_line + used, sizeof(json_line) - used, "{\"id\": %d, \"name\": \"item %d\"},", i, i);
+    }
+    snprintf(json_line + used - 1, sizeof(json_line) - used + 1, "]' http://localhost/");
+
+    // An unquoted base64 blob of ~64KB
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    used = snprintf(base64_line, sizeof(base64_line), "echo ");
+    while (used < sizeof(base64_line) - 1) {
+        base64_line[used] = alphabet[used % 64];
+        used++;
+    }
+    base64_line[used] = '\0';
+
+    for (int depth = 1; depth <= BENCH_MAX_DEPTH; depth++) {
+        used = 0;
+        for (int i = 0; i < depth; i++) {
+            used += snprintf(spawn_lines[depth] + used, BENCH_LINE_SIZE - used, i ? " | /bin/true" : "/bin/true");
+        }
+    }
+}
+
+// Helper function to get the first pipeline of a parsed line
+static const AstPipeline* parse_pipeline_line(const char* line, Arena* arena) {
+    int incomplete = 0;
+    TokenList* tokens = parse_arguments(line, 1, &incomplete, arena);
+    AstNode* ast = tokens ? build_ast(tokens, arena, &incomplete) : NULL;
+    if (ast == NULL || ast->kind != NODE_LIST || ast->n_children == 0 || ast->children[0]->kind != NODE_PIPELINE) {
+        fprintf(stderr, "shell_bench: cannot parse: %s\n", line);
+        exit(1);
+    }
+    return ast->children[0]->pipeline;
+}
+
+// Benchmark: lex a line into tokens
+static void bench_tokenize(long iterations, const void* arg) {
+    for (long i = 0; i < iterations; i++) {
+        int incomplete = 0;
+        TokenList* tokens = parse_arguments(arg, 1, &incomplete, &bench_arena);
+        bench_sink += tokens ? tokens->count : 0;
+        arena_reset(&bench_arena);
+    }
+}
+
+// Benchmark: lex and parse a line into an AST, bypassing the AST cache
+static void bench_parse(long iterations, const void* arg) {
+    for (long i = 0; i < iterations; i++) {
+        int incomplete = 0;
+        TokenList* tokens = parse_arguments(arg, 1, &incomplete, &bench_arena);
+        bench_sink += build_ast(tokens, &bench_arena, &incomplete) != NULL;
+        arena_reset(&bench_arena);
+    }
+}
+
+// Benchmark: expand a parsed pipeline into argv, as done for every execution
+static void bench_expand(long iterations, const void* arg) {
+    Arena ast_arena = {0};
+    const AstPipeline* pipeline = parse_pipeline_line(arg, &ast_arena);
+    for (long i = 0; i < iterations; i++) {
+        ParseResult** segments = instantiate_ast(pipeline, 0, &bench_ctx, &bench_arena);
+        bench_sink += segments != NULL;
+        arena_reset(&bench_arena);
+    }
+    arena_free(&ast_arena);
+}
+
+// Benchmark: resolve a command name through the command hash and PATH
+static void bench_lookup(long iterations, const void* arg) {
+    for (long i = 0; i < iterations; i++) {
+        char* path = find_exe_in_path(arg);
+        bench_sink += path != NULL;
+        free(path);
+    }
+}
+
+// Benchmark: list every completion of a prefix with a readline generator
+static void bench_complete(long iterations, const void* arg) {
+    char* (*generator)(const char*, int) = strchr(arg, '/') ? filename_generator : command_generator;
+    for (long i = 0; i < iterations; i++) {
+        char* match;
+        for (int state = 0; (match = generator(arg, state)) != NULL; state++) {
+            bench_sink++;
+            free(match);
+        }
+    }
+}
+
+// Benchmark: fetch the exec environment, rebuilding it each time when arg is non-NULL
+static void bench_environment(long iterations, const void* arg) {
+    for (long i = 0; i < iterations; i++) {
+        if (arg != NULL) {
+            set_variable(&bench_vars, "BENCH_EXPORTED", (i & 1) ? "odd" : "even");
+        }
+        bench_sink += get_environment(&bench_vars) != NULL;
+    }
+}
+
+// Helper function to create the build-directory-like tree the glob benchmarks match in:
+// BENCH_GLOB_FILES objects and as many sources, made before the first one is timed
+static int prepare_glob_dir(void) {
+    if (glob_dir[0] != '\0') {
+        return 0;
+    }
+    strcpy(glob_dir, BENCH_GLOB_TEMPLATE);
+    if (mkdtemp(glob_dir) == NULL) {
+        perror("shell_bench: mkdtemp failed");
+        glob_dir[0] = '\0';
+        return -1;
+    }
+    char path[sizeof(glob_dir) + 32]; // Room for "/unit" and any int and suffix
+    for (int i = 0; i < BENCH_GLOB_FILES; i++) {
+        const char* suffixes[] = {"o", "c"};
+        for (int s = 0; s < 2; s++) {
+            snprintf(path, sizeof(path), "%s/unit%05d.%s", glob_dir, i, suffixes[s]);
+            int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to delete the glob benchmarks' tree again
+static void remove_glob_dir(void) {
+    if (glob_dir[0] == '\0') {
+        return;
+    }
+    DIR* dirp = opendir(glob_dir);
+    struct dirent* entry;
+    while (dirp != NULL && (entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            unlinkat(dirfd(dirp), entry->d_name, 0);
+        }
+    }
+    if (dirp != NULL) {
+        closedir(dirp);
+    }
+    rmdir(glob_dir);
+}
+
+// Benchmark: expand a glob in a directory of 2 * BENCH_GLOB_FILES entries, compiled once
+// as the parser does; the listing comes from the directory snapshot cache
+static void bench_glob(long iterations, const void* arg) {
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/%s", glob_dir, (const char*)arg);
+    Arena pattern_arena = {0};
+    const GlobPattern* glob = compile_glob(pattern, &pattern_arena);
+    for (long i = 0; i < iterations; i++) {
+        char** matches;
+        bench_sink += expand_glob(glob, &bench_arena, &matches);
+        arena_reset(&bench_arena);
+    }
+    arena_free(&pattern_arena);
+}
+
+// Benchmark: launch a pipeline of /bin/true and wait for it
+static void bench_spawn(long iterations, const void* arg) {
+    Arena ast_arena = {0};
+    const AstPipeline* pipeline = parse_pipeline_line(arg, &ast_arena);
+    for (long i = 0; i < iterations; i++) {
+        ParseResult** segments = instantiate_ast(pipeline, 0, &bench_ctx, &bench_arena);
+        execute_pipeline(segments, pipeline->n_commands, 0, &bench_ctx, &bench_arena);
+        arena_reset(&bench_arena);
+    }
+    arena_free(&ast_arena);
+}
+
+// Benchmark: run `shell -c true` to completion, the cost of every short-lived shell
+static void bench_startup_command(long iterations, const void* arg) {
+    (void)arg;
+    char* argv[] = {shell_path, "-c", "true", NULL};
+    for (long i = 0; i < iterations; i++) {
+        pid_t pid;
+        if (posix_spawn(&pid, shell_path, NULL, NULL, argv, environ) != 0) {
+            perror("shell_bench: posix_spawn");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Benchmark: start an interactive shell on a pseudo-terminal and wait for its first prompt
+static void bench_startup_prompt(long iterations, const void* arg) {
+    (void)arg;
+    for (long i = 0; i < iterations; i++) {
+        int fd;
+        pid_t pid = forkpty(&fd, NULL, NULL, NULL);
+        if (pid == -1) {
+            perror("shell_bench: forkpty");
+            exit(1);
+        }
+        if (pid == 0) {
+            execl(shell_path, shell_path, (char*)NULL);
+            _exit(127);
+        }
+
+        // The prompt may arrive split across reads, after readline's terminal setup
+        char buf[256];
+        char last = '\0';
+        int seen = 0;
+        while (!seen) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            for (ssize_t j = 0; j < n && !seen; j++) {
+                seen = last == '$' && buf[j] == ' ';
+                last = buf[j];
+            }
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(fd);
+    }
+}
+
+// Helper function to find the shell executable built next to shell_bench, "" if missing
+static void find_shell_binary(void) {
+    ssize_t len = readlink("/proc/self/exe", shell_path, sizeof(shell_path) - 1);
+    shell_path[len > 0 ? len : 0] = '\0';
+    char* slash = strrchr(shell_path, '/');
+    if (slash == NULL || (size_t)(slash - shell_path) + sizeof("/shell") > sizeof(shell_path)) {
+        shell_path[0] = '\0';
+        return;
+    }
+    strcpy(slash, "/shell");
+    if (access(shell_path, X_OK) != 0) {
+        shell_path[0] = '\0';
+    }
+}
+
+// Helper function to time one benchmark, doubling the iteration count until a run lasts
+// BENCH_MIN_NS, and print its cost per operation
+static void run_benchmark(const Benchmark* bench) {
+    long iterations = 1;
+    long long elapsed;
+    while (1) {
+        long long started = now_ns();
+        bench->run(iterations, bench->arg);
+        elapsed = now_ns() - started;
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+    printf("%-28s %10ld %14.1f ns/op", bench->name, iterations, (double)elapsed / iterations);
+    if (bench->bytes > 0) {
+        printf(" %10.1f MB/s", (double)bench->bytes * iterations * 1000.0 / elapsed);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    init_variable_system(&bench_vars);
+    import_environment(&bench_vars);
+    init_jobs_system(&bench_jobs);
+    get_set_job_context(&bench_jobs);
+    init_completion_system(&bench_completions);
+    init_builtin_output();
+    arena_init(&bench_arena);
+    init_bench_lines();
+    find_shell_binary();
+
+    char name[32];
+    for (int i = 0; i < BENCH_VARIABLES; i++) {
+        snprintf(name, sizeof(name), "VAR%d", i);
+        set_variable(&bench_vars, name, "some value");
+    }
+    set_variable(&bench_vars, "BENCH_EXPORTED", "");
+    export_variable(&bench_vars, "BENCH_EXPORTED", 1);
+
+    static char depth_names[BENCH_MAX_DEPTH + 1][32];
+    Benchmark benches[32 + BENCH_MAX_DEPTH];
+    int n = 0;
+    benches[n++] = (Benchmark){"tokenize/long", bench_tokenize, long_line, strlen(long_line)};
+    benches[n++] = (Benchmark){"tokenize/quoted", bench_tokenize, quoted_line, strlen(quoted_line)};
+    benches[n++] = (Benchmark){"tokenize/json-64k", bench_tokenize, json_line, strlen(json_line)};
+    benches[n++] = (Benchmark){"tokenize/base64-64k", bench_tokenize, base64_line, strlen(base64_line)};
+    benches[n++] = (Benchmark){"parse/compound", bench_parse, "for i in a b c; do if true; then echo $i | cat; fi; done", 0};
+    benches[n++] = (Benchmark){"expand/literal", bench_expand, long_line, 0};
+    benches[n++] = (Benchmark){"expand/variables", bench_expand, variable_line, 0};
+    benches[n++] = (Benchmark){"expand/subst-builtin", bench_expand, "echo $(echo some words) `pwd`", 0};
+    benches[n++] = (Benchmark){"expand/subst-fork", bench_expand, "echo $(/bin/echo some words)", 0};
+    benches[n++] = (Benchmark){"glob/all-objects", bench_glob, "*.o", 0};
+    benches[n++] = (Benchmark){"glob/prefix", bench_glob, "unit4*.o", 0};
+    benches[n++] = (Benchmark){"glob/class", bench_glob, "unit0000[0-4].[co]", 0};
+    benches[n++] = (Benchmark){"lookup/hashed", bench_lookup, "ls", 0};
+    benches[n++] = (Benchmark){"lookup/missing", bench_lookup, "no-such-command-anywhere", 0};
+    benches[n++] = (Benchmark){"env/cached", bench_environment, NULL, 0};
+    benches[n++] = (Benchmark){"env/rebuild", bench_environment, "rebuild", 0};
+    benches[n++] = (Benchmark){"complete/command", bench_complete, "l", 0};
+    benches[n++] = (Benchmark){"complete/filename", bench_complete, "/usr/bin/l", 0};
+    for (int depth = 1; depth <= BENCH_MAX_DEPTH; depth *= 2) {
+        snprintf(depth_names[depth], sizeof(depth_names[depth]), "spawn/pipeline-%d", depth);
+        benches[n++] = (Benchmark){depth_names[depth], bench_spawn, spawn_lines[depth], 0};
+    }
+    if (shell_path[0] != '\0') {
+        benches[n++] = (Benchmark){"startup/command", bench_startup_command, NULL, 0};
+        benches[n++] = (Benchmark){"startup/first-prompt", bench_startup_prompt, NULL, 0};
+    } else {
+        fprintf(stderr, "shell_bench: no shell executable next to shell_bench, skipping startup benchmarks\n");
+    }
+
+    // Optional arguments select benchmarks whose name contains any of them
+    printf("%-28s %10s %14s\n", "benchmark", "iterations", "time");
+    for (int i = 0; i < n; i++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc && !selected; a++) {
+            selected = strstr(benches[i].name, argv[a]) != NULL;
+        }
+        if (selected && benches[i].run == bench_glob && prepare_glob_dir() != 0) {
+            continue;
+        }
+        if (selected) {
+            run_benchmark(&benches[i]);
+        }
+    }
+
+    flush_builtin_output();
+    remove_glob_dir();
+    arena_free(&bench_arena);
+    return 0;
+}
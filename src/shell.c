@@ -0,0 +1,8023 @@
+#include "shell.h"
+
+// Global builtin dispatch table, defined after the handlers it points to
+extern const BuiltinCommand builtin_table[];
+
+// Global command hash shared by command lookup, `type` and `hash`
+static CommandHash command_hash;
+
+// Global job-control state, only enabled when the shell owns an interactive terminal
+static int job_control = 0;
+static pid_t shell_pgid = 0;
+
+// Global exit status of the last command (`$?`) and of each stage of the last pipeline (PIPESTATUS)
+static int last_exit_status = 0;
+static int* last_pipestatus = NULL;
+static int n_last_pipestatus = 0;
+
+// Global control-flow state: `exit` and SIGINT unwind everything, break/continue unwind
+// loop_jump loop levels (the last one continued when loop_jump_continue is set)
+static int exit_requested = 0;
+static int exit_request_status = 0;
+static volatile sig_atomic_t pipeline_interrupted = 0;
+static volatile sig_atomic_t sigint_received = 0; // Set by the shell's own SIGINT handler
+static int loop_depth = 0;
+static int loop_jump = 0;
+static int loop_jump_continue = 0;
+
+// Global SIGCHLD self-pipe: the handler writes a byte, the REPL and readline hook read it
+static int sigchld_pipe[2] = {-1, -1};
+
+// Global stdout buffer for builtin output, flushed at well-defined points
+static char builtin_out_buffer[OUT_BUF_SIZE];
+
+// Global executable index, refreshed lazily on completion requests
+static ExeIndex exe_index;
+
+// Global LRU of directory listings used by filename completion
+static DirSnapshot dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+
+// Global LRU of parsed command lines, so repeated lines skip lexing and parsing
+static AstCacheEntry ast_cache[AST_CACHE_SIZE];
+static unsigned long ast_cache_clock;
+
+// Global flag choosing posix_spawn (default) or the classic fork+exec launch path
+static int use_posix_spawn = 1;
+
+// Global exec size limits from sysconf, read on first use (-1 when unknown)
+static long exec_arg_max = 0;
+static long exec_arg_strlen_max = 0;
+
+// Global input source of the running shell, also read for continuation lines
+static InputSource* active_input = NULL;
+
+// Global variable system of the running shell; environment lookups go through it
+static VariableSystem* shell_variables = NULL;
+
+// Global status of the last command substitution run while expanding the current command
+static int substitution_status = 0;
+
+extern char** environ;
+
+// Helper function to grow the job table, keeping job IDs equal to slot + 1
+int grow_jobs_table(JobSystem* sys) {
+    int new_capacity = sys->capacity ? sys->capacity * 2 : JOB_TABLE_INITIAL_SIZE;
+
+    Job* list = realloc(sys->list, new_capacity * sizeof(Job));
+    if (list == NULL) {
+        perror("grow_jobs_table: realloc failed");
+        return -1;
+    }
+    sys->list = list;
+
+    unsigned long* bitmap = realloc(sys->id_bitmap, (new_capacity / 64) * sizeof(unsigned long));
+    if (bitmap == NULL) {
+        perror("grow_jobs_table: realloc failed");
+        return -1;
+    }
+    sys->id_bitmap = bitmap;
+
+    memset(sys->list + sys->capacity, 0, (new_capacity - sys->capacity) * sizeof(Job));
+    memset(sys->id_bitmap + sys->capacity / 64, 0, ((new_capacity - sys->capacity) / 64) * sizeof(unsigned long));
+    sys->capacity = new_capacity;
+    return 0;
+}
+
+// Helper function to initialize job lists
+void init_jobs_system(JobSystem* sys) {
+    sys->list = NULL;
+    sys->capacity = 0;
+    sys->id_bitmap = NULL;
+    sys->n_done = 0;
+    grow_jobs_table(sys);
+
+    sys->index_size = JOB_INDEX_INITIAL_SIZE;
+    sys->index_count = 0;
+    sys->index_pids = calloc(sys->index_size, sizeof(pid_t));
+    sys->index_slots = malloc(sys->index_size * sizeof(int));
+    if (sys->index_pids == NULL || sys->index_slots == NULL) {
+        perror("init_jobs_system: malloc failed");
+        exit(1);
+    }
+}
+
+// Helper function to grow the completion registry
+int grow_completion_table(CompletionSystem* sys) {
+    int new_capacity = sys->capacity ? sys->capacity * 2 : COMPLETION_TABLE_INITIAL_SIZE;
+    CompletionRegister* list = realloc(sys->list, new_capacity * sizeof(CompletionRegister));
+    if (list == NULL) {
+        perror("grow_completion_table: realloc failed");
+        return -1;
+    }
+    sys->list = list;
+    sys->capacity = new_capacity;
+    return 0;
+}
+
+// Helper function to initialize completion specifications; registrations are stored
+// as they are made
+void init_completion_system(CompletionSystem* sys) {
+    sys->list = NULL;
+    sys->count = 0;
+    sys->capacity = 0;
+}
+
+// Helper function to fully buffer stdout so builtin output turns into large writes
+void init_builtin_output(void) {
+    setvbuf(stdout, builtin_out_buffer, _IOFBF, sizeof(builtin_out_buffer));
+}
+
+// Helper function to push pending builtin output to fd 1. Called before prompting,
+// before starting any child (so it neither duplicates nor reorders the buffer) and
+// before stdout is redirected or restored.
+void flush_builtin_output(void) {
+    fflush(stdout);
+}
+
+// Helper function to initialize shell variable tracking system
+void init_variable_system(VariableSystem* sys) {
+    sys->list = NULL;
+    sys->count = 0;
+    sys->capacity = 0;
+    sys->index_size = VAR_INDEX_INITIAL_SIZE;
+    sys->index = malloc(sys->index_size * sizeof(int));
+    if (sys->index == NULL) {
+        perror("init_variable_system: malloc failed");
+        sys->index_size = 0;
+    }
+    for (int i = 0; i < sys->index_size; i++) {
+        sys->index[i] = -1;
+    }
+    sys->name_pool = (Arena){NULL, NULL};
+    sys->env_generation = 1;
+    sys->envp = NULL;
+    sys->envp_count = 0;
+    sys->envp_generation = 0;
+}
+
+// Helper function to read an environment setting from the shell's variables (which hold
+// the imported environment plus anything exported since), falling back to the process
+// environment before the variable system exists
+const char* shell_getenv(const char* name) {
+    if (shell_variables == NULL) {
+        return getenv(name);
+    }
+    return lookup_variable(shell_variables, name, strlen(name));
+}
+
+// Helper function to fetch the environment handed to children the shell starts itself
+char** shell_environment(void) {
+    return (shell_variables != NULL) ? get_environment(shell_variables) : environ;
+}
+
+// Helper function to find smallest available job ID to allow for job number recycling.
+// Grows the table when every ID is taken; returns 0 only if that fails.
+int get_smallest_available_job(JobSystem* sys) {
+    for (int w = 0; w < sys->capacity / 64; w++) {
+        if (~sys->id_bitmap[w] != 0) {
+            return w * 64 + __builtin_ctzl(~sys->id_bitmap[w]) + 1;
+        }
+    }
+
+    int first_new_id = sys->capacity + 1;
+    return grow_jobs_table(sys) == 0 ? first_new_id : 0;
+}
+
+// Helper function to find the highest and second-highest job IDs in use (-1 if none)
+void find_latest_job_ids(JobSystem* sys, int* max_id, int* second_max_id) {
+    *max_id = -1;
+    *second_max_id = -1;
+
+    for (int w = sys->capacity / 64 - 1; w >= 0 && *second_max_id == -1; w--) {
+        unsigned long bits = sys->id_bitmap[w];
+        while (bits != 0 && *second_max_id == -1) {
+            int id = w * 64 + (63 - __builtin_clzl(bits)) + 1;
+            if (*max_id == -1) {
+                *max_id = id;
+            } else {
+                *second_max_id = id;
+            }
+            bits &= ~(1UL << (id - 1 - w * 64));
+        }
+    }
+}
+
+// Helper function to pick the first pid index bucket for a pid
+unsigned int job_pid_bucket(JobSystem* sys, pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (sys->index_size - 1);
+}
+
+// Helper function to place a pid in the index without growth checks
+void job_index_place(JobSystem* sys, pid_t pid, int slot) {
+    unsigned int mask = sys->index_size - 1;
+    unsigned int b = job_pid_bucket(sys, pid);
+    while (sys->index_pids[b] != 0 && sys->index_pids[b] != pid) {
+        b = (b + 1) & mask; // Linear probing
+    }
+    if (sys->index_pids[b] == 0) {
+        sys->index_count++;
+    }
+    sys->index_pids[b] = pid;
+    sys->index_slots[b] = slot;
+}
+
+// Helper function to double the pid index once it is half full
+int grow_job_index(JobSystem* sys) {
+    pid_t* old_pids = sys->index_pids;
+    int* old_slots = sys->index_slots;
+    int old_size = sys->index_size;
+
+    pid_t* new_pids = calloc(old_size * 2, sizeof(pid_t));
+    int* new_slots = malloc(old_size * 2 * sizeof(int));
+    if (new_pids == NULL || new_slots == NULL) {
+        perror("grow_job_index: malloc failed");
+        free(new_pids);
+        free(new_slots);
+        return -1;
+    }
+
+    sys->index_pids = new_pids;
+    sys->index_slots = new_slots;
+    sys->index_size = old_size * 2;
+    sys->index_count = 0;
+    for (int i = 0; i < old_size; i++) {
+        if (old_pids[i] != 0) {
+            job_index_place(sys, old_pids[i], old_slots[i]);
+        }
+    }
+
+    free(old_pids);
+    free(old_slots);
+    return 0;
+}
+
+// Helper function to map a pid to its job slot
+void job_index_insert(JobSystem* sys, pid_t pid, int slot) {
+    if ((sys->index_count + 1) * 2 > sys->index_size) {
+        // On allocation failure keep using the old table while it still has a free bucket
+        if (grow_job_index(sys) != 0 && sys->index_count + 1 >= sys->index_size) {
+            return;
+        }
+    }
+    job_index_place(sys, pid, slot);
+}
+
+// Helper function to find the bucket holding a pid, -1 if it is not indexed
+int job_index_find(JobSystem* sys, pid_t pid) {
+    unsigned int mask = sys->index_size - 1;
+    unsigned int b = job_pid_bucket(sys, pid);
+    while (sys->index_pids[b] != 0) {
+        if (sys->index_pids[b] == pid) {
+            return (int)b;
+        }
+        b = (b + 1) & mask;
+    }
+    return -1;
+}
+
+// Helper function to drop a pid from the index, shifting later chain members back so
+// lookups never need tombstones
+void job_index_remove(JobSystem* sys, int bucket) {
+    unsigned int mask = sys->index_size - 1;
+    unsigned int hole = bucket;
+    unsigned int b = hole;
+    while (1) {
+        b = (b + 1) & mask;
+        if (sys->index_pids[b] == 0) {
+            break;
+        }
+        // Move the entry into the hole unless its home bucket lies cyclically in (hole, b]
+        unsigned int home = job_pid_bucket(sys, sys->index_pids[b]);
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            sys->index_pids[hole] = sys->index_pids[b];
+            sys->index_slots[hole] = sys->index_slots[b];
+            hole = b;
+        }
+    }
+    sys->index_pids[hole] = 0;
+    sys->index_count--;
+}
+
+// Helper function to join the words of each pipeline stage into one display string
+// ("a b | c d"), measuring first so the text is written in a single pass
+char* build_job_command(char** const* stage_argvs, int n_stages) {
+    size_t total = 1;
+    for (int s = 0; s < n_stages; s++) {
+        for (int j = 0; stage_argvs[s][j] != NULL; j++) {
+            total += strlen(stage_argvs[s][j]) + 1;
+        }
+        total += 3; // " | "
+    }
+
+    char* command = malloc(total);
+    if (command == NULL) {
+        perror("build_job_command: malloc failed");
+        return NULL;
+    }
+
+    char* out = command;
+    for (int s = 0; s < n_stages; s++) {
+        if (s > 0) {
+            memcpy(out, " | ", 3);
+            out += 3;
+        }
+        for (int j = 0; stage_argvs[s][j] != NULL; j++) {
+            if (j > 0) {
+                *out++ = ' ';
+            }
+            size_t len = strlen(stage_argvs[s][j]);
+            memcpy(out, stage_argvs[s][j], len);
+            out += len;
+        }
+    }
+    *out = '\0';
+    return command;
+}
+
+// Helper function to record a job, taking ownership of command. statuses (exit code per
+// member, -1 while running) may be NULL when every member is still running.
+Job* register_job(JobSystem* sys, const pid_t* pids, const int* statuses, int n_pids, char* command) {
+    int job_id = get_smallest_available_job(sys);
+    if (job_id == 0) {
+        free(command);
+        return NULL;
+    }
+
+    Job* job = &sys->list[job_id - 1];
+    job->pids = malloc(n_pids * sizeof(pid_t));
+    job->statuses = malloc(n_pids * sizeof(int));
+    if (job->pids == NULL || job->statuses == NULL) {
+        perror("register_job: malloc failed");
+        free(job->pids);
+        free(job->statuses);
+        free(command);
+        job->pids = NULL;
+        job->statuses = NULL;
+        return NULL;
+    }
+
+    job->job_id = job_id;
+    job->pid = -1;
+    job->n_pids = n_pids;
+    job->n_running = 0;
+    for (int i = 0; i < n_pids; i++) {
+        job->pids[i] = pids[i];
+        // Members that never started count as finished: 1 after a failed redirection (pid 0),
+        // "command not found" otherwise
+        job->statuses[i] = statuses != NULL ? statuses[i] : (pids[i] == 0 ? 1 : (pids[i] < 0 ? 127 : -1));
+        if (job->pid == -1 && pids[i] > 0) {
+            job->pid = pids[i]; // The first member that started leads the process group
+        }
+        if (job->statuses[i] == -1) {
+            job->n_running++;
+            job_index_insert(sys, pids[i], job_id - 1);
+        }
+    }
+    job->command = command ? command : strdup("");
+    job->is_active = 1;
+    job->is_done = job->n_running == 0;
+    job->is_stopped = 0;
+    if (job->is_done) {
+        sys->n_done++;
+    }
+
+    sys->id_bitmap[(job_id - 1) / 64] |= 1UL << ((job_id - 1) % 64);
+    return job;
+}
+
+// Helper function to tell whether job notices ("[id] pid", "Done") are printed; like other
+// shells, only commands read interactively get them
+int job_notices_shown(void) {
+    return active_input != NULL && active_input->interactive;
+}
+
+// Helper function to record a background job and announce it as "[id] pid"
+int register_background_job(JobSystem* sys, const pid_t* pids, int n_pids, char* command) {
+    Job* job = register_job(sys, pids, NULL, n_pids, command);
+    if (job == NULL) {
+        return -1;
+    }
+
+    if (job->pid > 0 && job_notices_shown()) {
+        printf("[%d] %d\n", job->job_id, job->pid);
+    }
+    return job->job_id;
+}
+
+// Helper function to record that one job member exited with the given exit code
+void job_member_exited(JobSystem* sys, Job* job, int member, int code) {
+    if (job->statuses[member] != -1) {
+        return;
+    }
+
+    job->statuses[member] = code;
+    job->n_running--;
+
+    int bucket = job_index_find(sys, job->pids[member]);
+    if (bucket != -1) {
+        job_index_remove(sys, bucket);
+    }
+
+    if (job->n_running == 0) {
+        job->is_done = 1;
+        job->is_stopped = 0;
+        sys->n_done++;
+    }
+}
+
+// Helper function to free a reported job's ID and slot
+void release_job(JobSystem* sys, Job* job) {
+    for (int i = 0; i < job->n_pids; i++) {
+        if (job->statuses[i] == -1) {
+            int bucket = job_index_find(sys, job->pids[i]);
+            if (bucket != -1) {
+                job_index_remove(sys, bucket);
+            }
+        }
+    }
+    free(job->pids);
+    free(job->statuses);
+    free(job->command);
+    job->pids = NULL;
+    job->statuses = NULL;
+    job->command = NULL;
+    job->n_pids = 0;
+    job->n_running = 0;
+
+    sys->id_bitmap[(job->job_id - 1) / 64] &= ~(1UL << ((job->job_id - 1) % 64));
+    if (job->is_done) {
+        sys->n_done--;
+    }
+    job->is_active = 0;
+    job->is_done = 0;
+    job->is_stopped = 0;
+}
+
+// Helper function to turn a wait status into a shell exit code
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 1;
+}
+
+// Helper function to remember the exit codes of the last pipeline for `$?` and PIPESTATUS
+void set_last_status(const int* codes, int n) {
+    if (n > n_last_pipestatus) {
+        int* grown = realloc(last_pipestatus, n * sizeof(int));
+        if (grown == NULL) {
+            perror("set_last_status: realloc failed");
+            return;
+        }
+        last_pipestatus = grown;
+    }
+    memcpy(last_pipestatus, codes, n * sizeof(int));
+    n_last_pipestatus = n;
+    last_exit_status = n > 0 ? codes[n - 1] : 0;
+}
+
+// Helper function to remember the exit code of a single command
+void set_single_status(int code) {
+    set_last_status(&code, 1);
+}
+
+// Helper function to hand the terminal to a process group (no-op without job control)
+void give_terminal_to(pid_t pgid) {
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
+
+// Global SHELL_TRACE state: a ring of the last TRACE_RING_SIZE lines' phase timings
+static int trace_enabled = 0;
+static TraceRecord trace_ring[TRACE_RING_SIZE];
+static int trace_next = 0;
+static int trace_count = 0;
+static TraceRecord* trace_current = NULL;
+static long long trace_line_start = 0;
+static long long shell_start_ns = 0;
+
+// Global resource usage of the foreground children collected by wait_for_pipeline
+static struct timeval waited_utime = {0, 0};
+static struct timeval waited_stime = {0, 0};
+
+// Helper function to read the monotonic clock in nanoseconds
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Helper function to start timing a phase; free when tracing is off
+long long trace_start(void) {
+    return trace_current != NULL ? monotonic_ns() : 0;
+}
+
+// Helper function to charge the time since started to a phase of the current line
+void trace_phase(TracePhase phase, long long started) {
+    if (trace_current != NULL) {
+        trace_current->phase_ns[phase] += monotonic_ns() - started;
+    }
+}
+
+// Helper function to start recording a command line, reusing the oldest ring slot
+void trace_begin_line(const char* line) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_current = &trace_ring[trace_next];
+    memset(trace_current, 0, sizeof(*trace_current));
+    snprintf(trace_current->command, sizeof(trace_current->command), "%.*s", (int)strcspn(line, "\n"), line);
+    trace_line_start = monotonic_ns();
+}
+
+// Helper function to finish the current line's record
+void trace_end_line(void) {
+    if (trace_current == NULL) {
+        return;
+    }
+    trace_current->total_ns = monotonic_ns() - trace_line_start;
+    trace_current = NULL;
+    trace_next = (trace_next + 1) % TRACE_RING_SIZE;
+    if (trace_count < TRACE_RING_SIZE) {
+        trace_count++;
+    }
+}
+
+// Helper function to record the time from shell start to the first prompt (or, without a
+// terminal, to the first read) as a "(startup)" entry of the trace ring
+void trace_startup(void) {
+    if (!trace_enabled || shell_start_ns == 0) {
+        return;
+    }
+    long long started = shell_start_ns;
+    shell_start_ns = 0;
+
+    trace_begin_line("(startup)");
+    trace_line_start = started;
+    trace_end_line();
+}
+
+// Helper function to add a child's CPU times to the waited totals
+void add_waited_rusage(const struct rusage* usage) {
+    timeradd(&waited_utime, &usage->ru_utime, &waited_utime);
+    timeradd(&waited_stime, &usage->ru_stime, &waited_stime);
+}
+
+// Helper function to wait for the running members of a foreground pipeline. codes[i] is -1
+// while member i runs and receives its exit code; returns 1 if the pipeline was stopped.
+int wait_for_pipeline(const pid_t* pids, int* codes, int n) {
+    int stopped = 0;
+    int interrupted = 0;
+    long long started = trace_start();
+
+    for (int i = 0; i < n; i++) {
+        if (codes[i] != -1) {
+            continue;
+        }
+
+        // wait4 also reports the CPU time the member used, for `time`
+        int status;
+        struct rusage usage;
+        pid_t waited;
+        do {
+            waited = wait4(pids[i], &status, job_control ? WUNTRACED : 0, &usage);
+        } while (waited == -1 && errno == EINTR);
+
+        if (waited > 0 && !WIFSTOPPED(status)) {
+            add_waited_rusage(&usage);
+        }
+        if (waited == -1) {
+            // Nothing else reaps foreground members, so this is a real failure
+            fprintf(stderr, "shell: wait for pid %d: %s\n", (int)pids[i], strerror(errno));
+            codes[i] = 127;
+        } else if (WIFSTOPPED(status)) {
+            stopped = 1;
+        } else {
+            codes[i] = status_to_exit_code(status);
+            interrupted |= WIFSIGNALED(status) && WTERMSIG(status) == SIGINT;
+        }
+    }
+
+    // Like other shells, end the line the ^C was echoed on before the next prompt
+    if (interrupted && job_control) {
+        printf("\n");
+    }
+    pipeline_interrupted |= interrupted;
+
+    trace_phase(TRACE_WAIT, started);
+    return stopped;
+}
+
+// Helper function to finish a foreground pipeline: wait for it, take the terminal back and
+// either record its exit codes or, if it was stopped (Ctrl-Z), turn it into a stopped job
+void wait_for_foreground(JobSystem* sys, const pid_t* pids, int* codes, int n, char** const* stage_argvs) {
+    int stopped = wait_for_pipeline(pids, codes, n);
+    give_terminal_to(shell_pgid);
+
+    if (!stopped) {
+        set_last_status(codes, n);
+        return;
+    }
+
+    // The display text is only needed once the pipeline becomes a job
+    Job* job = register_job(sys, pids, codes, n, build_job_command(stage_argvs, n));
+    if (job != NULL) {
+        job->is_stopped = 1;
+        printf("\n[%d]+ %-24s%s\n", job->job_id, "Stopped", job->command);
+    }
+    set_single_status(128 + SIGTSTP);
+}
+
+// Helper function to register context and retrieve it when needed
+JobSystem* get_set_job_context(JobSystem* new_sys) {
+    static JobSystem* saved_sys = NULL;
+    if (new_sys != NULL) {
+        saved_sys = new_sys;
+    }
+    return saved_sys;
+}
+
+// Helper function to allocate a fresh arena block able to hold at least min_size bytes
+ArenaBlock* new_arena_block(size_t min_size) {
+    size_t capacity = (min_size > ARENA_BLOCK_SIZE) ? min_size : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL) {
+        perror("new_arena_block: malloc failed");
+        return NULL;
+    }
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+    return block;
+}
+
+// Helper function to initialize an empty arena
+void arena_init(Arena* arena) {
+    arena->head = NULL;
+    arena->last_alloc = NULL;
+}
+
+// Helper function to carve size bytes (pointer aligned) out of the arena
+void* arena_alloc(Arena* arena, size_t size) {
+    ArenaBlock* block = arena->head;
+    if (block != NULL) {
+        size_t offset = (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + size <= block->capacity) {
+            block->used = offset + size;
+            arena->last_alloc = block->data + offset;
+            return arena->last_alloc;
+        }
+    }
+
+    block = new_arena_block(size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = arena->head;
+    block->used = size;
+    arena->head = block;
+    arena->last_alloc = block->data;
+    return arena->last_alloc;
+}
+
+// Helper function to grow or shrink an arena allocation, in place when it was the latest one
+void* arena_resize(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+    if (ptr != NULL && ptr == arena->last_alloc) {
+        ArenaBlock* block = arena->head;
+        size_t offset = (char*)ptr - block->data;
+        if (offset + new_size <= block->capacity) {
+            block->used = offset + new_size;
+            return ptr;
+        }
+    }
+
+    void* fresh = arena_alloc(arena, new_size);
+    if (fresh != NULL && ptr != NULL) {
+        memcpy(fresh, ptr, (old_size < new_size) ? old_size : new_size);
+    }
+    return fresh;
+}
+
+// Helper function to copy len bytes of a string into the arena
+char* arena_strndup(Arena* arena, const char* str, size_t len) {
+    char* copy = arena_alloc(arena, len + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Helper function to copy a string into the arena
+char* arena_strdup(Arena* arena, const char* str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Helper function to release every allocation at once, keeping the first block for reuse
+void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL && block->next != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block != NULL) {
+        block->used = 0;
+    }
+    arena->head = block;
+    arena->last_alloc = NULL;
+}
+
+// Helper function to give all arena memory back to the system
+void arena_free(Arena* arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+// Helper function to remember the arena's current fill level
+ArenaMark arena_mark(Arena* arena) {
+    ArenaMark mark = {arena->head, arena->head ? arena->head->used : 0};
+    return mark;
+}
+
+// Helper function to release everything allocated since mark was taken
+void arena_rewind(Arena* arena, ArenaMark mark) {
+    while (arena->head != mark.block) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    if (arena->head != NULL) {
+        arena->head->used = mark.used;
+    }
+    arena->last_alloc = NULL;
+}
+
+// Helper function to initialize argument buffer (inside arena when one is given)
+ArgBuffer* init_arg_buffer(Arena* arena) {
+    ArgBuffer* buf = arena ? arena_alloc(arena, sizeof(ArgBuffer)) : malloc(sizeof(ArgBuffer));
+    if (!buf) {
+        perror("init_arg_buffer: malloc failed for ArgBuffer");
+        return NULL;
+    }
+
+    buf->arena = arena;
+    buf->capacity = ARG_BUFFER_INITIAL_SIZE;
+    buf->length = 0;
+    buf->buffer = arena ? arena_alloc(arena, buf->capacity) : malloc(buf->capacity);
+    if (!buf->buffer) {
+        perror("init_arg_buffer: malloc failed for buffer");
+        if (!arena) {
+            free(buf);
+        }
+        return NULL;
+    }
+    buf->buffer[0] = '\0'; // Null-terminate an empty string
+
+    return buf;
+}
+
+// Helper function to make room for `extra` more bytes (plus terminator), doubling capacity as needed
+int reserve_arg_buffer(ArgBuffer* buf, size_t extra) {
+    if (buf->length + extra < buf->capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = buf->capacity * 2;
+    while (buf->length + extra >= new_capacity) {
+        new_capacity *= 2;
+    }
+
+    char* new_buffer = buf->arena
+        ? arena_resize(buf->arena, buf->buffer, buf->capacity, new_capacity)
+        : realloc(buf->buffer, new_capacity);
+    if (!new_buffer) {
+        perror("reserve_arg_buffer: realloc failed");
+        return -1;
+    }
+    buf->buffer = new_buffer;
+    buf->capacity = new_capacity;
+    return 0;
+}
+
+// Helper function to add character to argument buffer with dynamic resizing
+int add_char_to_buffer(ArgBuffer* buf, char c) {
+    if (reserve_arg_buffer(buf, 1) < 0) {
+        return -1;
+    }
+
+    buf->buffer[buf->length++] = c;
+    buf->buffer[buf->length] = '\0';
+    return 0;
+}
+
+// Helper function to append a run of bytes to argument buffer with a single copy
+int append_to_buffer(ArgBuffer* buf, const char* data, size_t len) {
+    if (reserve_arg_buffer(buf, len) < 0) {
+        return -1;
+    }
+
+    memcpy(buf->buffer + buf->length, data, len);
+    buf->length += len;
+    buf->buffer[buf->length] = '\0';
+    return 0;
+}
+
+// Helper function to hand out the built argument and restart an arena-backed buffer.
+// The finished string is trimmed in place, so it is never copied again.
+char* take_arg_buffer(ArgBuffer* buf) {
+    char* result = arena_resize(buf->arena, buf->buffer, buf->capacity, buf->length + 1);
+
+    buf->capacity = ARG_BUFFER_INITIAL_SIZE;
+    buf->length = 0;
+    buf->buffer = arena_alloc(buf->arena, buf->capacity);
+    if (result == NULL || buf->buffer == NULL) {
+        return NULL;
+    }
+    buf->buffer[0] = '\0';
+    return result;
+}
+
+// Helper function to free argument buffer (arena-backed buffers go away with the arena)
+void free_arg_buffer(ArgBuffer* buf) {
+    if (buf != NULL && buf->arena == NULL) {
+        free(buf->buffer);
+        free(buf);
+    }
+}
+
+// Helper function to append a token to the stream, growing the token array inside the arena
+Token* push_token(TokenList* list, TokenKind kind, int fd, const char* start, size_t length, Arena* arena) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 16;
+        Token* grown = arena_resize(arena, list->tokens, list->capacity * sizeof(Token), new_capacity * sizeof(Token));
+        if (grown == NULL) {
+            perror("push_token: allocation failed");
+            return NULL;
+        }
+        list->tokens = grown;
+        list->capacity = new_capacity;
+    }
+
+    Token* token = &list->tokens[list->count++];
+    token->kind = kind;
+    token->fd = fd;
+    token->text = NULL;
+    token->glob = NULL;
+    token->substs = NULL;
+    token->n_substs = 0;
+    token->params = NULL;
+    token->n_params = 0;
+    token->start = start;
+    token->length = length;
+    return token;
+}
+
+// Helper function to initialize an empty token stream in the arena
+TokenList* init_token_list(Arena* arena) {
+    TokenList* list = arena_alloc(arena, sizeof(TokenList));
+    if (list == NULL) {
+        perror("init_token_list: malloc failed");
+        return NULL;
+    }
+    list->tokens = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    return list;
+}
+
+// Helper function to remember that length bytes appended to the word at offset start were
+// quoted or escaped; a span continuing the previous one is merged into it
+int note_quoted_run(WordQuoting* quoting, size_t start, size_t length, Arena* arena) {
+    if (quoting->n_spans > 0 && quoting->spans[2 * quoting->n_spans - 1] == start) {
+        quoting->spans[2 * quoting->n_spans - 1] += length;
+        return 0;
+    }
+    if (quoting->n_spans == quoting->capacity) {
+        int new_capacity = quoting->capacity ? quoting->capacity * 2 : 4;
+        size_t* grown = arena_resize(arena, quoting->spans, quoting->capacity * 2 * sizeof(size_t), new_capacity * 2 * sizeof(size_t));
+        if (grown == NULL) {
+            perror("note_quoted_run: allocation failed");
+            return -1;
+        }
+        quoting->spans = grown;
+        quoting->capacity = new_capacity;
+    }
+    quoting->spans[2 * quoting->n_spans] = start;
+    quoting->spans[2 * quoting->n_spans + 1] = start + length;
+    quoting->n_spans++;
+    return 0;
+}
+
+// Helper function to measure the $NAME, ${NAME} or $? reference at ref: the number of
+// characters it covers, 0 when the '$' starts none
+size_t param_reference_length(const char* ref) {
+    const char* name = ref[1] == '{' ? ref + 2 : ref + 1;
+    const char* name_end = name;
+    if (*name == '?') {
+        name_end++;
+    } else {
+        while (isalnum((unsigned char)*name_end) || *name_end == '_') {
+            name_end++;
+        }
+    }
+    if (ref[1] != '{') {
+        return name_end == name ? 0 : name_end - ref;
+    }
+    return name_end - ref + (*name_end == '}'); // An unclosed ${NAME takes what it has
+}
+
+// Helper function to note the parameter reference the run at input (appended to the word
+// at offset start) begins with, if it begins with one
+int note_param_reference(WordQuoting* quoting, size_t start, const char* input, int quoted, Arena* arena) {
+    if (*input != '$') {
+        return 0;
+    }
+    size_t length = param_reference_length(input);
+    if (length == 0) {
+        return 0; // A '$' that starts no name stays literal
+    }
+    if (quoting->n_params == quoting->param_capacity) {
+        int new_capacity = quoting->param_capacity ? quoting->param_capacity * 2 : 4;
+        WordParam* grown = arena_resize(arena, quoting->params, quoting->param_capacity * sizeof(WordParam), new_capacity * sizeof(WordParam));
+        if (grown == NULL) {
+            perror("note_param_reference: allocation failed");
+            return -1;
+        }
+        quoting->params = grown;
+        quoting->param_capacity = new_capacity;
+    }
+    quoting->params[quoting->n_params++] = (WordParam){start, length, quoted};
+    return 0;
+}
+
+// Helper function to turn a word with unquoted glob characters into its pattern form:
+// the resolved text with every quoted glob special escaped by a backslash
+const char* build_glob_text(const char* text, const WordQuoting* quoting, Arena* arena) {
+    if (quoting->n_spans == 0) {
+        return text; // Nothing was quoted, so the text already is the pattern
+    }
+
+    size_t len = strlen(text);
+    char* pattern = arena_alloc(arena, 2 * len + 1);
+    if (pattern == NULL) {
+        return NULL;
+    }
+    size_t out = 0;
+    int span = 0;
+    for (size_t i = 0; i < len; i++) {
+        while (span < quoting->n_spans && quoting->spans[2 * span + 1] <= i) {
+            span++;
+        }
+        int quoted = span < quoting->n_spans && quoting->spans[2 * span] <= i;
+        if (quoted && strchr("*?[]\\", text[i]) != NULL) {
+            pattern[out++] = '\\';
+        }
+        pattern[out++] = text[i];
+    }
+    pattern[out] = '\0';
+    return pattern;
+}
+
+// Helper function to measure the command substitution starting at text, which points at
+// its "$(" or '`': the length up to and including the matching ')' or '`', or 0 when
+// the text ends first. Quotes, escapes and nested substitutions inside are skipped over.
+size_t command_substitution_length(const char* text) {
+    if (*text == '`') {
+        size_t i = 1;
+        while (text[i] != '`') {
+            if (text[i] == '\0' || (text[i] == '\\' && text[i + 1] == '\0')) {
+                return 0;
+            }
+            i += (text[i] == '\\') ? 2 : 1;
+        }
+        return i + 1;
+    }
+
+    int depth = 1;
+    size_t i = 2;
+    while (depth > 0) {
+        char c = text[i];
+        if (c == '\0') {
+            return 0;
+        } else if (c == '\\') {
+            if (text[i + 1] == '\0') {
+                return 0;
+            }
+            i += 2;
+        } else if (c == '\'') {
+            const char* close = strchr(text + i + 1, '\'');
+            if (close == NULL) {
+                return 0;
+            }
+            i = close - text + 1;
+        } else if (c == '"') {
+            for (i++; text[i] != '"'; i++) {
+                if (text[i] == '\0' || (text[i] == '\\' && text[i + 1] == '\0')) {
+                    return 0;
+                } else if (text[i] == '\\') {
+                    i++;
+                } else if (text[i] == '`' || (text[i] == '$' && text[i + 1] == '(')) {
+                    size_t inner = command_substitution_length(text + i);
+                    if (inner == 0) {
+                        return 0;
+                    }
+                    i += inner - 1;
+                }
+            }
+            i++;
+        } else if (c == '`' || (c == '$' && text[i + 1] == '(')) {
+            size_t inner = command_substitution_length(text + i);
+            if (inner == 0) {
+                return 0;
+            }
+            i += inner;
+        } else {
+            depth += (c == '(') - (c == ')');
+            i++;
+        }
+    }
+    return i;
+}
+
+// Helper function to extract the command of the substitution spanning raw[0..length):
+// the text between "$(" and ')' as is, or between backquotes with the backslashes that
+// escape '$', '`' and '\' removed
+char* command_substitution_source(const char* raw, size_t length, Arena* arena) {
+    if (*raw == '$') {
+        return arena_strndup(arena, raw + 2, length - 3);
+    }
+
+    char* command = arena_alloc(arena, length - 1);
+    if (command == NULL) {
+        return NULL;
+    }
+    size_t out = 0;
+    for (size_t i = 1; i < length - 1; i++) {
+        if (raw[i] == '\\' && strchr("$`\\", raw[i + 1]) != NULL) {
+            i++;
+        }
+        command[out++] = raw[i];
+    }
+    command[out] = '\0';
+    return command;
+}
+
+// Helper function to record a substitution of length raw characters at offset start of
+// the word's resolved text
+int note_command_substitution(WordSubst** substs, int* n_substs, int* capacity, size_t start, const char* raw, size_t length, int quoted, Arena* arena) {
+    if (*n_substs == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 2;
+        WordSubst* grown = arena_resize(arena, *substs, *capacity * sizeof(WordSubst), new_capacity * sizeof(WordSubst));
+        if (grown == NULL) {
+            perror("note_command_substitution: allocation failed");
+            return -1;
+        }
+        *substs = grown;
+        *capacity = new_capacity;
+    }
+
+    const char* command = command_substitution_source(raw, length, arena);
+    if (command == NULL) {
+        perror("note_command_substitution: allocation failed");
+        return -1;
+    }
+    (*substs)[(*n_substs)++] = (WordSubst){start, length, command, quoted};
+    return 0;
+}
+
+// Helper function to copy the command substitution at input_line + *pos into the word
+// being built, unresolved, and note where it is and whether double quotes keep its output
+// whole. Returns 0, 1 when the input ends before
+// it does and more lines may complete it, or -1 after reporting an error.
+int lex_command_substitution(const char* input_line, int* pos, ArgBuffer* buf, WordQuoting* quoting, int quoted, int at_eof, Arena* arena) {
+    const char* raw = input_line + *pos;
+    size_t length = command_substitution_length(raw);
+    if (length == 0) {
+        if (!at_eof) {
+            return 1;
+        }
+        fprintf(stderr, "shell: unexpected EOF while looking for matching `%c'\n", *raw == '`' ? '`' : ')');
+        return -1;
+    }
+
+    if (note_command_substitution(&quoting->substs, &quoting->n_substs, &quoting->subst_capacity, buf->length, raw, length, quoted, arena) < 0 ||
+        append_to_buffer(buf, raw, length) < 0) {
+        return -1;
+    }
+    *pos += length;
+    return 0;
+}
+
+// Helper function to find the parameter references and command substitutions in the text
+// of a word that was not lexed (an unquoted here-document body), as if it were double
+// quoted: a backslash before $, `, \ or a newline is dropped and the character after it
+// kept literal. The word's text is replaced by the result. Returns 0, or -1 on
+// allocation failure.
+int find_word_expansions(Token* word, Arena* arena) {
+    WordQuoting quoting = {NULL, 0, 0, 0, NULL, 0, 0, NULL, 0, 0};
+    const char* text = word->text;
+    char* out = arena_alloc(arena, strlen(text) + 1);
+    if (out == NULL) {
+        perror("find_word_expansions: allocation failed");
+        return -1;
+    }
+    size_t used = 0;
+    const char* p = text;
+    while (*p != '\0') {
+        size_t run = strcspn(p, "$`\\");
+        memcpy(out + used, p, run);
+        used += run;
+        p += run;
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == '\\') {
+            if (p[1] == '$' || p[1] == '`' || p[1] == '\\') {
+                out[used++] = p[1];
+                p += 2;
+            } else if (p[1] == '\n') {
+                p += 2;
+            } else {
+                out[used++] = *p++;
+            }
+            continue;
+        }
+
+        size_t length = *p == '$' && p[1] != '(' ? 0 : command_substitution_length(p);
+        if (length > 0) {
+            if (note_command_substitution(&quoting.substs, &quoting.n_substs, &quoting.subst_capacity, used, p, length, 1, arena) < 0) {
+                return -1;
+            }
+        } else if (*p == '$') {
+            length = param_reference_length(p);
+            if (length > 0 && note_param_reference(&quoting, used, p, 1, arena) < 0) {
+                return -1;
+            }
+            length += length == 0;
+        } else {
+            length = strlen(p); // Unterminated: the rest stays literal
+        }
+        memcpy(out + used, p, length);
+        used += length;
+        p += length;
+    }
+    out[used] = '\0';
+    word->text = out;
+    word->substs = quoting.substs;
+    word->n_substs = quoting.n_substs;
+    word->params = quoting.params;
+    word->n_params = quoting.n_params;
+    return 0;
+}
+
+// Helper function to finalize the word being built (if any) as a WORD token.
+// word_start is the offset where the word began in the input, or -1 when no word is open.
+int flush_word(ArgBuffer* buf, WordQuoting* quoting, TokenList* list, const char* input_line, int* word_start, int end, Arena* arena) {
+    if (*word_start < 0) {
+        return 0;
+    }
+
+    Token* token = push_token(list, TOKEN_WORD, -1, input_line + *word_start, end - *word_start, arena);
+    if (token == NULL) {
+        return -1;
+    }
+    token->text = take_arg_buffer(buf);
+    if (token->text == NULL) {
+        perror("parse_arguments: allocation failed for word");
+        return -1;
+    }
+    if (quoting->has_glob && (token->glob = build_glob_text(token->text, quoting, arena)) == NULL) {
+        perror("parse_arguments: allocation failed for word");
+        return -1;
+    }
+
+    // The substitution and reference lists now belong to the token; the next word starts its own
+    token->substs = quoting->substs;
+    token->n_substs = quoting->n_substs;
+    token->params = quoting->params;
+    token->n_params = quoting->n_params;
+    quoting->substs = NULL;
+    quoting->n_substs = 0;
+    quoting->subst_capacity = 0;
+    quoting->params = NULL;
+    quoting->n_params = 0;
+    quoting->param_capacity = 0;
+    quoting->n_spans = 0;
+    quoting->has_glob = 0;
+    *word_start = -1;
+    return 0;
+}
+
+// Helper function to collect the bodies of the here-documents opened since token
+// *pending, from the lines starting at input_line + *pos. Each body is stored as the
+// HEREDOC token's text and *pos moves past its delimiter line. Returns 0, 1 when the
+// input ends before a delimiter (more lines are needed), or -1 on allocation failure.
+int read_heredoc_bodies(TokenList* list, int* pending, const char* input_line, int* pos, int at_eof, Arena* arena) {
+    for (; *pending < list->count; (*pending)++) {
+        Token* op = &list->tokens[*pending];
+        if (op->kind != TOKEN_HEREDOC || op->text != NULL || *pending + 1 >= list->count ||
+            list->tokens[*pending + 1].kind != TOKEN_WORD) {
+            continue;
+        }
+        const char* delimiter = list->tokens[*pending + 1].text;
+        int strip_tabs = op->start[op->length - 1] == '-';
+
+        ArgBuffer* body = init_arg_buffer(arena);
+        if (body == NULL) {
+            return -1;
+        }
+        while (1) {
+            const char* line = input_line + *pos;
+            if (*line == '\0') {
+                if (!at_eof) {
+                    return 1;
+                }
+                fprintf(stderr, "shell: warning: here-document delimited by end-of-file (wanted `%s')\n", delimiter);
+                break;
+            }
+
+            const char* newline = strchr(line, '\n');
+            size_t line_length = newline ? (size_t)(newline - line) : strlen(line);
+            *pos += line_length + (newline != NULL);
+            if (strip_tabs) {
+                // strspn stops at the newline, so this never runs past the line
+                size_t tabs = strspn(line, "\t");
+                line += tabs;
+                line_length -= tabs;
+            }
+            if (line_length == strlen(delimiter) && memcmp(line, delimiter, line_length) == 0) {
+                break;
+            }
+            if (append_to_buffer(body, line, line_length) < 0 || add_char_to_buffer(body, '\n') < 0) {
+                return -1;
+            }
+        }
+
+        op->text = take_arg_buffer(body);
+        if (op->text == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to lex input text into a typed token stream in a single pass.
+// Quotes and escapes are resolved into WORD text; only unquoted operator characters
+// produce operator tokens, and '#' at the start of a word begins a comment. Here-document
+// bodies are taken from the lines after the one that opens them. Sets *incomplete (and
+// returns NULL) when the text ends inside a here-document and at_eof is not set.
+// Everything lives in the arena.
+TokenList* parse_arguments(const char* input_line, int at_eof, int* incomplete, Arena* arena) {
+    *incomplete = 0;
+    TokenList* list = init_token_list(arena);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    ParseState state = {0, 0}; // Initialize state: not in single or double quotes
+    WordQuoting quoting = {NULL, 0, 0, 0, NULL, 0, 0, NULL, 0, 0}; // Quoted parts and substitutions of the word being built
+    ArgBuffer* current_arg_buffer = init_arg_buffer(arena);
+    if (!current_arg_buffer) {
+        return NULL;
+    }
+
+    int i = 0; // Current position in input_line
+    int word_start = -1; // Offset where the word being built began, -1 when none
+    int pending_heredoc = 0; // First token that may still be a here-document without a body
+
+    while (input_line[i] != '\0') {
+        char current_char = input_line[i];
+
+        if (state.in_single_quote) {
+            if (current_char == '\'') {
+                state.in_single_quote = 0; // End single quote
+                i++; // Consume the quote, do NOT add to buffer
+            } else {
+                // In single quotes, ALL characters are literal: copy up to the closing quote at once
+                size_t run = strcspn(input_line + i, "'");
+                if (note_quoted_run(&quoting, current_arg_buffer->length, run, arena) < 0 ||
+                    append_to_buffer(current_arg_buffer, input_line + i, run) < 0) {
+                    return NULL;
+                }
+                i += run;
+            }
+        } else if (state.in_double_quote) {
+            if (current_char == '"') {
+                state.in_double_quote = 0; // End double quote
+                i++; // Consume the quote, do NOT add to buffer
+            } else if (current_char == '\\') {
+                i++; // Advance past the backslash to the character being (potentially) escaped
+
+                if (input_line[i] == '\0') {
+                    // Trailing backslash in double quotes -> literal backslash
+                    if (note_quoted_run(&quoting, current_arg_buffer->length, 1, arena) < 0 ||
+                        add_char_to_buffer(current_arg_buffer, '\\') < 0) {
+                        return NULL;
+                    }
+                    break;
+                } else if (input_line[i] == '"' || input_line[i] == '\\' ||
+                           input_line[i] == '$' || input_line[i] == '`') {
+                    // Specific characters: \ escapes these, the backslash is removed, char is literal.
+                    if (note_quoted_run(&quoting, current_arg_buffer->length, 1, arena) < 0 ||
+                        add_char_to_buffer(current_arg_buffer, input_line[i]) < 0) {
+                        return NULL;
+                    }
+                } else {
+                    // For all other characters (like `\n`, `\5`, `\t`, `\X` etc.):
+                    // The backslash itself is preserved as a literal character,
+                    // followed by the next character, also as a literal.
+                    if (note_quoted_run(&quoting, current_arg_buffer->length, 2, arena) < 0 ||
+                        add_char_to_buffer(current_arg_buffer, '\\') < 0 ||
+                        add_char_to_buffer(current_arg_buffer, input_line[i]) < 0) {
+                        return NULL;
+                    }
+                }
+                i++; // Advance past the character that was (or wasn't) escaped
+            } else if ((current_char == '$' && input_line[i + 1] == '(') || current_char == '`') {
+                int result = lex_command_substitution(input_line, &i, current_arg_buffer, &quoting, state.in_double_quote, at_eof, arena);
+                if (result != 0) {
+                    *incomplete = (result == 1);
+                    return NULL;
+                }
+            } else {
+                // Regular characters in double quotes: copy the run up to the next quote,
+                // backslash or possible substitution (a '$' that starts none is copied too)
+                size_t run = 1 + strcspn(input_line + i + 1, DQUOTE_SPECIAL_CHARS);
+                if (note_quoted_run(&quoting, current_arg_buffer->length, run, arena) < 0 ||
+                    note_param_reference(&quoting, current_arg_buffer->length, input_line + i, 1, arena) < 0 ||
+                    append_to_buffer(current_arg_buffer, input_line + i, run) < 0) {
+                    return NULL;
+                }
+                i += run;
+            }
+        } else if (current_char == '\n') {
+            // Unquoted line break: ends the command, then any here-document bodies follow
+            if (flush_word(current_arg_buffer, &quoting, list, input_line, &word_start, i, arena) < 0 ||
+                push_token(list, TOKEN_NEWLINE, -1, input_line + i, 1, arena) == NULL) {
+                return NULL;
+            }
+            i++;
+            int result = read_heredoc_bodies(list, &pending_heredoc, input_line, &i, at_eof, arena);
+            if (result != 0) {
+                *incomplete = (result == 1);
+                return NULL;
+            }
+        } else if (isspace((unsigned char)current_char)) {
+            // Whitespace (always separates words)
+            if (flush_word(current_arg_buffer, &quoting, list, input_line, &word_start, i, arena) < 0) {
+                return NULL;
+            }
+            i++;
+        } else if (word_start < 0 && current_char == '#') {
+            // Comment: skip to the end of the line, leaving the line break itself
+            i += strcspn(input_line + i, "\n");
+        } else if (current_char == '|' || current_char == '&' || current_char == '<' || current_char == '>' || current_char == ';' ||
+                   (word_start < 0 && isdigit((unsigned char)current_char) && (input_line[i+1] == '>' || input_line[i+1] == '<'))) {
+            // Operators: a leading fd digit only counts when it starts a new word (e.g. "2>")
+            if (flush_word(current_arg_buffer, &quoting, list, input_line, &word_start, i, arena) < 0) {
+                return NULL;
+            }
+
+            int op_start = i;
+            TokenKind kind;
+            int fd = -1;
+
+            if (current_char == '|') {
+                kind = TOKEN_PIPE;
+                i++;
+                if (input_line[i] == '|') {
+                    kind = TOKEN_OR;
+                    i++;
+                }
+            } else if (current_char == '&') {
+                kind = TOKEN_AMP;
+                i++;
+                if (input_line[i] == '&') {
+                    kind = TOKEN_AND;
+                    i++;
+                }
+            } else if (current_char == ';') {
+                kind = TOKEN_SEMI;
+                i++;
+            } else {
+                if (isdigit((unsigned char)current_char)) {
+                    fd = current_char - '0';
+                    i++; // Consume the fd digit
+                }
+                char op = input_line[i++];
+                if (op == '>') {
+                    fd = (fd == -1) ? STDOUT_FILENO : fd;
+                    kind = TOKEN_REDIR_OUT;
+                    if (input_line[i] == '>') {
+                        kind = TOKEN_REDIR_APPEND;
+                        i++;
+                    } else if (input_line[i] == '&') {
+                        kind = TOKEN_REDIR_DUP;
+                        i++;
+                    }
+                } else {
+                    fd = (fd == -1) ? STDIN_FILENO : fd;
+                    kind = TOKEN_REDIR_IN;
+                    if (input_line[i] == '<' && input_line[i+1] == '<') {
+                        kind = TOKEN_HERESTRING;
+                        i += 2;
+                    } else if (input_line[i] == '<') {
+                        kind = TOKEN_HEREDOC;
+                        i++;
+                        if (input_line[i] == '-') {
+                            i++; // <<- strips leading tabs from the body
+                        }
+                    } else if (input_line[i] == '&') {
+                        kind = TOKEN_REDIR_DUP;
+                        i++;
+                    }
+                }
+            }
+
+            if (push_token(list, kind, fd, input_line + op_start, i - op_start, arena) == NULL) {
+                return NULL;
+            }
+        } else {
+            // Anything else opens (or continues) a word
+            if (word_start < 0) {
+                word_start = i;
+            }
+
+            if (current_char == '\\') {
+                i++; // Advance past the backslash to the character it's escaping
+                if (input_line[i] == '\0') {
+                    // Trailing backslash unquoted is literal (e.g., `cmd arg\`)
+                    if (note_quoted_run(&quoting, current_arg_buffer->length, 1, arena) < 0 ||
+                        add_char_to_buffer(current_arg_buffer, '\\') < 0) {
+                        return NULL;
+                    }
+                    break;
+                }
+                // Non-quoted backslash escapes the next character.
+                if (note_quoted_run(&quoting, current_arg_buffer->length, 1, arena) < 0 ||
+                    add_char_to_buffer(current_arg_buffer, input_line[i]) < 0) {
+                    return NULL;
+                }
+                i++; // Advance past the escaped character
+            } else if (current_char == '\'') {
+                state.in_single_quote = 1; // Enter single quote (don't add quote to buffer)
+                i++;
+            } else if (current_char == '"') {
+                state.in_double_quote = 1; // Enter double quote (don't add quote to buffer)
+                i++;
+            } else if ((current_char == '$' && input_line[i + 1] == '(') || current_char == '`') {
+                int result = lex_command_substitution(input_line, &i, current_arg_buffer, &quoting, state.in_double_quote, at_eof, arena);
+                if (result != 0) {
+                    *incomplete = (result == 1);
+                    return NULL;
+                }
+            } else {
+                // Regular characters (builds a word): copy the run up to the next character
+                // that quotes, escapes, separates, starts an operator or may start a
+                // substitution. Inside a word a digit or '#' is ordinary, so only the first
+                // character needed the checks above (and a '$' that starts none is copied).
+                size_t run = 1 + strcspn(input_line + i + 1, WORD_SPECIAL_CHARS);
+                if (!quoting.has_glob && (memchr(input_line + i, '*', run) || memchr(input_line + i, '?', run) ||
+                                          memchr(input_line + i, '[', run))) {
+                    quoting.has_glob = 1;
+                }
+                if (note_param_reference(&quoting, current_arg_buffer->length, input_line + i, 0, arena) < 0 ||
+                    append_to_buffer(current_arg_buffer, input_line + i, run) < 0) {
+                    return NULL;
+                }
+                i += run;
+            }
+        }
+    }
+
+    // Check for unterminated quotes at the end of the line
+    if (state.in_single_quote || state.in_double_quote) {
+        fprintf(stderr, "shell: unterminated quote\n");
+        return NULL; // Return NULL to indicate a parsing error
+    }
+
+    // After loop, add any remaining content in the buffer as the last word
+    if (flush_word(current_arg_buffer, &quoting, list, input_line, &word_start, i, arena) < 0) {
+        return NULL;
+    }
+
+    // A here-document opened on the last line still needs its body
+    int result = read_heredoc_bodies(list, &pending_heredoc, input_line, &i, at_eof, arena);
+    if (result != 0) {
+        *incomplete = (result == 1);
+        return NULL;
+    }
+
+    return list;
+}
+
+// Helper function to initialize redirection information with room for max_ops operations
+RedirectionInfo* init_redirection_info(int max_ops, Arena* arena) {
+    RedirectionInfo* redir = arena_alloc(arena, sizeof(RedirectionInfo));
+    if (redir == NULL) {
+        perror("init_redirection_info: malloc failed");
+        return NULL;
+    }
+    redir->count = 0;
+    redir->ops = NULL;
+    if (max_ops > 0) {
+        redir->ops = arena_alloc(arena, max_ops * sizeof(RedirOp));
+        if (redir->ops == NULL) {
+            perror("init_redirection_info: malloc failed");
+            return NULL;
+        }
+    }
+
+    return redir;
+}
+
+// Helper function to append an operation targeting fd; the remaining fields start empty
+RedirOp* add_redirection_op(RedirectionInfo* redir, RedirKind kind, int fd) {
+    RedirOp* op = &redir->ops[redir->count++];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    op->fd = fd;
+    op->source_fd = -1;
+    op->ready_fd = -1;
+    op->saved_fd = -2;
+    return op;
+}
+
+// Helper function to hash len bytes of a string (FNV-1a)
+unsigned int hash_bytes(const char* str, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Helper function to hash a command name into a bucket index
+unsigned int hash_command_name(const char* name) {
+    return hash_bytes(name, strlen(name)) & (HASH_BUCKETS - 1);
+}
+
+// Helper function to forget every remembered command location
+void command_hash_clear(CommandHash* table) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        HashedCommand* entry = table->buckets[i];
+        while (entry != NULL) {
+            HashedCommand* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        table->buckets[i] = NULL;
+    }
+    table->count = 0;
+}
+
+// Helper function to drop the whole table if PATH changed since it was filled
+void command_hash_check_path(CommandHash* table) {
+    const char* path_env = shell_getenv("PATH");
+
+    if (table->path_snapshot != NULL && path_env != NULL && strcmp(table->path_snapshot, path_env) == 0) {
+        return;
+    }
+    if (table->path_snapshot == NULL && path_env == NULL) {
+        return;
+    }
+
+    command_hash_clear(table);
+    free(table->path_snapshot);
+    table->path_snapshot = path_env ? strdup(path_env) : NULL;
+}
+
+// Helper function to look up a remembered command location
+HashedCommand* command_hash_lookup(CommandHash* table, const char* name) {
+    HashedCommand* entry = table->buckets[hash_command_name(name)];
+    while (entry != NULL) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+// Helper function to remember (or replace) the location of a command
+HashedCommand* command_hash_insert(CommandHash* table, const char* name, const char* path, int hits) {
+    HashedCommand* entry = command_hash_lookup(table, name);
+    if (entry != NULL) {
+        char* new_path = strdup(path);
+        if (new_path == NULL) {
+            perror("command_hash_insert: strdup failed");
+            return NULL;
+        }
+        free(entry->path);
+        entry->path = new_path;
+        entry->hits = hits;
+        return entry;
+    }
+
+    entry = malloc(sizeof(HashedCommand));
+    if (entry == NULL) {
+        perror("command_hash_insert: malloc failed");
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    if (entry->name == NULL || entry->path == NULL) {
+        perror("command_hash_insert: strdup failed");
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    entry->hits = hits;
+
+    unsigned int bucket = hash_command_name(name);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->count++;
+    return entry;
+}
+
+// Helper function to forget a single command, e.g. after its file vanished
+void command_hash_remove(CommandHash* table, const char* name) {
+    HashedCommand** link = &table->buckets[hash_command_name(name)];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            HashedCommand* entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            table->count--;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+// Helper function to compare two C strings for qsort/bsearch
+int compare_strings(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// Helper function to order index entries by name, then by PATH position
+int compare_exe_entries(const void* a, const void* b) {
+    const ExeIndexEntry* x = a;
+    const ExeIndexEntry* y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->dir_idx - y->dir_idx;
+}
+
+// Helper function to drop the directory list of the executable index
+void free_exe_index_dirs(ExeIndex* index) {
+    for (int i = 0; i < index->n_dirs; i++) {
+        free(index->dirs[i].path);
+        free(index->dirs[i].names);
+        arena_free(&index->dirs[i].name_pool);
+    }
+    free(index->dirs);
+    index->dirs = NULL;
+    index->n_dirs = 0;
+}
+
+// Helper function to re-split PATH into index directories, only when PATH changed.
+// Returns 1 when the directory list was rebuilt, 0 when it was already current.
+int sync_exe_index_dirs(ExeIndex* index) {
+    const char* path_env = shell_getenv("PATH");
+    if (index->path_snapshot != NULL && path_env != NULL && strcmp(index->path_snapshot, path_env) == 0) {
+        return 0;
+    }
+    if (index->path_snapshot == NULL && path_env == NULL && index->is_built) {
+        return 0;
+    }
+
+    free_exe_index_dirs(index);
+    free(index->path_snapshot);
+    index->path_snapshot = path_env ? strdup(path_env) : NULL;
+    index->is_built = 0;
+
+    if (index->path_snapshot == NULL) {
+        return 1;
+    }
+
+    int count = 1;
+    for (const char* p = index->path_snapshot; *p != '\0'; p++) {
+        if (*p == ':') {
+            count++;
+        }
+    }
+
+    index->dirs = calloc(count, sizeof(IndexedDir));
+    if (index->dirs == NULL) {
+        perror("sync_exe_index_dirs: calloc failed");
+        return 1;
+    }
+
+    const char* start = index->path_snapshot;
+    while (1) {
+        const char* colon = strchr(start, ':');
+        size_t len = colon ? (size_t)(colon - start) : strlen(start);
+
+        // Empty components are skipped, matching the PATH scan
+        if (len > 0) {
+            IndexedDir* dir = &index->dirs[index->n_dirs++];
+            dir->path = strndup(start, len);
+            arena_init(&dir->name_pool);
+        }
+
+        if (colon == NULL) {
+            break;
+        }
+        start = colon + 1;
+    }
+    return 1;
+}
+
+// Helper function to forget hashed commands that a rescanned directory no longer provides
+void evict_stale_hashed_commands(IndexedDir* dir) {
+    size_t dir_len = strlen(dir->path);
+
+    for (int b = 0; b < HASH_BUCKETS; b++) {
+        HashedCommand* entry = command_hash.buckets[b];
+        while (entry != NULL) {
+            HashedCommand* next = entry->next;
+            if (strncmp(entry->path, dir->path, dir_len) == 0 && entry->path[dir_len] == '/' &&
+                strcmp(entry->path + dir_len + 1, entry->name) == 0 &&
+                bsearch(&entry->name, dir->names, dir->n_names, sizeof(char*), compare_strings) == NULL) {
+                command_hash_remove(&command_hash, entry->name);
+            }
+            entry = next;
+        }
+    }
+}
+
+// Helper function to (re)read the executables of one PATH directory
+void scan_indexed_dir(IndexedDir* dir) {
+    arena_reset(&dir->name_pool);
+    dir->n_names = 0;
+
+    DIR* dirp = opendir(dir->path);
+    if (dirp == NULL) {
+        return;
+    }
+
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (entry->d_type == DT_DIR || faccessat(dirfd(dirp), entry->d_name, X_OK, 0) != 0) {
+            continue;
+        }
+
+        if (dir->n_names == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            char** grown = realloc(dir->names, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                perror("scan_indexed_dir: realloc failed");
+                break;
+            }
+            dir->names = grown;
+            capacity = new_capacity;
+        }
+
+        char* name = arena_strdup(&dir->name_pool, entry->d_name);
+        if (name == NULL) {
+            break;
+        }
+        dir->names[dir->n_names++] = name;
+    }
+    closedir(dirp);
+
+    qsort(dir->names, dir->n_names, sizeof(char*), compare_strings);
+    evict_stale_hashed_commands(dir);
+}
+
+// Helper function to merge builtins and all directory listings into one sorted, de-duplicated array
+void rebuild_exe_index_entries(ExeIndex* index) {
+    int n_builtins = 0;
+    while (builtin_table[n_builtins].name != NULL) {
+        n_builtins++;
+    }
+    int total = n_builtins;
+    for (int i = 0; i < index->n_dirs; i++) {
+        total += index->dirs[i].n_names;
+    }
+
+    ExeIndexEntry* entries = malloc((total > 0 ? total : 1) * sizeof(ExeIndexEntry));
+    if (entries == NULL) {
+        perror("rebuild_exe_index_entries: malloc failed");
+        return;
+    }
+
+    int n = 0;
+    for (int i = 0; i < n_builtins; i++) {
+        entries[n++] = (ExeIndexEntry){builtin_table[i].name, -1, 1};
+    }
+    for (int d = 0; d < index->n_dirs; d++) {
+        for (int j = 0; j < index->dirs[d].n_names; j++) {
+            entries[n++] = (ExeIndexEntry){index->dirs[d].names[j], d, 0};
+        }
+    }
+    qsort(entries, n, sizeof(ExeIndexEntry), compare_exe_entries);
+
+    // Collapse duplicates, keeping the earliest PATH directory (builtins sort first)
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        if (out > 0 && strcmp(entries[out - 1].name, entries[i].name) == 0) {
+            if (entries[out - 1].dir_idx < 0) {
+                entries[out - 1].dir_idx = entries[i].dir_idx;
+            }
+            entries[out - 1].is_builtin |= entries[i].is_builtin;
+            continue;
+        }
+        entries[out++] = entries[i];
+    }
+
+    free(index->entries);
+    index->entries = entries;
+    index->count = out;
+}
+
+// Helper function to bring the executable index up to date, rereading only
+// directories whose modification time changed since they were last read
+void refresh_exe_index(ExeIndex* index) {
+    int changed = sync_exe_index_dirs(index) || !index->is_built;
+
+    for (int i = 0; i < index->n_dirs; i++) {
+        IndexedDir* dir = &index->dirs[i];
+        struct stat st;
+
+        if (stat(dir->path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            if (dir->exists) {
+                dir->exists = 0;
+                dir->n_names = 0;
+                arena_reset(&dir->name_pool);
+                evict_stale_hashed_commands(dir);
+                changed = 1;
+            }
+            continue;
+        }
+
+        if (!dir->exists || st.st_mtim.tv_sec != dir->mtime.tv_sec || st.st_mtim.tv_nsec != dir->mtime.tv_nsec) {
+            scan_indexed_dir(dir);
+            dir->mtime = st.st_mtim;
+            dir->exists = 1;
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        rebuild_exe_index_entries(index);
+        index->is_built = 1;
+    }
+}
+
+// Helper function to find the first index entry not ordered before prefix (binary search)
+int exe_index_lower_bound(ExeIndex* index, const char* prefix) {
+    int lo = 0;
+    int hi = index->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(index->entries[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Helper function to scan PATH directories for an executable (uncached).
+// The directory list is split once per PATH value and shared with the executable index.
+char* search_path_for_exe(const char* exe) {
+    sync_exe_index_dirs(&exe_index);
+
+    for (int i = 0; i < exe_index.n_dirs; i++) {
+        char fullPath[PATH_MAX];
+        int ret = snprintf(fullPath, sizeof(fullPath), "%s/%s", exe_index.dirs[i].path, exe);
+
+        // X_OK already implies the file exists, so one access() per directory is enough
+        if (ret < (int)sizeof(fullPath) && access(fullPath, X_OK) == 0) {
+            return strdup(fullPath);
+        }
+    }
+
+    return NULL;
+}
+
+// Helper function to resolve a command name, consulting the command hash first
+char* lookup_exe_in_path(const char* exe) {
+    // If it's an absolute or relative path (contains '/'), don't search PATH
+    if (strchr(exe, '/') != NULL) {
+        if (access(exe, X_OK) == 0) {
+            return strdup(exe);
+        }
+        return NULL;
+    }
+
+    command_hash_check_path(&command_hash);
+
+    HashedCommand* entry = command_hash_lookup(&command_hash, exe);
+    if (entry != NULL) {
+        entry->hits++;
+        return strdup(entry->path);
+    }
+
+    char* result = search_path_for_exe(exe);
+    if (result != NULL) {
+        command_hash_insert(&command_hash, exe, result, 1);
+    }
+    return result;
+}
+
+// Helper function to find if executable exists in PATH
+char* find_exe_in_path(const char* exe) {
+    long long started = trace_start();
+    char* result = lookup_exe_in_path(exe);
+    trace_phase(TRACE_LOOKUP, started);
+    return result;
+}
+
+// Helper function to handle `hash` commands; returns 1 when a name is not found
+int handle_hash_cmd(char** argv) {
+    command_hash_check_path(&command_hash);
+
+    if (argv[1] == NULL) {
+        if (command_hash.count == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+
+        printf("hits\tcommand\n");
+        for (int i = 0; i < HASH_BUCKETS; i++) {
+            for (HashedCommand* entry = command_hash.buckets[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-r") == 0) {
+        // The -r Flag: Forget all remembered locations
+        command_hash_clear(&command_hash);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-p") == 0) {
+        // The -p Flag: Use the given path as the location of name
+        if (argv[2] == NULL || argv[3] == NULL) {
+            fprintf(stderr, "hash: usage: hash [-r] [-p pathname] [name ...]\n");
+            return 1;
+        }
+        command_hash_insert(&command_hash, argv[3], argv[2], 0);
+        return 0;
+    }
+
+    // Otherwise look up each name and remember where it was found
+    int status = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strchr(argv[i], '/') != NULL) {
+            continue;
+        }
+
+        char* path = search_path_for_exe(argv[i]);
+        if (path == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        command_hash_insert(&command_hash, argv[i], path, 0);
+        free(path);
+    }
+    return status;
+}
+
+// Helper function to check whether a descriptor refers to a pipe or FIFO
+int fd_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Helper function to check whether a descriptor refers to a regular file
+int fd_is_regular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Helper function to write a whole buffer, retrying short writes
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper function to move exactly len bytes out of a pipe with splice, -1 on error
+int splice_exact(int pipe_fd, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper function to copy in_fd to out_fd until EOF without passing the data through user
+// space when the kernel allows it: splice when either side is a pipe, copy_file_range
+// between regular files, sendfile from a regular file, and read/write otherwise.
+// Returns the number of bytes moved, or -1 with errno set.
+long long move_fd_data(int in_fd, int out_fd) {
+    long long total = 0;
+    int in_pipe = fd_is_pipe(in_fd);
+    int out_pipe = fd_is_pipe(out_fd);
+    int in_regular = fd_is_regular(in_fd);
+
+    if (in_pipe || out_pipe) {
+        while (1) {
+            ssize_t n = splice(in_fd, NULL, out_fd, NULL, IO_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                return total;
+            }
+            if (n == -1) {
+                // The other side does not support splice; nothing was moved yet this round
+                if ((errno == EINVAL || errno == ENOSYS) && total == 0) {
+                    break;
+                }
+                return -1;
+            }
+            total += n;
+        }
+    } else if (in_regular && fd_is_regular(out_fd)) {
+        while (1) {
+            ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, IO_CHUNK_SIZE * 16, 0);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                return total;
+            }
+            if (n == -1) {
+                if ((errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) && total == 0) {
+                    break;
+                }
+                return -1;
+            }
+            total += n;
+        }
+    } else if (in_regular) {
+        while (1) {
+            ssize_t n = sendfile(out_fd, in_fd, NULL, IO_CHUNK_SIZE * 16);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                return total;
+            }
+            if (n == -1) {
+                if ((errno == EINVAL || errno == ENOSYS) && total == 0) {
+                    break;
+                }
+                return -1;
+            }
+            total += n;
+        }
+    }
+
+    // Portable fallback through a user-space buffer
+    char buffer[IO_CHUNK_SIZE];
+    while (1) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            return total;
+        }
+        if (n == -1 || write_all(out_fd, buffer, n) != 0) {
+            return -1;
+        }
+        total += n;
+    }
+}
+
+// Helper function to fan a pipe out to several sinks without copying through user space.
+// Each chunk is duplicated with tee(2) into a scratch pipe for every sink but the last,
+// and finally spliced (consumed) into the last sink. Returns 0, or -1 with errno set.
+int fan_out_pipe(int in_fd, const int* sinks, int n_sinks) {
+    int scratch[2];
+    if (n_sinks > 1 && pipe2(scratch, O_CLOEXEC) == -1) {
+        return -1;
+    }
+
+    int result = 0;
+    while (1) {
+        ssize_t n;
+        if (n_sinks > 1) {
+            // Peek at the next chunk: the data stays in in_fd and a copy lands in scratch
+            n = tee(in_fd, scratch[1], IO_CHUNK_SIZE, 0);
+        } else {
+            n = splice(in_fd, NULL, sinks[0], NULL, IO_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = (int)(n < 0 ? -1 : 0);
+            break;
+        }
+        if (n_sinks == 1) {
+            continue;
+        }
+
+        if (splice_exact(scratch[0], sinks[0], n) != 0) {
+            result = -1;
+            break;
+        }
+        for (int s = 1; s < n_sinks - 1; s++) {
+            ssize_t copied;
+            do {
+                copied = tee(in_fd, scratch[1], n, 0);
+            } while (copied == -1 && errno == EINTR);
+            if (copied != n || splice_exact(scratch[0], sinks[s], n) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        if (result != 0 || splice_exact(in_fd, sinks[n_sinks - 1], n) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    if (n_sinks > 1) {
+        int saved_errno = errno;
+        close(scratch[0]);
+        close(scratch[1]);
+        errno = saved_errno;
+    }
+    return result;
+}
+
+// Helper function to handle `tee` commands: copy stdin to stdout and to every file given,
+// appending with -a. Uses tee(2)/splice(2) when stdin is a pipe.
+int handle_tee_cmd(char** argv) {
+    int append = 0;
+    int a = 1;
+    if (argv[a] != NULL && strcmp(argv[a], "-a") == 0) {
+        append = 1;
+        a++;
+    }
+
+    int n_files = 0;
+    for (int i = a; argv[i] != NULL; i++) {
+        n_files++;
+    }
+
+    int* sinks = malloc((n_files + 1) * sizeof(int));
+    if (sinks == NULL) {
+        perror("tee: malloc failed");
+        return 1;
+    }
+
+    int code = 0;
+    int n_sinks = 0;
+    flush_builtin_output();
+    sinks[n_sinks++] = STDOUT_FILENO;
+    for (int i = a; argv[i] != NULL; i++) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+        int fd = open(argv[i], flags, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+            code = 1;
+            continue;
+        }
+        sinks[n_sinks++] = fd;
+    }
+
+    // splice(2) only writes into pipes and non-append regular files, so terminals, sockets
+    // and O_APPEND files take the buffered path
+    int can_splice = fd_is_pipe(STDIN_FILENO);
+    for (int s = 0; s < n_sinks && can_splice; s++) {
+        int flags = fcntl(sinks[s], F_GETFL);
+        can_splice = flags != -1 && !(flags & O_APPEND) && (fd_is_pipe(sinks[s]) || fd_is_regular(sinks[s]));
+    }
+
+    int moved;
+    if (can_splice) {
+        moved = fan_out_pipe(STDIN_FILENO, sinks, n_sinks);
+    } else {
+        char buffer[IO_CHUNK_SIZE];
+        moved = 0;
+        while (1) {
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                moved = (int)(n < 0 ? -1 : 0);
+                break;
+            }
+            for (int s = 0; s < n_sinks; s++) {
+                if (write_all(sinks[s], buffer, n) != 0) {
+                    moved = -1;
+                }
+            }
+        }
+    }
+
+    if (moved != 0 && errno != EPIPE) {
+        fprintf(stderr, "tee: %s\n", strerror(errno));
+        code = 1;
+    }
+
+    for (int s = 1; s < n_sinks; s++) {
+        close(sinks[s]);
+    }
+    free(sinks);
+    return code;
+}
+
+// Helper function to handle `echo` commands
+void handle_echo_cmd(char** argv) {
+    // argv[0] is "echo", subsequent elements are the arguments to echo
+    for (int i = 1; argv[i] != NULL; i++) {
+        // The quotes are now stripped during parsing in parse_arguments
+        printf("%s%s", argv[i], (argv[i+1] != NULL) ? " " : "");
+    }
+    printf("\n");
+}
+
+// Helper function to handle `exit` commands
+int handle_exit_cmd(char** argv) { // Now takes char** argv
+    if (argv[1] != NULL) {
+        return atoi(argv[1]);
+    }
+    return 0;
+}
+
+// Helper function to format a duration in microseconds the way `time` and `times` do:
+// seconds with precision decimals, or minutes and seconds (0m1.500s) in long form
+void format_duration(char* out, size_t size, long long usec, int precision, int long_form) {
+    long long seconds = usec / 1000000;
+    char fraction[8];
+    snprintf(fraction, sizeof(fraction), "%06lld", usec % 1000000);
+    fraction[precision] = '\0';
+
+    int used = 0;
+    if (long_form) {
+        used = snprintf(out, size, "%lldm", seconds / 60);
+        seconds %= 60;
+    }
+    if (precision > 0) {
+        snprintf(out + used, size - used, "%lld.%s%s", seconds, fraction, long_form ? "s" : "");
+    } else {
+        snprintf(out + used, size - used, "%lld%s", seconds, long_form ? "s" : "");
+    }
+}
+
+// Helper function to print a `time` report to stderr. format follows TIMEFORMAT: %[p][l]R,
+// %[p][l]U and %[p][l]S are real, user and system time, %P the CPU percentage, %% a '%'.
+void print_time_report(const char* format, long long real_us, long long user_us, long long sys_us) {
+    char text[64];
+    for (const char* c = format; *c != '\0'; c++) {
+        if (*c != '%') {
+            fputc(*c, stderr);
+            continue;
+        }
+        if (c[1] == '%') {
+            fputc('%', stderr);
+            c++;
+            continue;
+        }
+
+        const char* spec = c + 1;
+        int precision = 3;
+        int long_form = 0;
+        if (isdigit((unsigned char)*spec)) {
+            precision = *spec - '0' > 3 ? 3 : *spec - '0';
+            spec++;
+        }
+        if (*spec == 'l') {
+            long_form = 1;
+            spec++;
+        }
+
+        if (*spec == 'R' || *spec == 'U' || *spec == 'S') {
+            long long usec = *spec == 'R' ? real_us : (*spec == 'U' ? user_us : sys_us);
+            format_duration(text, sizeof(text), usec, precision, long_form);
+            fputs(text, stderr);
+        } else if (*spec == 'P') {
+            double percent = real_us > 0 ? 100.0 * (user_us + sys_us) / real_us : 0.0;
+            fprintf(stderr, "%.2f", percent);
+        } else {
+            // Unknown directives are printed as written
+            fputc('%', stderr);
+            continue;
+        }
+        c = spec;
+    }
+    fputc('\n', stderr);
+}
+
+// Helper function to handle `times`: user and system time of the shell, then of its children
+void handle_times_cmd(void) {
+    struct rusage self;
+    struct rusage children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    const struct timeval* values[] = {&self.ru_utime, &self.ru_stime, &children.ru_utime, &children.ru_stime};
+    char text[4][32];
+    for (int i = 0; i < 4; i++) {
+        format_duration(text[i], sizeof(text[i]), values[i]->tv_sec * 1000000LL + values[i]->tv_usec, 3, 1);
+    }
+    printf("%s %s\n%s %s\n", text[0], text[1], text[2], text[3]);
+}
+
+// Helper function to handle `trace`: print the SHELL_TRACE phase timings of recent command
+// lines in nanoseconds, oldest first; `trace -c` empties the ring
+int handle_trace_cmd(char** argv) {
+    if (!trace_enabled) {
+        fprintf(stderr, "trace: tracing is off (start the shell with SHELL_TRACE=1)\n");
+        return 1;
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "-c") == 0) {
+        trace_count = 0;
+        return 0;
+    }
+
+    printf("%10s %10s %10s %10s %10s %10s  %s\n", "tokenize", "expand", "lookup", "spawn", "wait", "total", "command");
+    for (int i = 0; i < trace_count; i++) {
+        const TraceRecord* record = &trace_ring[(trace_next - trace_count + i + TRACE_RING_SIZE) % TRACE_RING_SIZE];
+        for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+            printf("%10lld ", record->phase_ns[phase]);
+        }
+        printf("%10lld  %s\n", record->total_ns, record->command);
+    }
+    return 0;
+}
+
+// Helper function to handle `break [n]` and `continue [n]`: leave (or restart) the nth
+// enclosing loop once the current command returns
+int handle_loop_jump_cmd(char** argv, int is_continue) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a `for', `while', or `until' loop\n", argv[0]);
+        return 0;
+    }
+
+    int levels = 1;
+    if (argv[1] != NULL) {
+        levels = atoi(argv[1]);
+        if (levels < 1) {
+            fprintf(stderr, "%s: %s: loop count out of range\n", argv[0], argv[1]);
+            return 1;
+        }
+    }
+    loop_jump = levels < loop_depth ? levels : loop_depth;
+    loop_jump_continue = is_continue;
+    return 0;
+}
+
+// Helper function to find a builtin's dispatch entry, NULL if the name is not a builtin
+const BuiltinCommand* find_builtin(const char* name) {
+    if (name == NULL) {
+        return NULL;
+    }
+    for (int i = 0; builtin_table[i].name != NULL; i++) {
+        if (strcmp(builtin_table[i].name, name) == 0) {
+            return &builtin_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Helper function to check whether a command name refers to a shell builtin
+int is_builtin_command(const char* name) {
+    return find_builtin(name) != NULL;
+}
+
+// Helper function to handle `type` commands; returns 1 when a name is not found
+int handle_type_cmd(char** argv) {
+    // argv[0] is "type", argv[1] onwards are commands to type
+    if (argv[1] == NULL || *argv[1] == '\0') {
+        printf("type: usage: type name [...]\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        const char* cmd_to_type = argv[i];
+
+        if (is_builtin_command(cmd_to_type)) {
+            printf("%s is a shell builtin\n", cmd_to_type);
+            continue; // Check next argument
+        }
+
+        // Report remembered locations from the command hash before scanning PATH
+        command_hash_check_path(&command_hash);
+        HashedCommand* entry = command_hash_lookup(&command_hash, cmd_to_type);
+        if (entry != NULL) {
+            printf("%s is hashed (%s)\n", cmd_to_type, entry->path);
+            continue;
+        }
+
+        char* fullPath = search_path_for_exe(cmd_to_type);
+        if (fullPath != NULL) {
+            printf("%s is %s\n", cmd_to_type, fullPath);
+            free(fullPath);
+        } else {
+            printf("%s: not found\n", cmd_to_type);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+// Helper function to handle `pwd` commands
+char* handle_pwd_cmd() {
+    char* buffer = (char*)malloc(PATH_MAX);
+    if (buffer == NULL) {
+        perror("pwd: malloc failed for path buffer");
+        return NULL;
+    }
+
+    if (getcwd(buffer, PATH_MAX) == NULL) {
+        perror("pwd: getcwd failed");
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Helper function to handle `cd` commands; returns 1 when the directory is not changed
+int handle_cd_cmd(char** argv) {
+    const char* path = argv[1];
+
+    const char* target_path;
+    char expanded_path[PATH_MAX];
+
+    if (path == NULL || *path == '\0' || strcmp(path, "~") == 0) {
+        target_path = shell_getenv("HOME");
+        if (target_path == NULL) {
+            fprintf(stderr, "cd: HOME environment variable not set\n");
+            return 1;
+        }
+    } else if (*path == '~') {
+        const char* home = shell_getenv("HOME");
+        if (home == NULL) {
+            fprintf(stderr, "cd: HOME environment variable not set\n");
+            return 1;
+        }
+        snprintf(expanded_path, sizeof(expanded_path), "%s%s", home, path + 1);
+        target_path = expanded_path;
+    } else {
+        target_path = path;
+    }
+
+    if (chdir(target_path) != 0) {
+        printf("cd: %s: No such file or directory\n", target_path);
+        return 1;
+    }
+    return 0;
+}
+
+// Global variable keeping track of the first history number not yet written by `-a`
+static int last_history_written_idx = 1;
+
+// Global HISTFILE store of an interactive shell
+static HistoryStore history_store = {NULL, -1, NULL, 0, 0, NULL, 0, 0};
+
+// Helper function to map a whole file read-only. Returns NULL with *length 0 for an
+// empty file, and sets *failed if the file cannot be opened or mapped.
+static const char* map_history_file(const char* filename, size_t* length, int* failed) {
+    *length = 0;
+    *failed = 0;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *failed = 1;
+        return NULL;
+    }
+
+    // Writers hold the lock while appending, so the mapping never ends mid-entry
+    flock(fd, LOCK_SH);
+    struct stat st;
+    void* map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            *failed = 1;
+        } else {
+            *length = st.st_size;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return map;
+}
+
+// Helper function to add the non-empty lines of data[start, end) to readline's history
+static void add_history_lines(const char* data, size_t start, size_t end) {
+    char* line = NULL;
+    size_t capacity = 0;
+    while (start < end) {
+        const char* nl = memchr(data + start, '\n', end - start);
+        size_t len = (nl ? (size_t)(nl - data) : end) - start;
+        if (len > 0) {
+            // Readline wants terminated strings, and the mapping is read-only
+            if (len + 1 > capacity) {
+                capacity = len + 1;
+                char* grown = realloc(line, capacity);
+                if (grown == NULL) {
+                    break;
+                }
+                line = grown;
+            }
+            memcpy(line, data + start, len);
+            line[len] = '\0';
+            add_history(line);
+        }
+        start += len + 1;
+    }
+    free(line);
+}
+
+// Helper function to find where the last max_entries non-empty lines of data start
+static size_t find_history_window(const char* data, size_t length, int max_entries) {
+    size_t pos = length;
+    int found = 0;
+    while (pos > 0) {
+        // pos is the end of a line; find its start
+        const char* nl = memrchr(data, '\n', pos - 1);
+        size_t line_start = nl ? (size_t)(nl - data) + 1 : 0;
+        if (pos - 1 > line_start) {
+            if (found == max_entries) {
+                return pos;
+            }
+            found++;
+        }
+        pos = line_start;
+    }
+    return 0;
+}
+
+// Helper function to index the entries of the mapped file that readline does not hold
+static void index_history_store(HistoryStore* store) {
+    if (store->indexed) {
+        return;
+    }
+    store->indexed = 1;
+
+    int capacity = 0;
+    size_t pos = 0;
+    while (pos < store->window_start) {
+        const char* nl = memchr(store->map + pos, '\n', store->window_start - pos);
+        size_t end = nl ? (size_t)(nl - store->map) : store->window_start;
+        if (end > pos) {
+            if (store->n_offsets == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                size_t* grown = realloc(store->offsets, capacity * sizeof(size_t));
+                if (grown == NULL) {
+                    return;
+                }
+                store->offsets = grown;
+            }
+            store->offsets[store->n_offsets++] = pos;
+        }
+        pos = end + 1;
+    }
+}
+
+// Helper function to get the number of stored entries older than readline's first one
+static int history_entries_before_window(void) {
+    if (history_store.map == NULL || history_store.window_start == 0) {
+        return 0;
+    }
+    index_history_store(&history_store);
+    return history_store.n_offsets;
+}
+
+// Helper function to open HISTFILE at startup: map it and load only its newest max_entries
+// entries into readline
+static void open_history_store(const char* filename, int max_entries) {
+    HistoryStore* store = &history_store;
+    int failed;
+    store->path = strdup(filename);
+    store->map = map_history_file(filename, &store->map_length, &failed);
+    if (failed) {
+        perror("history");
+    }
+    if (store->map == NULL) {
+        return;
+    }
+
+    // An entry still being written by another shell has no newline yet
+    size_t length = store->map_length;
+    while (length > 0 && store->map[length - 1] != '\n') {
+        length--;
+    }
+    store->window_start = find_history_window(store->map, length, max_entries);
+    add_history_lines(store->map, store->window_start, length);
+}
+
+// Helper function to write buffers to fd in full, batching them into writev calls
+static int write_iovecs(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        int batch = count < HISTORY_IOV_BATCH ? count : HISTORY_IOV_BATCH;
+        ssize_t written = writev(fd, iov, batch);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip the buffers written completely, then trim a partially written one
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Helper function to append readline's entries from index first on to fd under an exclusive
+// lock, so entries of concurrent shells never interleave
+static int append_history_entries(int fd, int first) {
+    HIST_ENTRY** entries = history_list();
+    int count = history_length - first;
+    if (entries == NULL || count <= 0) {
+        return 0;
+    }
+
+    struct iovec* iov = malloc(2 * count * sizeof(struct iovec));
+    if (iov == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        iov[2 * i].iov_base = entries[first + i]->line;
+        iov[2 * i].iov_len = strlen(entries[first + i]->line);
+        iov[2 * i + 1].iov_base = "\n";
+        iov[2 * i + 1].iov_len = 1;
+    }
+
+    flock(fd, LOCK_EX);
+    int result = write_iovecs(fd, iov, 2 * count);
+    flock(fd, LOCK_UN);
+    free(iov);
+    return result;
+}
+
+// Helper function to open a file for appending history entries
+static int open_history_append_fd(const char* filename) {
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("history");
+    }
+    return fd;
+}
+
+// Helper function to add an entered line to the history and append it to HISTFILE.
+// With HISTCONTROL=ignoredups (or ignoreboth) a repeat of the previous entry is dropped.
+static void record_history_entry(const char* line) {
+    const char* control = shell_getenv("HISTCONTROL");
+    if (control != NULL && (strstr(control, "ignoredups") || strstr(control, "ignoreboth")) && history_length > 0) {
+        HIST_ENTRY* last = history_get(history_base + history_length - 1);
+        if (last != NULL && strcmp(last->line, line) == 0) {
+            return;
+        }
+    }
+    add_history(line);
+
+    HistoryStore* store = &history_store;
+    if (store->path == NULL) {
+        return;
+    }
+    if (store->append_fd == -1) {
+        store->append_fd = open_history_append_fd(store->path);
+        if (store->append_fd == -1) {
+            free(store->path);
+            store->path = NULL; // Report once, then stop persisting
+            return;
+        }
+    }
+    if (append_history_entries(store->append_fd, history_length - 1) < 0) {
+        perror("history");
+    }
+}
+
+// Helper function to release the history store at exit
+static void close_history_store(void) {
+    HistoryStore* store = &history_store;
+    if (store->append_fd != -1) {
+        close(store->append_fd);
+    }
+    if (store->map != NULL) {
+        munmap((void*)store->map, store->map_length);
+    }
+    free(store->offsets);
+    free(store->path);
+    memset(store, 0, sizeof(*store));
+    store->append_fd = -1;
+}
+
+// Global trigram index serving `history -s` and Ctrl-R
+static HistoryIndex history_index = {NULL, 0};
+
+// Helper function to count all entries: older mapped ones plus readline's
+static int history_total_entries(void) {
+    return history_entries_before_window() + history_length;
+}
+
+// Helper function to get the text of history entry id, which is not terminated for
+// entries still in the mapped file
+static const char* history_entry_text(int id, size_t* len) {
+    int older = history_entries_before_window();
+    if (id < older) {
+        const char* line = history_store.map + history_store.offsets[id];
+        const char* end = memchr(line, '\n', history_store.map + history_store.map_length - line);
+        *len = end ? (size_t)(end - line) : strlen(line);
+        return line;
+    }
+
+    HIST_ENTRY** entries = history_list();
+    const char* line = entries[id - older]->line;
+    *len = strlen(line);
+    return line;
+}
+
+// Helper function to map three bytes to their trigram bucket
+static unsigned int trigram_bucket(const char* s) {
+    unsigned int key = ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (key * 2654435761u) >> 16;
+}
+
+// Helper function to add the entries not yet indexed to the trigram buckets
+static void update_history_index(void) {
+    HistoryIndex* index = &history_index;
+    int total = history_total_entries();
+    if (index->buckets == NULL) {
+        index->buckets = calloc(TRIGRAM_BUCKETS, sizeof(TrigramBucket));
+        if (index->buckets == NULL) {
+            return;
+        }
+    }
+
+    for (; index->n_indexed < total; index->n_indexed++) {
+        int id = index->n_indexed;
+        size_t len;
+        const char* text = history_entry_text(id, &len);
+        for (size_t i = 0; i + 3 <= len; i++) {
+            TrigramBucket* bucket = &index->buckets[trigram_bucket(text + i)];
+            // Ids arrive in order, so a repeated trigram only needs the last id checked
+            if (bucket->count > 0 && bucket->ids[bucket->count - 1] == id) {
+                continue;
+            }
+            if (bucket->count == bucket->capacity) {
+                int new_capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+                int* grown = realloc(bucket->ids, new_capacity * sizeof(int));
+                if (grown == NULL) {
+                    return;
+                }
+                bucket->ids = grown;
+                bucket->capacity = new_capacity;
+            }
+            bucket->ids[bucket->count++] = id;
+        }
+    }
+}
+
+// Helper function to check whether history entry id contains pattern
+static int history_entry_matches(int id, const char* pattern, size_t pattern_len) {
+    size_t len;
+    const char* text = history_entry_text(id, &len);
+    return memmem(text, len, pattern, pattern_len) != NULL;
+}
+
+// Helper function to find the newest entry older than before that contains pattern, -1 if
+// none. Patterns of three bytes or more only visit the entries in the bucket of their
+// rarest trigram; shorter ones are checked against every entry.
+static int search_history(const char* pattern, int before) {
+    size_t pattern_len = strlen(pattern);
+    int total = history_total_entries();
+    if (before > total) {
+        before = total;
+    }
+
+    update_history_index();
+    if (pattern_len < 3 || history_index.buckets == NULL || history_index.n_indexed < total) {
+        for (int id = before - 1; id >= 0; id--) {
+            if (history_entry_matches(id, pattern, pattern_len)) {
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    TrigramBucket* rarest = NULL;
+    for (size_t i = 0; i + 3 <= pattern_len; i++) {
+        TrigramBucket* bucket = &history_index.buckets[trigram_bucket(pattern + i)];
+        if (rarest == NULL || bucket->count < rarest->count) {
+            rarest = bucket;
+        }
+    }
+
+    // Binary search for the last candidate below before, then verify going back
+    int lo = 0;
+    int hi = rarest->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (rarest->ids[mid] < before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        if (history_entry_matches(rarest->ids[i], pattern, pattern_len)) {
+            return rarest->ids[i];
+        }
+    }
+    return -1;
+}
+
+// Helper function to release the search index at exit
+static void free_history_index(void) {
+    if (history_index.buckets != NULL) {
+        for (int i = 0; i < TRIGRAM_BUCKETS; i++) {
+            free(history_index.buckets[i].ids);
+        }
+        free(history_index.buckets);
+    }
+    history_index.buckets = NULL;
+    history_index.n_indexed = 0;
+}
+
+// Helper function for Ctrl-R: search history incrementally as the pattern is typed.
+// Ctrl-R again moves to the next older match, Ctrl-G restores the original line and any
+// other key accepts the match and is then handled as usual.
+static int reverse_search_history_key(int count, int key) {
+    (void)count;
+    (void)key;
+    ArgBuffer* typed = init_arg_buffer(NULL);
+    if (typed == NULL) {
+        return 0;
+    }
+    int found = -1;
+    int failed = 0;
+
+    while (1) {
+        size_t len = 0;
+        const char* text = found >= 0 ? history_entry_text(found, &len) : "";
+        const char* pattern = typed->buffer;
+        size_t pattern_len = typed->length;
+        rl_message("(%sreverse-i-search)`%s': %.*s", failed ? "failed " : "", pattern, (int)len, text);
+
+        int c = rl_read_key();
+        if (c == 7) { // Ctrl-G
+            found = -1;
+            break;
+        } else if (c == 18) { // Ctrl-R
+            if (pattern_len > 0) {
+                int next = search_history(pattern, found >= 0 ? found : history_total_entries());
+                failed = next < 0;
+                found = next >= 0 ? next : found;
+            }
+            continue;
+        } else if (c == 127 || c == 8) { // Backspace searches again from the newest entry
+            if (typed->length > 0) {
+                typed->buffer[--typed->length] = '\0';
+            }
+        } else if (isprint(c)) {
+            if (add_char_to_buffer(typed, (char)c) < 0) {
+                break;
+            }
+        } else {
+            if (c != 27) { // ESC only ends the search
+                rl_execute_next(c);
+            }
+            break;
+        }
+
+        int start = history_total_entries();
+        if (c != 127 && c != 8 && found >= 0) {
+            start = found + 1; // A longer pattern may still match the current entry
+        }
+        pattern = typed->buffer;
+        pattern_len = typed->length;
+        int next = pattern_len > 0 ? search_history(pattern, start) : -1;
+        failed = pattern_len > 0 && next < 0;
+        if (next >= 0 || pattern_len == 0) {
+            found = next;
+        }
+    }
+
+    if (found >= 0) {
+        size_t len;
+        const char* text = history_entry_text(found, &len);
+        char* line = strndup(text, len);
+        if (line != NULL) {
+            rl_replace_line(line, 0);
+            rl_point = rl_end;
+            free(line);
+        }
+    }
+    free_arg_buffer(typed);
+    rl_clear_message();
+    rl_redisplay();
+    return 0;
+}
+
+// Helper function to load history from file; returns -1 when it cannot be read
+static int load_history_from_file(const char* filename) {
+    size_t length;
+    int failed;
+    const char* map = map_history_file(filename, &length, &failed);
+    if (failed) {
+        perror("history");
+        return -1;
+    }
+    if (map != NULL) {
+        add_history_lines(map, 0, length);
+        munmap((void*)map, length);
+    }
+    return 0;
+}
+
+// Helper function to save history to a file. The entries go to a temporary file that
+// replaces the target in one rename, so readers never see a half-written history. The
+// older entries still mapped from HISTFILE come first, then readline's window. Returns -1
+// when the file is not replaced.
+static int save_history_to_file(const char* filename) {
+    HistoryStore* store = &history_store;
+    size_t len = strlen(filename);
+    char* tmp_path = malloc(len + 8);
+    if (tmp_path == NULL) {
+        perror("history");
+        return -1;
+    }
+    memcpy(tmp_path, filename, len);
+    memcpy(tmp_path + len, ".XXXXXX", 8);
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("history");
+        free(tmp_path);
+        return -1;
+    }
+    int failed = store->map != NULL && store->window_start > 0 && write_all(fd, store->map, store->window_start) != 0;
+    if (failed || append_history_entries(fd, 0) < 0 || close(fd) != 0 || rename(tmp_path, filename) != 0) {
+        perror("history");
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    // HISTFILE is a new file now, and the old appends went to the replaced one
+    if (store->path != NULL && strcmp(store->path, filename) == 0 && store->append_fd != -1) {
+        close(store->append_fd);
+        store->append_fd = -1;
+    }
+    return 0;
+}
+
+// Helper function to handle `history` commands; returns 1 when an option or a file operation fails
+int handle_history_cmd(char** argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        if (argv[2] == NULL) {
+            fprintf(stderr, "history: -r: option requires an argument\n");
+            return 1;
+        }
+
+        return load_history_from_file(argv[2]) == 0 ? 0 : 1;
+    }
+    // Handle history -w <file> option: write history to file (overwrite)
+    else if (argv[1] != NULL && strcmp(argv[1], "-w") == 0) {
+        if (argv[2] == NULL) {
+            fprintf(stderr, "history: -w: option requires an argument\n");
+            return 1;
+        }
+
+        if (save_history_to_file(argv[2]) != 0) {
+            return 1;
+        }
+        last_history_written_idx = history_base + history_length;
+        return 0;
+    }
+    // Handle history -a <file> option: append history to file
+    else if (argv[1] != NULL && strcmp(argv[1], "-a") == 0) {
+        if (argv[2] == NULL) {
+            fprintf(stderr, "history: -a option requires an argument\n");
+            return 1;
+        }
+
+        // Entries are already in HISTFILE as soon as they are entered
+        const char* filename = argv[2];
+        if (history_store.path == NULL || strcmp(history_store.path, filename) != 0) {
+            int fd = open_history_append_fd(filename);
+            if (fd == -1) {
+                return 1;
+            }
+            int first = last_history_written_idx - history_base;
+            if (append_history_entries(fd, first > 0 ? first : 0) < 0) {
+                perror("history");
+                close(fd);
+                return 1;
+            }
+            close(fd);
+        }
+        last_history_written_idx = history_base + history_length;
+        return 0;
+    }
+    
+    // Handle history -s <pattern> option: list the entries containing pattern
+    else if (argv[1] != NULL && strcmp(argv[1], "-s") == 0) {
+        if (argv[2] == NULL) {
+            fprintf(stderr, "history: -s: option requires an argument\n");
+            return 1;
+        }
+
+        // Matches are found newest first but listed in order, like `history`
+        int n_matches = 0;
+        int capacity = 0;
+        int* matches = NULL;
+        for (int id = search_history(argv[2], INT_MAX); id >= 0; id = search_history(argv[2], id)) {
+            if (n_matches == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                int* grown = realloc(matches, capacity * sizeof(int));
+                if (grown == NULL) {
+                    break;
+                }
+                matches = grown;
+            }
+            matches[n_matches++] = id;
+        }
+
+        int older = history_entries_before_window();
+        for (int i = n_matches - 1; i >= 0; i--) {
+            size_t len;
+            const char* text = history_entry_text(matches[i], &len);
+            int number = matches[i] < older ? matches[i] + 1 : matches[i] + history_base;
+            printf("%5d %.*s\n", number, (int)len, text);
+        }
+        free(matches);
+        return 0;
+    }
+
+    // Exiting history display logic below; only the requested tail is visited
+    int total_entries = history_length;
+
+    // Entries older than readline's are numbered (and shown) from the mapped HISTFILE
+    int older = history_entries_before_window();
+    int n = total_entries;
+    if (argv[1] != NULL) {
+        char* endptr;
+        long temp = strtol(argv[1], &endptr, 10);
+
+        // Validate the argument
+        if (*endptr != '\0' || temp <= 0) {
+            fprintf(stderr, "history: %s: numeric argument required\n", argv[1]);
+            return 1;
+        }
+
+        n = temp > total_entries + older ? total_entries + older : (int)temp;
+    }
+
+    HIST_ENTRY** history_entries = history_list();
+    if (!history_entries) {
+        return 0;
+    }
+
+    for (int i = older - (n - total_entries); i < older; i++) {
+        const char* line = history_store.map + history_store.offsets[i];
+        int len = (int)strcspn(line, "\n");
+        printf("%5d %.*s\n", i + 1, len, line);
+    }
+
+    int start_idx = n < total_entries ? total_entries - n : 0;
+    for (int i = start_idx; i < total_entries; i++) {
+        printf("%5d %s\n", i + history_base + older, history_entries[i]->line);
+    }
+    return 0;
+}
+
+// Helper function to handle `jobs` commands
+void handle_jobs_cmd(char** argv, JobSystem* sys) {
+    (void)argv;
+    int max_id;
+    int second_max_id;
+    find_latest_job_ids(sys, &max_id, &second_max_id);
+
+    // Visit jobs in ID order straight from the bitmap
+    for (int w = 0; w < sys->capacity / 64; w++) {
+        unsigned long bits = sys->id_bitmap[w];
+        while (bits != 0) {
+            int bit = __builtin_ctzl(bits);
+            bits &= bits - 1;
+            Job* job = &sys->list[w * 64 + bit];
+
+            // Default space for all other older jobs
+            char marker = ' ';
+
+            if  (job->job_id == max_id) {
+                marker = '+';
+            } else if (job->job_id == second_max_id) {
+                marker = '-';
+            }
+
+            if (job->is_done) {
+                // Print job as done with proper 24-character padding
+                printf("[%d]%c %-24s%s\n", job->job_id, marker, "Done", job->command);
+
+                // Remove job entry from list records immediately
+                release_job(sys, job);
+            } else if (job->is_stopped) {
+                printf("[%d]%c %-24s%s\n", job->job_id, marker, "Stopped", job->command);
+            } else {
+                printf("[%d]%c %-24s%s &\n", job->job_id, marker, "Running", job->command);
+            }
+        }
+    }
+}
+
+// Helper function to resolve a job spec (`%n`, `n`, `%+`, `%%`, `%-`, or NULL for the
+// current job) to an active job, reporting "no such job" on behalf of the builtin
+Job* resolve_job_spec(JobSystem* sys, const char* spec, const char* builtin_name) {
+    int max_id;
+    int second_max_id;
+    find_latest_job_ids(sys, &max_id, &second_max_id);
+
+    int job_id = -1;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        job_id = max_id;
+    } else if (strcmp(spec, "%-") == 0) {
+        job_id = second_max_id != -1 ? second_max_id : max_id;
+    } else {
+        const char* digits = (spec[0] == '%') ? spec + 1 : spec;
+        char* end = NULL;
+        long value = strtol(digits, &end, 10);
+        if (*digits != '\0' && *end == '\0' && value > 0 && value <= sys->capacity) {
+            job_id = (int)value;
+        }
+    }
+
+    if (job_id > 0 && sys->list[job_id - 1].is_active) {
+        return &sys->list[job_id - 1];
+    }
+
+    fprintf(stderr, "%s: %s: no such job\n", builtin_name, spec ? spec : "current");
+    return NULL;
+}
+
+// Helper function to handle `fg` commands: continue a job in the foreground and wait for it
+int handle_fg_cmd(char** argv, JobSystem* sys) {
+    Job* job = resolve_job_spec(sys, argv[1], "fg");
+    if (job == NULL) {
+        return 1;
+    }
+
+    printf("%s\n", job->command);
+    flush_builtin_output();
+
+    give_terminal_to(job->pid);
+    if (job->is_stopped) {
+        killpg(job->pid, SIGCONT);
+        job->is_stopped = 0;
+    }
+
+    int stopped = wait_for_pipeline(job->pids, job->statuses, job->n_pids);
+    give_terminal_to(shell_pgid);
+
+    // Fold the members that exited while in the foreground back into the job record
+    int exited_codes[job->n_pids];
+    memcpy(exited_codes, job->statuses, job->n_pids * sizeof(int));
+    for (int i = 0; i < job->n_pids; i++) {
+        if (exited_codes[i] != -1 && job_index_find(sys, job->pids[i]) != -1) {
+            job->statuses[i] = -1;
+            job_member_exited(sys, job, i, exited_codes[i]);
+        }
+    }
+
+    if (stopped) {
+        job->is_stopped = 1;
+        printf("\n[%d]+ %-24s%s\n", job->job_id, "Stopped", job->command);
+        return 128 + SIGTSTP;
+    }
+
+    // A job finished in the foreground is not reported as Done later
+    int code = job->statuses[job->n_pids - 1];
+    release_job(sys, job);
+    return code;
+}
+
+// Helper function to handle `bg` commands: continue a stopped job in the background
+int handle_bg_cmd(char** argv, JobSystem* sys) {
+    Job* job = resolve_job_spec(sys, argv[1], "bg");
+    if (job == NULL) {
+        return 1;
+    }
+
+    if (!job->is_stopped) {
+        fprintf(stderr, "bg: job %d already in background\n", job->job_id);
+        return 0;
+    }
+
+    killpg(job->pid, SIGCONT);
+    job->is_stopped = 0;
+    printf("[%d]+ %s &\n", job->job_id, job->command);
+    return 0;
+}
+
+// Helper function to wait for the still-running members of one job (blocking)
+int wait_for_job(JobSystem* sys, Job* job) {
+    for (int i = 0; i < job->n_pids; i++) {
+        if (job->statuses[i] != -1) {
+            continue;
+        }
+
+        int status;
+        pid_t waited;
+        do {
+            waited = waitpid(job->pids[i], &status, 0);
+        } while (waited == -1 && errno == EINTR);
+
+        job_member_exited(sys, job, i, waited == -1 ? 0 : status_to_exit_code(status));
+    }
+
+    // The finished job is still reported as Done before the next prompt
+    return job->statuses[job->n_pids - 1];
+}
+
+// Helper function to handle `wait` commands: with no operands wait for every job,
+// otherwise for each job spec or pid given. Waiting for every job fails with 127 when
+// a stage of one never started.
+int handle_wait_cmd(char** argv, JobSystem* sys) {
+    int code = 0;
+
+    if (argv[1] == NULL) {
+        for (int slot = 0; slot < sys->capacity; slot++) {
+            Job* job = &sys->list[slot];
+            if (!job->is_active) {
+                continue;
+            }
+            if (!job->is_done) {
+                wait_for_job(sys, job);
+            }
+            for (int i = 0; i < job->n_pids; i++) {
+                if (job->pids[i] < 0) {
+                    code = 127;
+                }
+            }
+        }
+        return code;
+    }
+
+    for (int a = 1; argv[a] != NULL; a++) {
+        if (argv[a][0] == '%') {
+            Job* job = resolve_job_spec(sys, argv[a], "wait");
+            code = job ? wait_for_job(sys, job) : 127;
+            continue;
+        }
+
+        char* end = NULL;
+        long value = strtol(argv[a], &end, 10);
+        if (*argv[a] == '\0' || *end != '\0' || value <= 0) {
+            fprintf(stderr, "wait: `%s': not a pid or valid job spec\n", argv[a]);
+            code = 2;
+            continue;
+        }
+
+        pid_t pid = (pid_t)value;
+        int bucket = job_index_find(sys, pid);
+        if (bucket != -1) {
+            // A job member: wait for just that process and record it in the job
+            Job* job = &sys->list[sys->index_slots[bucket]];
+            int status;
+            pid_t waited;
+            do {
+                waited = waitpid(pid, &status, 0);
+            } while (waited == -1 && errno == EINTR);
+
+            code = waited == -1 ? 0 : status_to_exit_code(status);
+            for (int i = 0; i < job->n_pids; i++) {
+                if (job->pids[i] == pid) {
+                    job_member_exited(sys, job, i, code);
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // Members that already finished are still found in their job record
+        int found = 0;
+        for (int slot = 0; slot < sys->capacity && !found; slot++) {
+            Job* job = &sys->list[slot];
+            for (int i = 0; job->is_active && i < job->n_pids; i++) {
+                if (job->pids[i] == pid) {
+                    code = job->statuses[i];
+                    found = 1;
+                    break;
+                }
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "wait: pid %ld is not a child of this shell\n", value);
+            code = 127;
+        }
+    }
+
+    return code;
+}
+
+// Structure mapping signal names accepted by `kill` to numbers
+typedef struct {
+    const char* name;
+    int number;
+} SignalName;
+
+static const SignalName signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {NULL, 0}
+};
+
+// Helper function to parse a signal given by number, NAME or SIGNAME; -1 if unknown
+int parse_signal_spec(const char* spec) {
+    char* end = NULL;
+    long value = strtol(spec, &end, 10);
+    if (*spec != '\0' && *end == '\0') {
+        return (value >= 0 && value < NSIG) ? (int)value : -1;
+    }
+
+    if (strncasecmp(spec, "SIG", 3) == 0) {
+        spec += 3;
+    }
+    for (int i = 0; signal_names[i].name != NULL; i++) {
+        if (strcasecmp(spec, signal_names[i].name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+// Helper function to handle `kill` commands: `kill [-s SIG | -SIG] %job|pid ...`.
+// Job specs signal the job's whole process group.
+int handle_kill_cmd(char** argv, JobSystem* sys) {
+    int signo = SIGTERM;
+    int a = 1;
+
+    if (argv[a] != NULL && strcmp(argv[a], "-s") == 0 && argv[a + 1] != NULL) {
+        signo = parse_signal_spec(argv[a + 1]);
+        a += 2;
+    } else if (argv[a] != NULL && argv[a][0] == '-' && argv[a][1] != '\0') {
+        signo = parse_signal_spec(argv[a] + 1);
+        a++;
+    }
+
+    if (signo < 0) {
+        fprintf(stderr, "kill: %s: invalid signal specification\n", argv[a - 1]);
+        return 1;
+    }
+    if (argv[a] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -sigspec] pid | jobspec ...\n");
+        return 2;
+    }
+
+    int code = 0;
+    for (; argv[a] != NULL; a++) {
+        if (argv[a][0] == '%') {
+            Job* job = resolve_job_spec(sys, argv[a], "kill");
+            if (job == NULL) {
+                code = 1;
+                continue;
+            }
+            if (killpg(job->pid, signo) == -1) {
+                fprintf(stderr, "kill: %s: %s\n", argv[a], strerror(errno));
+                code = 1;
+            } else if (signo == SIGCONT) {
+                job->is_stopped = 0;
+            }
+            continue;
+        }
+
+        char* end = NULL;
+        long value = strtol(argv[a], &end, 10);
+        if (*argv[a] == '\0' || *end != '\0') {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", argv[a]);
+            code = 1;
+            continue;
+        }
+        if (kill((pid_t)value, signo) == -1) {
+            fprintf(stderr, "kill: (%ld) - %s\n", value, strerror(errno));
+            code = 1;
+        }
+    }
+
+    return code;
+}
+
+// Helper function to look up an existing command in registry
+int find_completion_index(CompletionSystem* sys, const char* command) {
+    for (int i = 0; i < sys->count; i++) {
+        if (sys->list[i].command != NULL && strcmp(sys->list[i].command, command) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Helper function to register context and retrieve it when needed
+CompletionSystem* get_set_completion_context(CompletionSystem* new_sys) {
+    static CompletionSystem* saved_sys = NULL;
+    if (new_sys != NULL) {
+        saved_sys = new_sys;
+    }
+    return saved_sys;
+}
+
+// Helper function to drop the cached reply of a persistent completer
+void clear_completion_cache(CompletionRegister* reg) {
+    free(reg->cache_word);
+    free(reg->cache_prev);
+    free(reg->reply);
+    free(reg->results);
+    reg->cache_word = NULL;
+    reg->cache_prev = NULL;
+    reg->reply = NULL;
+    reg->results = NULL;
+    reg->n_results = 0;
+}
+
+// Helper function to stop a completer co-process and close its pipes
+void stop_completion_coprocess(CompletionRegister* reg) {
+    if (reg->to_coproc != -1) {
+        close(reg->to_coproc);
+        reg->to_coproc = -1;
+    }
+    if (reg->from_coproc != -1) {
+        close(reg->from_coproc);
+        reg->from_coproc = -1;
+    }
+    if (reg->coproc_pid > 0) {
+        kill(reg->coproc_pid, SIGKILL);
+        waitpid(reg->coproc_pid, NULL, 0);
+    }
+    reg->coproc_pid = -1;
+}
+
+// Helper function to launch a completer as a co-process talking over a pair of pipes
+int start_completion_coprocess(CompletionRegister* reg) {
+    int to_child[2];
+    int from_child[2];
+
+    // Close-on-exec keeps the shell's ends out of every other child
+    if (pipe2(to_child, O_CLOEXEC) == -1) {
+        perror("complete: pipe failed");
+        return -1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) == -1) {
+        perror("complete: pipe failed");
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_child[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, from_child[1], STDOUT_FILENO);
+
+    char* argv[] = {reg->completer, NULL};
+    pid_t pid;
+    flush_builtin_output();
+    int err = posix_spawnp(&pid, reg->completer, &actions, NULL, argv, shell_environment());
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(to_child[0]);
+    close(from_child[1]);
+
+    if (err != 0) {
+        fprintf(stderr, "complete: %s: %s\n", reg->completer, strerror(err));
+        close(to_child[1]);
+        close(from_child[0]);
+        return -1;
+    }
+
+    reg->coproc_pid = pid;
+    reg->to_coproc = to_child[1];
+    reg->from_coproc = from_child[0];
+    return 0;
+}
+
+// Helper function to write a whole request to the co-process without dying on SIGPIPE
+int write_completion_request(int fd, const char* data, size_t len) {
+    struct sigaction ignore;
+    struct sigaction saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+
+    int result = 0;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+
+    sigaction(SIGPIPE, &saved, NULL);
+    return result;
+}
+
+// Helper function to read one reply (candidate lines ended by an empty line) before the deadline.
+// Returns the reply length, or -1 on timeout, EOF or error.
+ssize_t read_completion_reply(int fd, char** reply_out) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t capacity = COMPLETER_READ_MIN;
+    size_t length = 0;
+    char* reply = malloc(capacity);
+    if (reply == NULL) {
+        perror("complete: malloc failed");
+        return -1;
+    }
+
+    while (1) {
+        // The reply is complete once it is a lone newline or ends with a blank line
+        if ((length == 1 && reply[0] == '\n') || (length >= 2 && reply[length - 2] == '\n' && reply[length - 1] == '\n')) {
+            reply[length] = '\0';
+            *reply_out = reply;
+            return (ssize_t)length;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= COMPLETER_TIMEOUT_MS) {
+            break;
+        }
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int)(COMPLETER_TIMEOUT_MS - elapsed_ms));
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            break;
+        }
+
+        if (capacity - length < COMPLETER_READ_MIN) {
+            char* grown = realloc(reply, capacity * 2);
+            if (grown == NULL) {
+                perror("complete: realloc failed");
+                break;
+            }
+            reply = grown;
+            capacity *= 2;
+        }
+
+        ssize_t n = read(fd, reply + length, capacity - length - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+
+    free(reply);
+    return -1;
+}
+
+// Helper function to copy one field of a completer request to out, turning the tabs and
+// newlines in it into spaces so it cannot split the request. Returns the end of the copy.
+char* put_request_field(char* out, const char* field) {
+    for (; *field != '\0'; field++) {
+        *out++ = (*field == '\t' || *field == '\n') ? ' ' : *field;
+    }
+    return out;
+}
+
+// Helper function to ask a persistent completer for candidates. Requests are one line,
+// `command<TAB>word<TAB>prev<TAB>point<TAB>line`, with tabs and newlines inside a field sent
+// as spaces; replies are one candidate per line ended by an empty line. The last reply is
+// reused while (word, prev) stay the same.
+int query_completion_coprocess(CompletionRegister* reg, const char* word, const char* prev) {
+    if (reg->cache_word != NULL && strcmp(reg->cache_word, word) == 0 && strcmp(reg->cache_prev, prev) == 0) {
+        return 0;
+    }
+    clear_completion_cache(reg);
+
+    if (reg->coproc_pid == -1 && start_completion_coprocess(reg) != 0) {
+        return -1;
+    }
+
+    char point[16];
+    snprintf(point, sizeof(point), "%d", rl_point);
+    const char* fields[] = {reg->command, word, prev, point, rl_line_buffer};
+    int n_fields = sizeof(fields) / sizeof(fields[0]);
+    size_t request_len = 0;
+    for (int f = 0; f < n_fields; f++) {
+        request_len += strlen(fields[f]) + 1;
+    }
+    char* request = malloc(request_len + 1);
+    if (request == NULL) {
+        perror("complete: malloc failed");
+        return -1;
+    }
+    char* out = request;
+    for (int f = 0; f < n_fields; f++) {
+        out = put_request_field(out, fields[f]);
+        *out++ = f < n_fields - 1 ? '\t' : '\n';
+    }
+    *out = '\0';
+
+    char* reply = NULL;
+    int ok = write_completion_request(reg->to_coproc, request, request_len) == 0 &&
+             read_completion_reply(reg->from_coproc, &reply) >= 0;
+    free(request);
+
+    if (!ok) {
+        // A hung or dead completer is dropped; the next TAB starts a fresh one
+        fprintf(stderr, "\ncomplete: %s: completer did not answer\n", reg->completer);
+        rl_on_new_line();
+        stop_completion_coprocess(reg);
+        return -1;
+    }
+
+    int count = 0;
+    for (char* p = reply; *p != '\0'; p++) {
+        if (*p == '\n') {
+            count++;
+        }
+    }
+
+    // One slot per complete line; an empty reply needs none
+    reg->results = count > 0 ? malloc(count * sizeof(char*)) : NULL;
+    if (count > 0 && reg->results == NULL) {
+        perror("complete: malloc failed");
+        free(reply);
+        return -1;
+    }
+
+    // Split the reply into candidate lines in place, stopping at the terminating blank line
+    char* line = reply;
+    while (*line != '\0' && *line != '\n') {
+        char* newline = strchr(line, '\n');
+        if (newline == NULL) {
+            break; // A trailing partial line was not counted and is no candidate
+        }
+        *newline = '\0';
+        reg->results[reg->n_results++] = line;
+        line = newline + 1;
+    }
+
+    reg->reply = reply;
+    reg->cache_word = strdup(word);
+    reg->cache_prev = strdup(prev);
+    return 0;
+}
+
+// Helper function to find the command name and the word before the one being completed.
+// Splits a copy of the whole line in place, handed back through line_copy for the caller
+// to free; returns the number of words on the line.
+int find_completion_words(const char* text, char** line_copy, const char** cmd_name, const char** prev_word) {
+    *line_copy = strdup(rl_line_buffer);
+    if (*line_copy == NULL) {
+        perror("find_completion_words: strdup failed");
+        return 0;
+    }
+
+    // Only the first and the last two words matter, so none are collected
+    const char* last = NULL;
+    const char* before_last = NULL;
+    int token_count = 0;
+    char* token = strtok(*line_copy, " \t");
+    while (token != NULL) {
+        if (token_count == 0) {
+            *cmd_name = token;
+        }
+        before_last = last;
+        last = token;
+        token_count++;
+        token = strtok(NULL, " \t");
+    }
+
+    if (token_count == 0) {
+        return 0;
+    }
+
+    // Identify argv[1], argv[2], argv[3]
+    *prev_word = "";
+
+    if (token_count >= 2) {
+        if (strcmp(last, text) == 0) {
+            *prev_word = before_last;
+        } else {
+            *prev_word = last;
+        }
+    }
+
+    return token_count;
+}
+
+char** environment_with_assignments(VariableSystem* var_sys, char** assigns, int n_assigns, Arena* arena);
+
+// Helper function to start a completion script through /bin/sh with its output on a pipe.
+// COMP_LINE and COMP_POINT are handed over as environment overrides rather than set in
+// (and then removed from) the shell's own environment.
+FILE* open_completion_script(const char* exec_cmd, pid_t* pid_out) {
+    Arena env_arena = {0};
+    char* comp_line = arena_alloc(&env_arena, strlen(rl_line_buffer) + sizeof("COMP_LINE="));
+    char comp_point[32];
+    if (comp_line == NULL) {
+        return NULL;
+    }
+    sprintf(comp_line, "COMP_LINE=%s", rl_line_buffer);
+    snprintf(comp_point, sizeof(comp_point), "COMP_POINT=%d", rl_point);
+    char* assigns[] = {comp_line, comp_point};
+
+    char** envp = (shell_variables != NULL) ? environment_with_assignments(shell_variables, assigns, 2, &env_arena) : environ;
+
+    int out_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        arena_free(&env_arena);
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    char* argv[] = {"sh", "-c", (char*)exec_cmd, NULL};
+    int err = posix_spawn(pid_out, "/bin/sh", &actions, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    arena_free(&env_arena);
+    close(out_pipe[1]);
+
+    if (err != 0) {
+        close(out_pipe[0]);
+        errno = err;
+        return NULL;
+    }
+
+    FILE* fp = fdopen(out_pipe[0], "r");
+    if (fp == NULL) {
+        close(out_pipe[0]);
+        waitpid(*pid_out, NULL, 0);
+    }
+    return fp;
+}
+
+// Helper function to close a completion script's output and reap it
+void close_completion_script(FILE* fp, pid_t pid) {
+    fclose(fp);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Helper function which generates custom completion scripts registered
+char* script_completion_generator(const char* text, int state) {
+    // Persistent static pointers to keep stream context alive across Readline iterations
+    static FILE* fp = NULL;
+    static pid_t script_pid = -1;
+    static CompletionRegister* coproc_reg = NULL;
+    static int result_idx = 0;
+    CompletionSystem* sys = NULL;
+
+    // State 0 indicates this is the first TAB request for this word
+    if (state == 0) {
+        // Clean up any leaked or unclosed pipes from previous evaluations
+        if (fp != NULL) {
+            close_completion_script(fp, script_pid);
+            fp = NULL;
+        }
+        coproc_reg = NULL;
+
+        sys = get_set_completion_context(NULL);
+        if (sys == NULL) {
+            return NULL;
+        }
+
+        // Tokenize line up to current completion point to find parameters
+        char* line_copy = NULL;
+        const char* cmd_name = NULL;
+        const char* current_word = text;
+        const char* prev_word = "";
+        if (find_completion_words(text, &line_copy, &cmd_name, &prev_word) == 0) {
+            free(line_copy);
+            return NULL;
+        }
+
+        // Find the script path
+        int idx = find_completion_index(sys, cmd_name);
+        if (idx == -1) {
+            free(line_copy);
+            return NULL;
+        }
+
+        CompletionRegister* reg = &sys->list[idx];
+        if (reg->persistent) {
+            int queried = query_completion_coprocess(reg, current_word, prev_word);
+            free(line_copy);
+            if (queried != 0) {
+                return NULL;
+            }
+            coproc_reg = reg;
+            result_idx = 0;
+        } else {
+            const char* script_path = reg->completer;
+
+            // Construct execution command string securely wrapping arguments in quotes
+            char* exec_cmd = NULL;
+            int built = asprintf(&exec_cmd, "%s '%s' '%s' '%s'", script_path, cmd_name, current_word, prev_word);
+            free(line_copy);
+            if (built < 0) {
+                perror("script_completion_generator: asprintf failed");
+                return NULL;
+            }
+
+            flush_builtin_output();
+            fp = open_completion_script(exec_cmd, &script_pid);
+            free(exec_cmd);
+            if (!fp) {
+                perror("failed running completer");
+                return NULL;
+            }
+        }
+    }
+
+    if (coproc_reg != NULL) {
+        if (result_idx < coproc_reg->n_results) {
+            return strdup(coproc_reg->results[result_idx++]);
+        }
+        coproc_reg = NULL;
+        return NULL;
+    }
+
+    if (fp != NULL) {
+        char* output_line = NULL;
+        size_t output_capacity = 0;
+        ssize_t len = getline(&output_line, &output_capacity, fp);
+        if (len >= 0) {
+            if (len > 0 && output_line[len - 1] == '\n') {
+                output_line[len - 1] = '\0';
+            }
+
+            return output_line; // Readline takes ownership of the match
+        }
+        free(output_line);
+
+        close_completion_script(fp, script_pid);
+        fp = NULL;
+    }
+
+    return NULL;
+}
+
+// Helper function to handle `complete` commands; returns 1 on a usage error or an unknown command
+int handle_complete_cmd(char** argv, CompletionSystem* sys) {
+    if (argv == NULL || argv[0] == NULL || sys == NULL) {
+        return 1;
+    }
+
+    
+    if (argv[1] != NULL && strcmp(argv[1], "-p") == 0) {
+        // The -p Flag: Prints out matching specifications
+        if (argv[2] == NULL) {
+            fprintf(stderr, "complete: usage: complete [-p] [command]\n");
+            return 1;
+        }
+
+        int idx = find_completion_index(sys, argv[2]);
+        if (idx != -1) {
+            printf("complete %s '%s' %s\n", sys->list[idx].persistent ? "-P" : "-C", sys->list[idx].completer, sys->list[idx].command);
+        } else {
+            fprintf(stderr, "complete: %s: no completion specification\n", argv[2]);
+            return 1;
+        }
+    } else if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        // The -r Flag: Removes a stored completion rule
+        if (argv[2] == NULL) {
+            fprintf(stderr, "complete: usage: complete [-r] [command]\n");
+            return 1;
+        }
+
+        int idx = find_completion_index(sys, argv[2]);
+        if (idx != -1) {
+            // Free memory holding strings for this registration
+            stop_completion_coprocess(&sys->list[idx]);
+            clear_completion_cache(&sys->list[idx]);
+            free(sys->list[idx].command);
+            free(sys->list[idx].completer);
+
+            // Shift any subsequent items down to keep the registry list contiguous
+            for (int i = idx; i < sys->count - 1; i++) {
+                sys->list[i] = sys->list[i + 1];
+            }
+
+            // The trailing slot is filled afresh by the next registration
+            sys->count--;
+        } else {
+            fprintf(stderr, "complete: %s: no completion specification\n", argv[2]);
+            return 1;
+        }
+    } else if (argv[1] != NULL && (strcmp(argv[1] , "-C") == 0 || strcmp(argv[1], "-P") == 0)) {
+        // The -C Flag: Registers new completion script
+        // The -P Flag: Same, but the script is kept running as a co-process
+        int persistent = strcmp(argv[1], "-P") == 0;
+        if (argv[2] == NULL || argv[3] == NULL) {
+            fprintf(stderr, "complete: usage: complete %s [completer] [command]\n", argv[1]);
+            return 1;
+        }
+
+        const char* script_path = argv[2];
+        const char* cmd_name = argv[3];
+
+        int idx = find_completion_index(sys, cmd_name);
+        if (idx != -1) {
+            stop_completion_coprocess(&sys->list[idx]);
+            clear_completion_cache(&sys->list[idx]);
+            free(sys->list[idx].completer);
+            sys->list[idx].completer = strdup(script_path);
+            sys->list[idx].persistent = persistent;
+        } else {
+            if (sys->count == sys->capacity && grow_completion_table(sys) < 0) {
+                return 1;
+            }
+            sys->list[sys->count] = (CompletionRegister){strdup(cmd_name), strdup(script_path), persistent, -1, -1, -1, NULL, NULL, NULL, NULL, 0};
+            sys->count++;
+        }
+    }
+    return 0;
+}
+
+// Helper function to find the index slot for a name: either the slot holding it or the empty slot ending its probe chain
+int probe_variable_slot(VariableSystem* var_sys, const char* name, size_t len, unsigned int hash) {
+    unsigned int mask = var_sys->index_size - 1;
+    unsigned int slot = hash & mask;
+
+    while (var_sys->index[slot] != -1) {
+        ShellVariable* var = &var_sys->list[var_sys->index[slot]];
+        if (var->hash == hash && var->name_len == len && memcmp(var->name, name, len) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask; // Linear probing
+    }
+    return (int)slot;
+}
+
+// Helper function to look up an existing shell variable by a (pointer, length) name slice
+int find_variable_index_n(VariableSystem* var_sys, const char* name, size_t len) {
+    if (var_sys->index_size == 0) {
+        return -1;
+    }
+    return var_sys->index[probe_variable_slot(var_sys, name, len, hash_bytes(name, len))];
+}
+
+// Helper function to look up an existing shell variable
+int find_variable_index(VariableSystem* var_sys, const char* variable) {
+    return find_variable_index_n(var_sys, variable, strlen(variable));
+}
+
+// Helper function to fetch a variable's value without copying its name, NULL when unset
+const char* lookup_variable(VariableSystem* var_sys, const char* name, size_t len) {
+    int idx = find_variable_index_n(var_sys, name, len);
+    return (idx != -1) ? var_sys->list[idx].value : NULL;
+}
+
+// Helper function to double the hash index once it is half full
+int grow_variable_index(VariableSystem* var_sys) {
+    int new_size = var_sys->index_size ? var_sys->index_size * 2 : VAR_INDEX_INITIAL_SIZE;
+    int* new_index = malloc(new_size * sizeof(int));
+    if (new_index == NULL) {
+        perror("grow_variable_index: malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < new_size; i++) {
+        new_index[i] = -1;
+    }
+
+    // Reinsert every variable using its cached hash
+    unsigned int mask = new_size - 1;
+    for (int i = 0; i < var_sys->count; i++) {
+        unsigned int slot = var_sys->list[i].hash & mask;
+        while (new_index[slot] != -1) {
+            slot = (slot + 1) & mask;
+        }
+        new_index[slot] = i;
+    }
+
+    free(var_sys->index);
+    var_sys->index = new_index;
+    var_sys->index_size = new_size;
+    return 0;
+}
+
+// Helper function to create or update a shell variable
+int set_variable(VariableSystem* var_sys, const char* name, const char* value) {
+    size_t len = strlen(name);
+    unsigned int hash = hash_bytes(name, len);
+
+    if (var_sys->index_size > 0) {
+        int slot = probe_variable_slot(var_sys, name, len, hash);
+        if (var_sys->index[slot] != -1) {
+            // Update existing variable
+            char* new_value = strdup(value);
+            if (new_value == NULL) {
+                perror("set_variable: strdup failed");
+                return -1;
+            }
+            ShellVariable* var = &var_sys->list[var_sys->index[slot]];
+            free(var->value);
+            var->value = new_value;
+            if (var->exported) {
+                var_sys->env_generation++;
+            }
+            return 0;
+        }
+    }
+
+    // Keep the index at most half full so probe chains stay short
+    if ((var_sys->count + 1) * 2 > var_sys->index_size && grow_variable_index(var_sys) < 0) {
+        return -1;
+    }
+
+    if (var_sys->count == var_sys->capacity) {
+        int new_capacity = var_sys->capacity ? var_sys->capacity * 2 : 16;
+        ShellVariable* new_list = realloc(var_sys->list, new_capacity * sizeof(ShellVariable));
+        if (new_list == NULL) {
+            perror("set_variable: realloc failed");
+            return -1;
+        }
+        var_sys->list = new_list;
+        var_sys->capacity = new_capacity;
+    }
+
+    ShellVariable* var = &var_sys->list[var_sys->count];
+    var->name = arena_strndup(&var_sys->name_pool, name, len);
+    var->value = strdup(value);
+    if (var->name == NULL || var->value == NULL) {
+        perror("set_variable: strdup failed");
+        free(var->value);
+        return -1;
+    }
+    var->name_len = len;
+    var->hash = hash;
+    var->exported = 0;
+
+    var_sys->index[probe_variable_slot(var_sys, name, len, hash)] = var_sys->count;
+    var_sys->count++;
+    return 0;
+}
+
+// Helper function to validate shell variable identifiers
+int is_valid_var_identifier(const char* name) {
+    // Invalid shell identifier if variable identifier is empty
+    if (name == NULL || *name == '\0') {
+        return 0;
+    }
+
+    // Rule 1: Must start with a letter (a-z, A-Z) or an underscore
+    if (!isalpha((unsigned char)*name) && *name != '_') {
+        return 0;
+    }
+
+    // Rule 2: Remaining characters must be alphanumeric or underscores
+    name++;
+    while (*name != '\0') {
+        if (!isalnum((unsigned char)*name) && *name != '_') {
+            return 0;
+        }
+        name++;
+    }
+
+    return 1; // Valid shell variable identifier
+}
+
+// Helper function to measure the NAME in a `NAME=value` word, 0 when the word is not an assignment
+size_t assignment_name_length(const char* word, size_t len) {
+    if (len == 0 || (!isalpha((unsigned char)word[0]) && word[0] != '_')) {
+        return 0;
+    }
+    size_t i = 1;
+    while (i < len && (isalnum((unsigned char)word[i]) || word[i] == '_')) {
+        i++;
+    }
+    return (i < len && word[i] == '=') ? i : 0;
+}
+
+// Helper function to mark an existing variable as exported (or not), invalidating the
+// cached environment when that changes what children see. Returns -1 if it is unset.
+int export_variable(VariableSystem* var_sys, const char* name, int exported) {
+    int idx = find_variable_index(var_sys, name);
+    if (idx == -1) {
+        return -1;
+    }
+    if (var_sys->list[idx].exported != exported) {
+        var_sys->list[idx].exported = exported;
+        var_sys->env_generation++;
+    }
+    return 0;
+}
+
+// Helper function to turn the inherited environment into exported shell variables, so
+// the shell reads and updates them without going back through getenv/setenv
+void import_environment(VariableSystem* var_sys) {
+    for (char** entry = environ; *entry != NULL; entry++) {
+        const char* eq_sign = strchr(*entry, '=');
+        if (eq_sign == NULL || assignment_name_length(*entry, (size_t)(eq_sign - *entry) + 1) == 0) {
+            continue; // Names a shell variable cannot hold are not imported
+        }
+
+        char* name = strndup(*entry, (size_t)(eq_sign - *entry));
+        if (name == NULL) {
+            perror("import_environment: strndup failed");
+            return;
+        }
+        if (set_variable(var_sys, name, eq_sign + 1) == 0) {
+            export_variable(var_sys, name, 1);
+        }
+        free(name);
+    }
+}
+
+// Helper function to return the NULL-terminated environment for external commands. The
+// array is cached and only rebuilt when an exported variable changed since the last call.
+char** get_environment(VariableSystem* var_sys) {
+    if (var_sys->envp != NULL && var_sys->envp_generation == var_sys->env_generation) {
+        return var_sys->envp;
+    }
+
+    if (var_sys->envp != NULL) {
+        for (int i = 0; i < var_sys->envp_count; i++) {
+            free(var_sys->envp[i]);
+        }
+        free(var_sys->envp);
+        var_sys->envp = NULL;
+        var_sys->envp_count = 0;
+    }
+
+    int n_exported = 0;
+    for (int i = 0; i < var_sys->count; i++) {
+        n_exported += var_sys->list[i].exported;
+    }
+
+    char** envp = malloc((n_exported + 1) * sizeof(char*));
+    if (envp == NULL) {
+        perror("get_environment: malloc failed");
+        return environ;
+    }
+
+    int n = 0;
+    for (int i = 0; i < var_sys->count; i++) {
+        ShellVariable* var = &var_sys->list[i];
+        if (!var->exported) {
+            continue;
+        }
+        size_t value_len = strlen(var->value);
+        char* entry = malloc(var->name_len + value_len + 2);
+        if (entry == NULL) {
+            perror("get_environment: malloc failed");
+            continue;
+        }
+        memcpy(entry, var->name, var->name_len);
+        entry[var->name_len] = '=';
+        memcpy(entry + var->name_len + 1, var->value, value_len + 1);
+        envp[n++] = entry;
+    }
+    envp[n] = NULL;
+
+    var_sys->envp = envp;
+    var_sys->envp_count = n;
+    var_sys->envp_generation = var_sys->env_generation;
+    return envp;
+}
+
+// Helper function to build the environment for one command with `NAME=value` prefix
+// assignments applied on top of the cached one. Only the pointer array is copied, into
+// the per-line arena, so overrides cost nothing once the line is done.
+char** environment_with_assignments(VariableSystem* var_sys, char** assigns, int n_assigns, Arena* arena) {
+    char** base = get_environment(var_sys);
+    if (n_assigns == 0) {
+        return base;
+    }
+
+    int base_count = (base == var_sys->envp) ? var_sys->envp_count : 0;
+    if (base != var_sys->envp) {
+        while (base[base_count] != NULL) {
+            base_count++;
+        }
+    }
+
+    char** envp = arena_alloc(arena, (base_count + n_assigns + 1) * sizeof(char*));
+    if (envp == NULL) {
+        return base;
+    }
+    memcpy(envp, base, base_count * sizeof(char*));
+    int n = base_count;
+
+    for (int i = 0; i < n_assigns; i++) {
+        size_t name_len = strchr(assigns[i], '=') - assigns[i] + 1; // Includes the '='
+        int j = 0;
+        while (j < n && strncmp(envp[j], assigns[i], name_len) != 0) {
+            j++;
+        }
+        envp[j] = assigns[i];
+        if (j == n) {
+            n++;
+        }
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+// Helper function to set the variables named by `NAME=value` words in the shell itself
+void apply_assignments(VariableSystem* var_sys, char** assigns, int n_assigns) {
+    for (int i = 0; i < n_assigns; i++) {
+        const char* eq_sign = strchr(assigns[i], '=');
+        char* name = strndup(assigns[i], (size_t)(eq_sign - assigns[i]));
+        if (name == NULL) {
+            perror("apply_assignments: strndup failed");
+            return;
+        }
+        set_variable(var_sys, name, eq_sign + 1);
+        free(name);
+    }
+}
+
+// Helper function to print a variable the way `declare -p` shows it
+void print_variable_declaration(const ShellVariable* var) {
+    printf("declare %s %s=\"%s\"\n", var->exported ? "-x" : "--", var->name, var->value);
+}
+
+// Helper function to handle `declare` commands; returns 1 for an unknown or invalid name
+int handle_declare_cmd(char** argv, VariableSystem* var_sys) {
+    if (argv == NULL || argv[0] == NULL || var_sys ==  NULL) {
+        return 1;
+    }
+
+    // Without a variable name, list the shell's own variables in declaration order; the
+    // exported ones, the whole imported environment among them, are listed by `export`
+    if (argv[1] == NULL || (strcmp(argv[1], "-p") == 0 && argv[2] == NULL)) {
+        for (int i = 0; i < var_sys->count; i++) {
+            if (!var_sys->list[i].exported) {
+                print_variable_declaration(&var_sys->list[i]);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-p") == 0) {
+        // The -p Flag: Prints out description of variable
+        int idx = find_variable_index(var_sys, argv[2]);
+        if (idx != -1) {
+            print_variable_declaration(&var_sys->list[idx]);
+        } else {
+            fprintf(stderr, "declare: %s: not found\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+
+    char* eq_sign = strchr(argv[1], '=');
+
+    if (eq_sign != NULL) {
+        // Split the token into name and value
+        *eq_sign = '\0';
+        char* var_name = argv[1];
+        char* var_value = eq_sign + 1;
+
+        // Validate shell variable identifier before saving
+        if (!is_valid_var_identifier(var_name)) {
+            // Restore '=' momentarily to print original input in error message
+            *eq_sign = '=';
+            fprintf(stderr, "declare: `%s': not a valid identifier\n", argv[1]);
+            return 1;
+        }
+
+        // Create the variable or update the existing one
+        set_variable(var_sys, var_name, var_value);
+
+        // Restore the '=' symbol in argv
+        *eq_sign = '=';
+    }
+    return 0;
+}
+
+// Helper function to handle `export` commands: `NAME=value` sets and exports, `NAME`
+// exports an existing variable, -n takes the export attribute away again
+int handle_export_cmd(char** argv, VariableSystem* var_sys) {
+    int first = 1;
+    int exported = 1;
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        exported = 0;
+        first = 2;
+    } else if (argv[1] != NULL && strcmp(argv[1], "-p") == 0) {
+        first = 2;
+    }
+
+    // Without names, list the exported variables
+    if (argv[first] == NULL) {
+        for (int i = 0; i < var_sys->count; i++) {
+            if (var_sys->list[i].exported) {
+                print_variable_declaration(&var_sys->list[i]);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = first; argv[i] != NULL; i++) {
+        // Split the word into name and value, restoring the '=' afterwards
+        char* eq_sign = strchr(argv[i], '=');
+        if (eq_sign != NULL) {
+            *eq_sign = '\0';
+        }
+
+        if (!is_valid_var_identifier(argv[i])) {
+            if (eq_sign != NULL) {
+                *eq_sign = '=';
+            }
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+
+        if (eq_sign != NULL) {
+            set_variable(var_sys, argv[i], eq_sign + 1);
+        }
+        // Exporting a name that is not set does nothing
+        export_variable(var_sys, argv[i], exported);
+
+        if (eq_sign != NULL) {
+            *eq_sign = '=';
+        }
+    }
+    return status;
+}
+
+// Helper function to move a descriptor the shell opened above the range redirections
+// target, so applying one operation can never clobber another operation's source
+int move_fd_high(int fd) {
+    if (fd == -1 || fd >= 10) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return high;
+}
+
+// Helper function to back a here-document body with an in-memory file (a pipe when
+// memfd_create is unavailable), positioned at the start for reading
+int open_heredoc_fd(const char* body, size_t len) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd != -1) {
+        if (write_all(fd, body, len) != 0 || lseek(fd, 0, SEEK_SET) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    if (len > IO_CHUNK_SIZE) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)len);
+    }
+    // A body larger than the pipe would block the shell, so it fails with EAGAIN instead
+    int result = write_all(pipe_fds[1], body, len);
+    close(pipe_fds[1]);
+    if (result != 0) {
+        close(pipe_fds[0]);
+        return -1;
+    }
+    fcntl(pipe_fds[0], F_SETFL, 0);
+    return pipe_fds[0];
+}
+
+// Helper function to close the descriptors prepare_redirections opened
+void release_redirections(RedirectionInfo* redir) {
+    for (int i = 0; i < redir->count; i++) {
+        if (redir->ops[i].ready_fd != -1) {
+            close(redir->ops[i].ready_fd);
+            redir->ops[i].ready_fd = -1;
+        }
+    }
+}
+
+// Helper function to open every file and here-document a command's redirections need, in
+// the shell, so failures are reported once with the file name. Returns 0, or -1 after
+// printing the error and releasing whatever was already opened.
+int prepare_redirections(RedirectionInfo* redir) {
+    for (int i = 0; i < redir->count; i++) {
+        RedirOp* op = &redir->ops[i];
+        if (op->kind == REDIR_OPEN) {
+            op->ready_fd = move_fd_high(open(op->word, op->open_flags | O_CLOEXEC, 0644));
+            if (op->ready_fd == -1) {
+                fprintf(stderr, "shell: %s: %s\n", op->word, strerror(errno));
+                release_redirections(redir);
+                return -1;
+            }
+        } else if (op->kind == REDIR_HEREDOC) {
+            op->ready_fd = move_fd_high(open_heredoc_fd(op->body ? op->body : "", op->body_len));
+            if (op->ready_fd == -1) {
+                fprintf(stderr, "shell: here-document: %s\n", strerror(errno));
+                release_redirections(redir);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to carry out prepared redirections on the current process in order.
+// With save set, each target's previous descriptor is kept so restore_redirections can
+// undo them (used for builtins running in the shell). Returns 0, or -1 with errno set.
+int apply_redirections(RedirectionInfo* redir, int save) {
+    for (int i = 0; i < redir->count; i++) {
+        RedirOp* op = &redir->ops[i];
+        if (save) {
+            op->saved_fd = fcntl(op->fd, F_DUPFD_CLOEXEC, 10);
+        }
+
+        int result = 0;
+        if (op->kind == REDIR_CLOSE) {
+            close(op->fd);
+        } else if (op->kind == REDIR_DUP) {
+            if (op->source_fd != op->fd) {
+                result = dup2(op->source_fd, op->fd);
+            }
+        } else {
+            result = dup2(op->ready_fd, op->fd);
+        }
+        if (result == -1) {
+            fprintf(stderr, "shell: %d: %s\n", op->kind == REDIR_DUP ? op->source_fd : op->fd, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to undo apply_redirections(redir, 1), newest operation first
+void restore_redirections(RedirectionInfo* redir) {
+    for (int i = redir->count - 1; i >= 0; i--) {
+        RedirOp* op = &redir->ops[i];
+        if (op->saved_fd == -2) {
+            continue;
+        }
+        if (op->saved_fd == -1) {
+            close(op->fd);
+        } else {
+            dup2(op->saved_fd, op->fd);
+            close(op->saved_fd);
+        }
+        op->saved_fd = -2;
+    }
+}
+
+// Helper function to run a builtin with its redirections applied inside the shell,
+// flushing buffered output around every descriptor change
+int run_builtin_with_redirections(const BuiltinCommand* builtin, ParseResult* command, ShellContext* ctx) {
+    RedirectionInfo* redir = command->redir_info;
+    if (redir->count == 0) {
+        return builtin->run(command->argv, ctx);
+    }
+
+    if (prepare_redirections(redir) != 0) {
+        return 1;
+    }
+
+    // Output produced before the redirection still belongs to the old stdout
+    flush_builtin_output();
+    int applied = apply_redirections(redir, 1);
+    release_redirections(redir);
+
+    int code = 1;
+    if (applied == 0) {
+        code = builtin->run(command->argv, ctx);
+    }
+
+    flush_builtin_output();
+    restore_redirections(redir);
+    clearerr(stdout);
+    return code;
+}
+
+// Helper function to translate prepared redirections into posix_spawn file actions
+int add_redirection_file_actions(posix_spawn_file_actions_t* actions, RedirectionInfo* redir_info) {
+    for (int i = 0; i < redir_info->count; i++) {
+        RedirOp* op = &redir_info->ops[i];
+        int err = 0;
+        if (op->kind == REDIR_CLOSE) {
+            err = posix_spawn_file_actions_addclose(actions, op->fd);
+        } else if (op->kind == REDIR_DUP) {
+            if (op->source_fd != op->fd) {
+                err = posix_spawn_file_actions_adddup2(actions, op->source_fd, op->fd);
+            }
+        } else {
+            err = posix_spawn_file_actions_adddup2(actions, op->ready_fd, op->fd);
+        }
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// Helper function to check that argv and envp fit what exec accepts, so an oversized
+// command is refused before anything is launched. The kernel limits the strings and their
+// pointers together to sysconf(_SC_ARG_MAX) and each string to 32 pages.
+// Returns 0, or -1 with errno set to E2BIG.
+int check_exec_size(char* const argv[], char* const envp[]) {
+    if (exec_arg_max == 0) {
+        exec_arg_max = sysconf(_SC_ARG_MAX);
+        exec_arg_strlen_max = sysconf(_SC_PAGESIZE) * 32;
+        if (exec_arg_max <= 0 || exec_arg_strlen_max <= 0) {
+            exec_arg_max = -1; // Unknown: leave the decision to exec
+        }
+    }
+    if (exec_arg_max < 0) {
+        return 0;
+    }
+
+    size_t total = 0;
+    char* const* lists[] = {argv, envp};
+    for (int l = 0; l < 2; l++) {
+        for (int i = 0; lists[l] != NULL && lists[l][i] != NULL; i++) {
+            size_t len = strlen(lists[l][i]) + 1;
+            if (len > (size_t)exec_arg_strlen_max) {
+                errno = E2BIG;
+                return -1;
+            }
+            total += len + sizeof(char*);
+        }
+    }
+    if (total > (size_t)exec_arg_max) {
+        errno = E2BIG;
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to launch an executable with posix_spawn instead of fork+exec.
+// in_fd/out_fd (or -1) become the child's stdin/stdout, close_fds are closed in the child,
+// then the (already prepared) redirections are applied.
+// pgid 0 starts a new process group, a positive pgid joins it, -1 keeps the shell's group;
+// take_terminal makes the new group the terminal's foreground group.
+// Returns the child pid, or -1 with errno set when the launch failed.
+pid_t spawn_external_exe(const char* exePath, char* argv[], char* const envp[], RedirectionInfo* redir_info, int in_fd, int out_fd, const int* close_fds, int n_close_fds, pid_t pgid, int take_terminal) {
+    if (check_exec_size(argv, envp) != 0) {
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    posix_spawnattr_t attr;
+    err = posix_spawnattr_init(&attr);
+    if (err != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        return -1;
+    }
+
+    // Signals the shell ignores for job control must not stay ignored in the child
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTTOU);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    if (pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    // Hand over the terminal inside the child so it cannot read before it is in the foreground
+    if (take_terminal && job_control) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#else
+    (void)take_terminal;
+#endif
+
+    if (err == 0 && in_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (err == 0 && out_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; err == 0 && i < n_close_fds; i++) {
+        err = posix_spawn_file_actions_addclose(&actions, close_fds[i]);
+    }
+    if (err == 0) {
+        err = add_redirection_file_actions(&actions, redir_info);
+    }
+
+    pid_t pid = -1;
+    if (err == 0) {
+        flush_builtin_output();
+        long long started = trace_start();
+        err = posix_spawn(&pid, exePath, &actions, &attr, argv, envp);
+        trace_phase(TRACE_SPAWN, started);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Helper function to put a forked child into its job's process group and restore the
+// signal dispositions the shell changed, before it runs a builtin or execs
+void prepare_job_child(pid_t pgid, int take_terminal) {
+    pid_t self = getpid();
+    setpgid(self, pgid == 0 ? self : pgid);
+    if (take_terminal) {
+        give_terminal_to(getpgrp());
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+}
+
+// Helper function to fork process and execute external executables
+void execute_external_exe_with_redirection(const char* exePath, char* argv[], char* const envp[], RedirectionInfo* redir_info, int is_background_process, JobSystem* job_sys) {
+    pid_t pid;
+
+    // Background jobs always get their own process group; foreground ones only under job control
+    pid_t pgid = (is_background_process || job_control) ? 0 : -1;
+    int take_terminal = !is_background_process;
+
+    if (prepare_redirections(redir_info) != 0) {
+        set_single_status(1);
+        return;
+    }
+
+    if (use_posix_spawn) {
+        pid = spawn_external_exe(exePath, argv, envp, redir_info, -1, -1, NULL, 0, pgid, take_terminal);
+        if (pid < 0 && errno == ENOENT && access(exePath, X_OK) != 0) {
+            // The remembered location went stale: forget it and search PATH once more
+            command_hash_remove(&command_hash, argv[0]);
+            char* fresh_path = find_exe_in_path(argv[0]);
+            if (fresh_path != NULL) {
+                pid = spawn_external_exe(fresh_path, argv, envp, redir_info, -1, -1, NULL, 0, pgid, take_terminal);
+                free(fresh_path);
+            } else {
+                errno = ENOENT;
+            }
+        }
+
+        release_redirections(redir_info);
+
+        if (pid < 0) {
+            int code = (errno == ENOENT) ? 127 : 126;
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            set_single_status(code);
+            return;
+        }
+    } else {
+        if (check_exec_size(argv, envp) != 0) {
+            release_redirections(redir_info);
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            set_single_status(126);
+            return;
+        }
+        flush_builtin_output();
+        long long started = trace_start();
+        pid = fork();
+        trace_phase(TRACE_SPAWN, started);
+    }
+
+    if (pid == 0) { // Child process (fork path only)
+        if (pgid != -1) {
+            prepare_job_child(pgid, take_terminal);
+        }
+
+        if (apply_redirections(redir_info, 0) != 0) {
+            exit(1);
+        }
+
+        execve(exePath, argv, envp);
+        // Only reached if execve fails; 127 tells the parent the file is gone
+        int exec_errno = errno;
+        perror("execv failed");
+        exit(exec_errno == ENOENT ? 127 : 1); // Child exits if execv fails
+    } else if (pid > 0) { // Parent process
+        release_redirections(redir_info);
+        if (pgid != -1) {
+            // Set the group from both sides so neither order of execution can race
+            setpgid(pid, pid);
+        }
+
+        char** stage_argvs[] = {argv};
+        if (is_background_process) {
+            register_background_job(job_sys, &pid, 1, build_job_command(stage_argvs, 1));
+            set_single_status(0);
+        } else {
+            // Traditional blocking behavior for foreground jobs
+            if (pgid != -1) {
+                give_terminal_to(pid);
+            }
+
+            int code = -1;
+            wait_for_foreground(job_sys, &pid, &code, 1, stage_argvs); // Parent waits for child
+
+            // A hashed location that no longer exists must be looked up again next time; a
+            // program that merely exits with 127 keeps its entry
+            if (code == 127 && access(exePath, X_OK) != 0) {
+                command_hash_remove(&command_hash, argv[0]);
+            }
+        }
+    } else { // Fork failed
+        release_redirections(redir_info);
+        perror("fork failed");
+    }
+}
+
+// Helper function to restore stdout (for built-ins)
+void restore_stdout(int saved_stdout) {
+    if (saved_stdout != -1) {
+        flush_builtin_output();
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+}
+
+// Generator function for command completion in PATH, answered from the executable index
+char* command_generator(const char* text, int state) {
+    static int entry_idx;
+    static size_t text_len;
+
+    if (!state) {
+        refresh_exe_index(&exe_index);
+        entry_idx = exe_index_lower_bound(&exe_index, text);
+        text_len = strlen(text);
+    }
+
+    // Matches for the prefix are contiguous in the sorted index
+    if (entry_idx < exe_index.count && strncmp(exe_index.entries[entry_idx].name, text, text_len) == 0) {
+        return strdup(exe_index.entries[entry_idx++].name);
+    }
+
+    return NULL;
+}
+
+// Helper function to order snapshot entries by name
+int compare_snapshot_entries(const void* a, const void* b) {
+    return strcmp(((const DirSnapshotEntry*)a)->name, ((const DirSnapshotEntry*)b)->name);
+}
+
+// Helper function to read a directory into a snapshot slot. d_type is trusted when the
+// filesystem provides it; only unknown entries and symlinks need an fstatat() call.
+int fill_dir_snapshot(DirSnapshot* snap, const char* path, const struct stat* st) {
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        return -1;
+    }
+
+    free(snap->path);
+    snap->path = strdup(path);
+    snap->dev = st->st_dev;
+    snap->ino = st->st_ino;
+    snap->mtime = st->st_mtim;
+    snap->count = 0;
+    arena_reset(&snap->name_pool);
+
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        // Skip the current and parent directory shortcuts
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (snap->count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            DirSnapshotEntry* grown = realloc(snap->entries, new_capacity * sizeof(DirSnapshotEntry));
+            if (grown == NULL) {
+                perror("fill_dir_snapshot: realloc failed");
+                break;
+            }
+            snap->entries = grown;
+            capacity = new_capacity;
+        }
+
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            // Without d_type, look at the entry itself so symlinks can still be told apart
+            struct stat entry_st;
+            if (fstatat(dirfd(dirp), entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0) {
+                entry->d_type = S_ISLNK(entry_st.st_mode) ? DT_LNK : S_ISDIR(entry_st.st_mode) ? DT_DIR : DT_REG;
+                is_dir = entry->d_type == DT_DIR;
+            }
+        }
+        if (entry->d_type == DT_LNK) {
+            struct stat entry_st;
+            is_dir = fstatat(dirfd(dirp), entry->d_name, &entry_st, 0) == 0 && S_ISDIR(entry_st.st_mode);
+        }
+
+        const char* name = arena_strdup(&snap->name_pool, entry->d_name);
+        if (name == NULL) {
+            break;
+        }
+        snap->entries[snap->count++] = (DirSnapshotEntry){name, is_dir, entry->d_type == DT_LNK};
+    }
+    closedir(dirp);
+
+    qsort(snap->entries, snap->count, sizeof(DirSnapshotEntry), compare_snapshot_entries);
+    return 0;
+}
+
+// Helper function to get a sorted listing of a directory, reusing the cached
+// snapshot while the directory's identity and mtime are unchanged
+DirSnapshot* get_dir_snapshot(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    DirSnapshot* victim = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        DirSnapshot* snap = &dir_cache[i];
+        if (snap->path != NULL && strcmp(snap->path, path) == 0) {
+            // Relative paths may name another directory after cd, so check dev/ino too
+            if (snap->dev != st.st_dev || snap->ino != st.st_ino ||
+                snap->mtime.tv_sec != st.st_mtim.tv_sec || snap->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+                if (fill_dir_snapshot(snap, path, &st) != 0) {
+                    return NULL;
+                }
+            }
+            snap->last_used = ++dir_cache_clock;
+            return snap;
+        }
+
+        // Prefer an unused slot, otherwise the least recently used one
+        if (victim->path != NULL && (snap->path == NULL || snap->last_used < victim->last_used)) {
+            victim = snap;
+        }
+    }
+
+    if (victim->path == NULL) {
+        arena_init(&victim->name_pool);
+    }
+    if (fill_dir_snapshot(victim, path, &st) != 0) {
+        return NULL;
+    }
+    victim->last_used = ++dir_cache_clock;
+    return victim;
+}
+
+// Global named character classes accepted inside glob brackets, e.g. [[:digit:]]
+static const struct {
+    const char* name;
+    int (*test)(int);
+} glob_char_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    {NULL, NULL}
+};
+
+// Helper function to compile the bracket expression at pattern[*pos] == '[' into a bitmap
+// of accepted bytes. Returns 1 with *pos moved past the ']', or 0 when the bracket is never
+// closed (the '[' is then an ordinary character).
+int compile_glob_class(const char* pattern, size_t len, size_t* pos, unsigned char* members) {
+    size_t i = *pos + 1;
+    int negate = 0;
+    if (i < len && (pattern[i] == '!' || pattern[i] == '^')) {
+        negate = 1;
+        i++;
+    }
+    memset(members, 0, 32);
+
+    // A ']' right after the opening (and any negation) is a member, not the end
+    int first = 1;
+    while (i < len && (pattern[i] != ']' || first)) {
+        first = 0;
+
+        if (pattern[i] == '[' && i + 1 < len && pattern[i + 1] == ':') {
+            size_t end = i + 2;
+            while (end + 1 < len && !(pattern[end] == ':' && pattern[end + 1] == ']')) {
+                end++;
+            }
+            if (end + 1 < len) {
+                for (int c = 0; glob_char_classes[c].name != NULL; c++) {
+                    if (strlen(glob_char_classes[c].name) == end - (i + 2) &&
+                        memcmp(glob_char_classes[c].name, pattern + i + 2, end - (i + 2)) == 0) {
+                        for (int b = 1; b < 256; b++) {
+                            if (glob_char_classes[c].test(b)) {
+                                members[b / 8] |= 1 << (b % 8);
+                            }
+                        }
+                    }
+                }
+                i = end + 2;
+                continue;
+            }
+        }
+
+        unsigned char lo = pattern[i];
+        if (lo == '\\' && i + 1 < len) {
+            lo = pattern[++i];
+        }
+        i++;
+        unsigned char hi = lo;
+        if (i + 1 < len && pattern[i] == '-' && pattern[i + 1] != ']') {
+            hi = pattern[++i];
+            if (hi == '\\' && i + 1 < len) {
+                hi = pattern[++i];
+            }
+            i++;
+        }
+        for (unsigned int b = lo; b <= hi; b++) {
+            members[b / 8] |= 1 << (b % 8);
+        }
+    }
+    if (i >= len) {
+        return 0;
+    }
+
+    if (negate) {
+        for (int b = 0; b < 32; b++) {
+            members[b] = ~members[b];
+        }
+    }
+    *pos = i + 1;
+    return 1;
+}
+
+// Helper function to compile one '/'-separated component of a glob pattern. Runs of plain
+// characters become single literal tokens; a component without wildcards keeps its
+// unescaped text in literal so the walk can use it without reading the directory.
+int compile_glob_segment(const char* text, size_t len, GlobSegment* segment, Arena* arena) {
+    segment->tokens = arena_alloc(arena, (len + 1) * sizeof(GlobToken));
+    char* literal = arena_alloc(arena, len + 1);
+    if (segment->tokens == NULL || literal == NULL) {
+        return -1;
+    }
+    segment->n_tokens = 0;
+    segment->is_globstar = len == 2 && text[0] == '*' && text[1] == '*';
+
+    size_t literal_len = 0;
+    int has_wildcard = 0;
+    size_t i = 0;
+    while (i < len) {
+        GlobToken* token = &segment->tokens[segment->n_tokens];
+        char c = text[i];
+        if (c == '*') {
+            while (i < len && text[i] == '*') {
+                i++; // Consecutive stars match the same as one
+            }
+            *token = (GlobToken){GLOB_STAR, NULL, 0, NULL};
+            segment->n_tokens++;
+            has_wildcard = 1;
+            continue;
+        }
+        if (c == '?') {
+            *token = (GlobToken){GLOB_ANY, NULL, 0, NULL};
+            segment->n_tokens++;
+            has_wildcard = 1;
+            i++;
+            continue;
+        }
+        if (c == '[') {
+            unsigned char* members = arena_alloc(arena, 32);
+            size_t pos = i;
+            if (members == NULL) {
+                return -1;
+            }
+            if (compile_glob_class(text, len, &pos, members)) {
+                *token = (GlobToken){GLOB_CLASS, NULL, 0, members};
+                segment->n_tokens++;
+                has_wildcard = 1;
+                i = pos;
+                continue;
+            }
+        }
+
+        if (c == '\\' && i + 1 < len) {
+            c = text[++i];
+        }
+        GlobToken* previous = segment->n_tokens > 0 ? &segment->tokens[segment->n_tokens - 1] : NULL;
+        if (previous != NULL && previous->kind == GLOB_LITERAL && previous->text + previous->length == literal + literal_len) {
+            previous->length++;
+        } else {
+            *token = (GlobToken){GLOB_LITERAL, literal + literal_len, 1, NULL};
+            segment->n_tokens++;
+        }
+        literal[literal_len++] = c;
+        i++;
+    }
+    literal[literal_len] = '\0';
+
+    segment->literal = has_wildcard ? NULL : literal;
+    segment->matches_dot = segment->n_tokens > 0 && segment->tokens[0].kind == GLOB_LITERAL && segment->tokens[0].text[0] == '.';
+    return 0;
+}
+
+// Helper function to compile a glob pattern once, so matching never re-parses it.
+// Returns NULL when the pattern has no wildcards (or on allocation failure): the word
+// is then used as it is.
+GlobPattern* compile_glob(const char* pattern, Arena* arena) {
+    size_t len = strlen(pattern);
+    int max_segments = 1;
+    for (const char* p = pattern; (p = strchr(p, '/')) != NULL; p++) {
+        max_segments++;
+    }
+
+    GlobPattern* glob = arena_alloc(arena, sizeof(GlobPattern));
+    GlobSegment* segments = arena_alloc(arena, max_segments * sizeof(GlobSegment));
+    if (glob == NULL || segments == NULL) {
+        perror("compile_glob: allocation failed");
+        return NULL;
+    }
+    glob->segments = segments;
+    glob->n_segments = 0;
+    glob->is_absolute = pattern[0] == '/';
+    glob->dirs_only = len > 1 && pattern[len - 1] == '/';
+
+    int has_wildcard = 0;
+    const char* p = pattern;
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++; // Repeated slashes separate nothing
+            continue;
+        }
+        size_t segment_len = strcspn(p, "/");
+        GlobSegment* segment = &segments[glob->n_segments++];
+        if (compile_glob_segment(p, segment_len, segment, arena) < 0) {
+            perror("compile_glob: allocation failed");
+            return NULL;
+        }
+        has_wildcard |= segment->literal == NULL;
+        p += segment_len;
+    }
+    return has_wildcard ? glob : NULL;
+}
+
+// Helper function to match a name against compiled glob tokens. A failed match resumes
+// after the latest '*', one character further on, so no name is scanned more than
+// once per star.
+int glob_match_tokens(const GlobToken* tokens, int n_tokens, const char* name, size_t len) {
+    // A trailing literal (the ".o" of "*.o") must end the name: reject most names right away
+    const GlobToken* tail = n_tokens > 0 ? &tokens[n_tokens - 1] : NULL;
+    if (tail != NULL && tail->kind == GLOB_LITERAL &&
+        (len < tail->length || memcmp(name + len - tail->length, tail->text, tail->length) != 0)) {
+        return 0;
+    }
+
+    int t = 0;
+    size_t n = 0;
+    int star = -1;
+    size_t star_n = 0;
+
+    while (n < len) {
+        if (t < n_tokens) {
+            const GlobToken* token = &tokens[t];
+            if (token->kind == GLOB_STAR) {
+                star = t++;
+                star_n = n;
+                continue;
+            }
+            if (token->kind == GLOB_ANY ||
+                (token->kind == GLOB_CLASS && (token->members[(unsigned char)name[n] / 8] & (1 << ((unsigned char)name[n] % 8)))) ||
+                (token->kind == GLOB_LITERAL && len - n >= token->length && memcmp(name + n, token->text, token->length) == 0)) {
+                n += token->kind == GLOB_LITERAL ? token->length : 1;
+                t++;
+                continue;
+            }
+        }
+        if (star < 0) {
+            return 0;
+        }
+        t = star + 1;
+        n = ++star_n;
+    }
+
+    while (t < n_tokens && tokens[t].kind == GLOB_STAR) {
+        t++;
+    }
+    return t == n_tokens;
+}
+
+// Helper function to check a directory entry name against one pattern component; hidden
+// names only match a component that starts with a literal '.'
+int glob_segment_matches(const GlobSegment* segment, const char* name) {
+    if (name[0] == '.' && !segment->matches_dot) {
+        return 0;
+    }
+    return glob_match_tokens(segment->tokens, segment->n_tokens, name, strlen(name));
+}
+
+// Helper function to record the walk's current path as a match
+int add_glob_match(GlobWalk* walk, size_t path_len) {
+    if (walk->count == walk->capacity) {
+        int new_capacity = walk->capacity ? walk->capacity * 2 : 16;
+        char** grown = arena_resize(walk->arena, walk->matches, walk->capacity * sizeof(char*), new_capacity * sizeof(char*));
+        if (grown == NULL) {
+            perror("add_glob_match: allocation failed");
+            return -1;
+        }
+        walk->matches = grown;
+        walk->capacity = new_capacity;
+    }
+    walk->matches[walk->count] = arena_strndup(walk->arena, walk->path, path_len);
+    if (walk->matches[walk->count] == NULL) {
+        return -1;
+    }
+    walk->count++;
+    return 0;
+}
+
+// Helper function to extend the walk's path; returns the new length, or 0 if it would not fit
+size_t glob_path_append(GlobWalk* walk, size_t path_len, const char* text, int add_slash) {
+    size_t len = strlen(text);
+    if (path_len + len + 2 > sizeof(walk->path)) {
+        return 0;
+    }
+    memcpy(walk->path + path_len, text, len);
+    path_len += len;
+    if (add_slash) {
+        walk->path[path_len++] = '/';
+    }
+    walk->path[path_len] = '\0';
+    return path_len;
+}
+
+// Helper function to list the entries of the walk's current directory that a component
+// accepts (for ** every visible entry), from the cached snapshot. With copy_names set the
+// names are copied, since walking further directories may evict this snapshot.
+int list_glob_candidates(GlobWalk* walk, size_t path_len, const GlobSegment* segment, int copy_names, DirSnapshotEntry** out) {
+    walk->path[path_len] = '\0'; // Deeper walks may have left a longer path behind
+    DirSnapshot* snap = get_dir_snapshot(path_len > 0 ? walk->path : ".");
+    if (snap == NULL) {
+        return 0;
+    }
+
+    // A leading literal narrows the search to one contiguous range of the sorted listing
+    int lo = 0;
+    int hi = snap->count;
+    if (!segment->is_globstar && segment->n_tokens > 0 && segment->tokens[0].kind == GLOB_LITERAL) {
+        const GlobToken* prefix = &segment->tokens[0];
+        int end = snap->count;
+        while (lo < end) {
+            int mid = lo + (end - lo) / 2;
+            if (strncmp(snap->entries[mid].name, prefix->text, prefix->length) < 0) {
+                lo = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+        hi = lo;
+        while (hi < snap->count && strncmp(snap->entries[hi].name, prefix->text, prefix->length) == 0) {
+            hi++;
+        }
+    }
+
+    DirSnapshotEntry* candidates = arena_alloc(walk->arena, (hi - lo + 1) * sizeof(DirSnapshotEntry));
+    if (candidates == NULL) {
+        return -1;
+    }
+    int n = 0;
+    for (int i = lo; i < hi; i++) {
+        const DirSnapshotEntry* entry = &snap->entries[i];
+        if (segment->is_globstar ? entry->name[0] == '.' : !glob_segment_matches(segment, entry->name)) {
+            continue;
+        }
+        candidates[n] = *entry;
+        if (copy_names && (candidates[n].name = arena_strdup(walk->arena, entry->name)) == NULL) {
+            return -1;
+        }
+        n++;
+    }
+    *out = candidates;
+    return n;
+}
+
+// Helper function to expand pattern components from seg on, below the walk's current
+// path (a directory prefix of path_len bytes)
+int glob_walk_from(GlobWalk* walk, int seg, size_t path_len) {
+    const GlobPattern* pattern = walk->pattern;
+    const GlobSegment* segment = &pattern->segments[seg];
+    int is_last = seg == pattern->n_segments - 1;
+
+    if (segment->literal != NULL) {
+        // A component without wildcards is used as written, only checked at the end
+        size_t new_len = glob_path_append(walk, path_len, segment->literal, !is_last || pattern->dirs_only);
+        if (new_len == 0) {
+            return 0;
+        }
+        if (!is_last) {
+            return glob_walk_from(walk, seg + 1, new_len);
+        }
+        struct stat st;
+        if (pattern->dirs_only ? stat(walk->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(walk->path, &st) == 0) {
+            return add_glob_match(walk, new_len);
+        }
+        return 0;
+    }
+
+    // ** followed by more components also matches no directory at all
+    if (segment->is_globstar && !is_last && glob_walk_from(walk, seg + 1, path_len) < 0) {
+        return -1;
+    }
+
+    DirSnapshotEntry* candidates;
+    int n = list_glob_candidates(walk, path_len, segment, !is_last || segment->is_globstar, &candidates);
+    for (int i = 0; i < n; i++) {
+        const DirSnapshotEntry* entry = &candidates[i];
+        if (is_last && (!pattern->dirs_only || entry->is_dir)) {
+            size_t new_len = glob_path_append(walk, path_len, entry->name, pattern->dirs_only);
+            if (new_len > 0 && add_glob_match(walk, new_len) < 0) {
+                return -1;
+            }
+        }
+        if (!entry->is_dir || (segment->is_globstar && entry->is_link) || (is_last && !segment->is_globstar)) {
+            continue;
+        }
+
+        // Descend: ** stays on its component (symlinks are not followed), others move on
+        size_t new_len = glob_path_append(walk, path_len, entry->name, 1);
+        if (new_len > 0 && glob_walk_from(walk, segment->is_globstar ? seg : seg + 1, new_len) < 0) {
+            return -1;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+// Helper function to order glob matches by name
+int compare_glob_matches(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Helper function to expand a compiled glob pattern into the sorted list of matching
+// paths, read through the directory snapshot cache so every directory is listed once
+// while it is unchanged. Returns the number of matches (0 leaves the word as written).
+int expand_glob(const GlobPattern* pattern, Arena* arena, char*** matches_out) {
+    GlobWalk* walk = arena_alloc(arena, sizeof(GlobWalk));
+    if (walk == NULL) {
+        return -1;
+    }
+    walk->pattern = pattern;
+    walk->arena = arena;
+    walk->matches = NULL;
+    walk->count = 0;
+    walk->capacity = 0;
+    walk->path[0] = '\0';
+
+    size_t path_len = pattern->is_absolute ? glob_path_append(walk, 0, "/", 0) : 0;
+    if (pattern->n_segments > 0 && glob_walk_from(walk, 0, path_len) < 0) {
+        return -1;
+    }
+
+    // Matches from a single directory already come out in order
+    int sorted = 1;
+    for (int i = 1; i < walk->count && sorted; i++) {
+        sorted = strcmp(walk->matches[i - 1], walk->matches[i]) <= 0;
+    }
+    if (!sorted) {
+        qsort(walk->matches, walk->count, sizeof(char*), compare_glob_matches);
+    }
+    *matches_out = walk->matches;
+    return walk->count;
+}
+
+// Generator function for filename completion, answered from a cached sorted snapshot
+char* filename_generator(const char* text, int state) {
+    static DirSnapshot* snap = NULL;
+    static int entry_idx;
+    static char* static_prefix = NULL; // Persists across calls when state != 0
+    static size_t prefix_len;
+    static char dir_path[PATH_MAX]; // Persists to reconstruct full path
+
+    // State 0 means this is the first call for this completion request
+    if (!state) {
+        rl_filename_completion_desired = 1;
+
+        // Find the last occurrence of '/'
+        const char* last_slash = strrchr(text, '/');
+
+        if (last_slash != NULL) {
+            // Copy directory portion (including the '/') and whatever follows as the search prefix
+            size_t dir_len = (last_slash - text) + 1;
+            snprintf(dir_path, sizeof(dir_path), "%.*s", (int)dir_len, text);
+            free(static_prefix);
+            static_prefix = strdup(last_slash + 1);
+        }
+        else {
+            // Fallback: No slash means current directory
+            strcpy(dir_path, ""); // Keep empty so that full path stitching works later
+            free(static_prefix);
+            static_prefix = strdup(text);
+        }
+        if (static_prefix == NULL) {
+            perror("filename_generator: strdup failed");
+            snap = NULL;
+            return NULL;
+        }
+        prefix_len = strlen(static_prefix);
+
+        snap = get_dir_snapshot(dir_path[0] != '\0' ? dir_path : ".");
+        if (snap == NULL) {
+            perror("filename_generator: opendir failed");
+            return NULL;
+        }
+
+        // Binary search for the first name not ordered before the prefix
+        int lo = 0;
+        int hi = snap->count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (strcmp(snap->entries[mid].name, static_prefix) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        entry_idx = lo;
+    }
+
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    // Matches for the prefix are contiguous in the sorted snapshot
+    if (entry_idx < snap->count && strncmp(snap->entries[entry_idx].name, static_prefix, prefix_len) == 0) {
+        const DirSnapshotEntry* entry = &snap->entries[entry_idx++];
+
+        // Completion for directories
+        rl_completion_append_character = entry->is_dir ? '/' : ' ';
+
+        char full_match[PATH_MAX];
+        snprintf(full_match, sizeof(full_match), "%s%s", dir_path, entry->name);
+
+        // Return match. Readline will call again with state != 0
+        return strdup(full_match);
+    }
+
+    snap = NULL;
+    return NULL;
+}
+
+// Generator function for builtin command completion
+char** builtin_completion(const char* text, int start, int end) {
+    // Always reset to the default space at the beginning of a new TAB press
+    rl_completion_append_character = ' ';
+
+    if (start == 0) {
+        // User is completing command name
+        rl_attempted_completion_over = 1;
+        return rl_completion_matches(text, command_generator);
+    }
+    else {
+        // User is completing an argument
+        CompletionSystem* sys = get_set_completion_context(NULL);
+
+        // The command name is the first word of the line, however long the line is
+        const char* line = rl_line_buffer + strspn(rl_line_buffer, " \t");
+        char* cmd_name = strndup(line, strcspn(line, " \t"));
+        int has_completer = cmd_name && *cmd_name && sys && find_completion_index(sys, cmd_name) != -1;
+        free(cmd_name);
+        if (has_completer) {
+            rl_attempted_completion_over = 1;
+            rl_completion_append_character = ' ';
+
+            // Override entry function to route directly to local-state generator
+            return rl_completion_matches(text, script_completion_generator);
+        }
+
+        // Fallback to default file/directory behavior if no custom script is registered
+        rl_attempted_completion_over = 0;
+        return rl_completion_matches(text, filename_generator);
+    }
+}
+
+// Helper function to record a redirection as an fd operation, given its expanded target
+// (the expanded body for here-documents).
+// Returns 0, or -1 after reporting a malformed redirection.
+int add_redirection(RedirectionInfo* redir, const AstRedir* ast_redir, char* target, Arena* arena) {
+    RedirOp* op;
+    switch (ast_redir->kind) {
+        case TOKEN_REDIR_OUT:
+        case TOKEN_REDIR_APPEND:
+            op = add_redirection_op(redir, REDIR_OPEN, ast_redir->fd);
+            op->open_flags = O_WRONLY | O_CREAT | (ast_redir->kind == TOKEN_REDIR_APPEND ? O_APPEND : O_TRUNC);
+            op->word = target;
+            return 0;
+        case TOKEN_REDIR_IN:
+            op = add_redirection_op(redir, REDIR_OPEN, ast_redir->fd);
+            op->open_flags = O_RDONLY;
+            op->word = target;
+            return 0;
+        case TOKEN_REDIR_DUP: {
+            if (strcmp(target, "-") == 0) {
+                add_redirection_op(redir, REDIR_CLOSE, ast_redir->fd);
+                return 0;
+            }
+            char* num_end;
+            long source = strtol(target, &num_end, 10);
+            if (*target == '\0' || *num_end != '\0' || source < 0 || source > INT_MAX) {
+                fprintf(stderr, "shell: %s: ambiguous redirect\n", target);
+                return -1;
+            }
+            op = add_redirection_op(redir, REDIR_DUP, ast_redir->fd);
+            op->source_fd = (int)source;
+            return 0;
+        }
+        case TOKEN_HEREDOC:
+            // For here-documents the expanded target is the body itself
+            op = add_redirection_op(redir, REDIR_HEREDOC, ast_redir->fd);
+            op->body = target;
+            op->body_len = strlen(target);
+            return 0;
+        case TOKEN_HERESTRING: {
+            // A here-string is a one-line here-document that is already known
+            size_t len = strlen(target);
+            op = add_redirection_op(redir, REDIR_HEREDOC, ast_redir->fd);
+            op->body = arena_alloc(arena, len + 2);
+            if (op->body == NULL) {
+                return -1;
+            }
+            memcpy(op->body, target, len);
+            op->body[len] = '\n';
+            op->body[len + 1] = '\0';
+            op->body_len = len + 1;
+            return 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Helper function to set up an input source over a string the shell does not own (-c)
+void init_string_input(InputSource* in, const char* text) {
+    memset(in, 0, sizeof(*in));
+    in->data = text;
+    in->length = strlen(text);
+    in->fd = -1;
+    in->sync_fd = -1;
+}
+
+// Helper function to set up an input source over an open descriptor. Regular files are
+// mmap'd whole; pipes and other streams are read in IO_CHUNK_SIZE blocks.
+// Returns 0, or -1 with errno set.
+int init_fd_input(InputSource* in, int fd) {
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->sync_fd = -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        if (start < 0) {
+            start = 0;
+        }
+        if (st.st_size > start) {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                in->map = map;
+                in->map_length = st.st_size;
+                in->data = (const char*)map + start;
+                in->length = st.st_size - start;
+                in->sync_base = start;
+                return 0;
+            }
+        } else {
+            return 0; // Nothing left to read
+        }
+    }
+
+    in->fd = fd;
+    return 0;
+}
+
+// Helper function to release what an input source mapped or buffered
+void free_input_source(InputSource* in) {
+    if (in->map != NULL) {
+        munmap(in->map, in->map_length);
+        in->map = NULL;
+    }
+    free(in->buffer);
+    in->buffer = NULL;
+}
+
+// Helper function to pull the next block from a streamed source into its buffer, dropping
+// the bytes already consumed. Returns the number of bytes added, 0 at end of input.
+ssize_t fill_input_buffer(InputSource* in) {
+    if (in->offset > 0) {
+        memmove(in->buffer, in->buffer + in->offset, in->buffer_length - in->offset);
+        in->buffer_length -= in->offset;
+        in->offset = 0;
+    }
+
+    if (in->buffer_length + IO_CHUNK_SIZE > in->buffer_capacity) {
+        size_t new_capacity = in->buffer_capacity ? in->buffer_capacity * 2 : IO_CHUNK_SIZE;
+        while (in->buffer_length + IO_CHUNK_SIZE > new_capacity) {
+            new_capacity *= 2;
+        }
+        char* new_buffer = realloc(in->buffer, new_capacity);
+        if (new_buffer == NULL) {
+            perror("fill_input_buffer: realloc failed");
+            return -1;
+        }
+        in->buffer = new_buffer;
+        in->buffer_capacity = new_capacity;
+    }
+
+    ssize_t n;
+    do {
+        n = read(in->fd, in->buffer + in->buffer_length, IO_CHUNK_SIZE);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        in->buffer_length += n;
+    }
+    return n;
+}
+
+void init_interactive_input(void);
+
+// Helper function to read the next input line without its newline, as a malloc'd string
+// the caller frees (like readline). Returns NULL at end of input.
+char* read_input_line(InputSource* in, const char* prompt) {
+    if (in->interactive) {
+        // Readline is configured on first use, so the shell pays for it only when it prompts
+        if (!in->readline_ready) {
+            init_interactive_input();
+            in->readline_ready = 1;
+        }
+        return readline(prompt);
+    }
+
+    if (in->fd != -1) {
+        // Streamed input: read blocks until a full line (or the end) is buffered
+        char* newline = NULL;
+        while (!in->at_eof) {
+            newline = in->buffer ? memchr(in->buffer + in->offset, '\n', in->buffer_length - in->offset) : NULL;
+            if (newline != NULL) {
+                break;
+            }
+            if (fill_input_buffer(in) <= 0) {
+                in->at_eof = 1;
+            }
+        }
+        if (newline == NULL && in->buffer != NULL) {
+            newline = memchr(in->buffer + in->offset, '\n', in->buffer_length - in->offset);
+        }
+
+        size_t available = in->buffer_length - in->offset;
+        if (available == 0) {
+            return NULL;
+        }
+        size_t line_length = newline ? (size_t)(newline - (in->buffer + in->offset)) : available;
+        char* line = strndup(in->buffer + in->offset, line_length);
+        in->offset += line_length + (newline != NULL);
+        return line;
+    }
+
+    // A command that read from the shared stdin may have moved past lines we mapped
+    if (in->sync_fd != -1) {
+        off_t position = lseek(in->sync_fd, 0, SEEK_CUR);
+        if (position >= in->sync_base + (off_t)in->offset) {
+            in->offset = position - in->sync_base;
+        }
+    }
+
+    if (in->offset >= in->length) {
+        return NULL;
+    }
+    const char* start = in->data + in->offset;
+    const char* newline = memchr(start, '\n', in->length - in->offset);
+    size_t line_length = newline ? (size_t)(newline - start) : in->length - in->offset;
+    in->offset += line_length + (newline != NULL);
+
+    // Commands reading the same stdin must continue right after the consumed lines
+    if (in->sync_fd != -1) {
+        lseek(in->sync_fd, in->sync_base + in->offset, SEEK_SET);
+    }
+    return strndup(start, line_length);
+}
+
+// Helper function to parse the command of a substitution, once, into the word's arena
+AstNode* parse_command_substitution(const char* command, Arena* arena) {
+    int incomplete = 0;
+    TokenList* tokens = parse_arguments(command, 1, &incomplete, arena);
+    AstNode* ast = tokens ? build_ast(tokens, arena, &incomplete) : NULL;
+    if (ast == NULL && incomplete) {
+        fprintf(stderr, "shell: syntax error: unexpected end of file\n");
+    }
+    return ast;
+}
+
+// Helper function to turn a WORD token's resolved text into an AST word: literal runs and
+// the parameter references and command substitutions the lexer found, whose commands are
+// parsed here. glob is the word's pattern form when it has unquoted wildcards, else NULL.
+int build_ast_word(AstWord* word, const Token* token, const char* glob, Arena* arena) {
+    size_t len = strlen(token->text);
+    char* text = arena_strndup(arena, token->text, len);
+    if (text == NULL) {
+        return -1;
+    }
+    word->text = text;
+    word->parts = NULL;
+    word->n_parts = 0;
+    word->has_params = 0;
+    word->has_glob = glob != NULL;
+    word->glob = NULL;
+
+    if (token->n_params == 0 && token->n_substs == 0) {
+        // The pattern is known now, so it is compiled once with the (cached) AST
+        if (glob != NULL) {
+            word->glob = compile_glob(glob, arena);
+        }
+        return 0;
+    }
+
+    // Every reference or substitution adds itself and at most one literal run before it
+    int max_parts = 1 + 2 * (token->n_params + token->n_substs);
+    word->parts = arena_alloc(arena, max_parts * sizeof(WordPart));
+    if (word->parts == NULL) {
+        return -1;
+    }
+    word->has_params = 1;
+
+    // Both lists are in text order, so they are merged like two sorted runs
+    size_t pos = 0;
+    int r = 0;
+    int s = 0;
+    while (r < token->n_params || s < token->n_substs) {
+        int take_subst = r == token->n_params || (s < token->n_substs && token->substs[s].start < token->params[r].start);
+        size_t start = take_subst ? token->substs[s].start : token->params[r].start;
+        if (start > pos) {
+            word->parts[word->n_parts++] = (WordPart){PART_LITERAL, text + pos, start - pos, NULL, 0};
+        }
+
+        if (take_subst) {
+            const WordSubst* subst = &token->substs[s++];
+            AstNode* command = parse_command_substitution(subst->command, arena);
+            if (command == NULL) {
+                return -1;
+            }
+            word->parts[word->n_parts++] = (WordPart){PART_COMMAND, text + subst->start, subst->length, command, subst->quoted};
+            pos = subst->start + subst->length;
+        } else {
+            // The name is what lies between "$" or "${" and the closing brace, if any
+            const WordParam* param = &token->params[r++];
+            const char* name = text + param->start + 1;
+            size_t name_len = param->length - 1;
+            if (*name == '{') {
+                name++;
+                name_len -= 1 + (text[param->start + param->length - 1] == '}');
+            }
+            word->parts[word->n_parts++] = (WordPart){PART_PARAM, name, name_len, NULL, param->quoted};
+            pos = param->start + param->length;
+        }
+    }
+    if (len > pos) {
+        word->parts[word->n_parts++] = (WordPart){PART_LITERAL, text + pos, len - pos, NULL, 0};
+    }
+    return 0;
+}
+
+// Helper function to check whether a token is the reserved word keyword, written unquoted
+int token_is_keyword(const Token* token, const char* keyword) {
+    size_t len = strlen(keyword);
+    return token->kind == TOKEN_WORD && token->length == len && memcmp(token->start, keyword, len) == 0;
+}
+
+// Helper function to check whether a token is a redirection operator
+int token_is_redirection(const Token* token) {
+    return token->kind == TOKEN_REDIR_OUT || token->kind == TOKEN_REDIR_APPEND || token->kind == TOKEN_REDIR_IN ||
+           token->kind == TOKEN_REDIR_DUP || token->kind == TOKEN_HEREDOC || token->kind == TOKEN_HERESTRING;
+}
+
+// Helper function to look at the parser's next token, NULL at the end of input
+Token* parser_peek(Parser* p) {
+    return p->pos < p->tokens->count ? &p->tokens->tokens[p->pos] : NULL;
+}
+
+// Helper function to check whether the next token is the given unquoted reserved word
+int parser_at_keyword(Parser* p, const char* keyword) {
+    Token* token = parser_peek(p);
+    return token != NULL && token_is_keyword(token, keyword);
+}
+
+// Helper function to check whether a list ends here: end of input or a reserved word
+// that closes an enclosing compound command
+int parser_at_list_end(Parser* p) {
+    static const char* closers[] = {"then", "elif", "else", "fi", "do", "done", NULL};
+    Token* token = parser_peek(p);
+    if (token == NULL) {
+        return 1;
+    }
+    for (int i = 0; closers[i] != NULL; i++) {
+        if (token_is_keyword(token, closers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to step over line breaks, which are allowed between most tokens
+void parser_skip_newlines(Parser* p) {
+    while (p->pos < p->tokens->count && p->tokens->tokens[p->pos].kind == TOKEN_NEWLINE) {
+        p->pos++;
+    }
+}
+
+// Helper function to reject the next token. Running out of tokens is not an error but a
+// request for more input, since the construct may continue on the next line.
+void parser_error(Parser* p) {
+    Token* token = parser_peek(p);
+    if (token == NULL) {
+        p->incomplete = 1;
+    } else if (!p->failed) {
+        if (token->kind == TOKEN_NEWLINE) {
+            fprintf(stderr, "shell: syntax error near unexpected token `newline'\n");
+        } else {
+            fprintf(stderr, "shell: syntax error near unexpected token `%.*s'\n", (int)token->length, token->start);
+        }
+    }
+    p->failed = 1;
+}
+
+// Helper function to consume a required reserved word; 0 on success
+int parser_expect_keyword(Parser* p, const char* keyword) {
+    if (!parser_at_keyword(p, keyword)) {
+        parser_error(p);
+        return -1;
+    }
+    p->pos++;
+    return 0;
+}
+
+// Helper function to allocate a zeroed AST node
+AstNode* new_ast_node(Parser* p, AstNodeKind kind) {
+    AstNode* node = arena_alloc(p->arena, sizeof(AstNode));
+    if (node == NULL) {
+        p->failed = 1;
+        return NULL;
+    }
+    memset(node, 0, sizeof(*node));
+    node->kind = kind;
+    return node;
+}
+
+// Helper function to parse the redirection whose operator is the next token. Here-document
+// bodies are literal when any part of the delimiter was quoted.
+int parse_redirection(Parser* p, AstRedir* redir) {
+    Token* token = &p->tokens->tokens[p->pos++];
+    Token* target = parser_peek(p);
+    if (target == NULL || target->kind != TOKEN_WORD) {
+        parser_error(p);
+        return -1;
+    }
+    p->pos++;
+
+    redir->kind = token->kind;
+    redir->fd = token->fd;
+    if (build_ast_word(&redir->target, target, NULL, p->arena) < 0) {
+        return -1;
+    }
+    memset(&redir->body, 0, sizeof(redir->body));
+    if (token->kind == TOKEN_HEREDOC) {
+        int quoted = memchr(target->start, '\'', target->length) != NULL ||
+                     memchr(target->start, '"', target->length) != NULL ||
+                     memchr(target->start, '\\', target->length) != NULL;
+        char* body = token->text ? token->text : "";
+        if (quoted) {
+            redir->body.text = arena_strdup(p->arena, body);
+        } else {
+            // The body is not lexed, so it becomes a word of its own for build_ast_word
+            Token body_word = {TOKEN_WORD, -1, body, NULL, NULL, 0, NULL, 0, token->start, token->length};
+            if (find_word_expansions(&body_word, p->arena) < 0 || build_ast_word(&redir->body, &body_word, NULL, p->arena) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to parse the redirections that may follow a compound command
+int parse_compound_redirections(Parser* p, AstNode* node) {
+    int n = 0;
+    for (int i = p->pos; i < p->tokens->count && token_is_redirection(&p->tokens->tokens[i]); i += 2) {
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    node->redirs = arena_alloc(p->arena, n * sizeof(AstRedir));
+    if (node->redirs == NULL) {
+        return -1;
+    }
+    while (node->n_redirs < n) {
+        if (parse_redirection(p, &node->redirs[node->n_redirs++]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to parse a simple command: words and redirections up to an operator.
+// A command with neither is a syntax error at the token found instead.
+int parse_simple_command(Parser* p, AstCommand* command) {
+    // Count ahead so the arrays can be sized exactly
+    int n_words = 0;
+    int n_redirs = 0;
+    for (int i = p->pos; i < p->tokens->count; i++) {
+        Token* token = &p->tokens->tokens[i];
+        if (token->kind == TOKEN_WORD) {
+            n_words++;
+        } else if (token_is_redirection(token)) {
+            n_redirs++;
+            i++; // Skip the target
+        } else {
+            break;
+        }
+    }
+    if (n_words == 0 && n_redirs == 0) {
+        parser_error(p);
+        return -1;
+    }
+
+    command->n_words = 0;
+    command->n_redirs = 0;
+    command->words = arena_alloc(p->arena, (n_words + 1) * sizeof(AstWord));
+    command->redirs = arena_alloc(p->arena, (n_redirs + 1) * sizeof(AstRedir));
+    if (command->words == NULL || command->redirs == NULL) {
+        return -1;
+    }
+
+    while (command->n_words < n_words || command->n_redirs < n_redirs) {
+        Token* token = parser_peek(p);
+        if (token->kind == TOKEN_WORD) {
+            // Unquoted `NAME=value` words before the command name are assignments
+            if (command->n_assigns == command->n_words && assignment_name_length(token->start, token->length) > 0) {
+                command->n_assigns++;
+            }
+            if (build_ast_word(&command->words[command->n_words++], token, token->glob, p->arena) < 0) {
+                return -1;
+            }
+            p->pos++;
+        } else if (parse_redirection(p, &command->redirs[command->n_redirs++]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+AstNode* parse_list(Parser* p);
+
+// Helper function to parse `if list then list [elif list then list]... [else list] fi`,
+// after the `if` or `elif`; an elif chain becomes nested if nodes sharing one `fi`
+AstNode* parse_if_clause(Parser* p) {
+    AstNode* node = new_ast_node(p, NODE_IF);
+    if (node == NULL || (node->first = parse_list(p)) == NULL || parser_expect_keyword(p, "then") < 0 ||
+        (node->second = parse_list(p)) == NULL) {
+        return NULL;
+    }
+
+    if (parser_at_keyword(p, "elif")) {
+        p->pos++;
+        node->third = parse_if_clause(p);
+        return node->third ? node : NULL;
+    }
+    if (parser_at_keyword(p, "else")) {
+        p->pos++;
+        if ((node->third = parse_list(p)) == NULL) {
+            return NULL;
+        }
+    }
+    return parser_expect_keyword(p, "fi") == 0 ? node : NULL;
+}
+
+// Helper function to parse `while|until list do list done`, after the keyword
+AstNode* parse_while_clause(Parser* p, int until) {
+    AstNode* node = new_ast_node(p, NODE_WHILE);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->until = until;
+    if ((node->first = parse_list(p)) == NULL || parser_expect_keyword(p, "do") < 0 ||
+        (node->second = parse_list(p)) == NULL || parser_expect_keyword(p, "done") < 0) {
+        return NULL;
+    }
+    return node;
+}
+
+// Helper function to parse `for name [in word...] ; do list done`, after the `for`
+AstNode* parse_for_clause(Parser* p) {
+    AstNode* node = new_ast_node(p, NODE_FOR);
+    Token* name = parser_peek(p);
+    if (node == NULL || name == NULL || name->kind != TOKEN_WORD || !is_valid_var_identifier(name->text)) {
+        parser_error(p);
+        return NULL;
+    }
+    node->for_var = arena_strdup(p->arena, name->text);
+    p->pos++;
+    parser_skip_newlines(p);
+
+    if (parser_at_keyword(p, "in")) {
+        p->pos++;
+        node->for_has_in = 1;
+        int n = 0;
+        while (p->pos + n < p->tokens->count && p->tokens->tokens[p->pos + n].kind == TOKEN_WORD) {
+            n++;
+        }
+        node->for_items = arena_alloc(p->arena, (n + 1) * sizeof(AstWord));
+        if (node->for_items == NULL) {
+            return NULL;
+        }
+        for (; node->n_for_items < n; node->n_for_items++) {
+            Token* item = &p->tokens->tokens[p->pos++];
+            if (build_ast_word(&node->for_items[node->n_for_items], item, item->glob, p->arena) < 0) {
+                return NULL;
+            }
+        }
+        Token* separator = parser_peek(p);
+        if (separator == NULL || (separator->kind != TOKEN_SEMI && separator->kind != TOKEN_NEWLINE)) {
+            parser_error(p);
+            return NULL;
+        }
+        p->pos++;
+    } else if (parser_peek(p) != NULL && parser_peek(p)->kind == TOKEN_SEMI) {
+        p->pos++;
+    }
+
+    parser_skip_newlines(p);
+    if (parser_expect_keyword(p, "do") < 0 || (node->second = parse_list(p)) == NULL ||
+        parser_expect_keyword(p, "done") < 0) {
+        return NULL;
+    }
+    return node;
+}
+
+// Helper function to copy the source text of tokens first up to the parser position
+const char* parser_source(Parser* p, int first) {
+    const Token* start = &p->tokens->tokens[first];
+    const Token* end = &p->tokens->tokens[p->pos - 1];
+    return arena_strndup(p->arena, start->start, end->start + end->length - start->start);
+}
+
+// Helper function to parse a compound command (if, while, until, for) with its trailing
+// redirections. Returns NULL without consuming anything when no reserved word starts one.
+AstNode* parse_compound_command(Parser* p) {
+    int first = p->pos;
+    AstNode* node = NULL;
+    if (parser_at_keyword(p, "if")) {
+        p->pos++;
+        node = parse_if_clause(p);
+    } else if (parser_at_keyword(p, "while") || parser_at_keyword(p, "until")) {
+        int until = parser_at_keyword(p, "until");
+        p->pos++;
+        node = parse_while_clause(p, until);
+    } else if (parser_at_keyword(p, "for")) {
+        p->pos++;
+        node = parse_for_clause(p);
+    } else {
+        return NULL;
+    }
+
+    if (node == NULL || parse_compound_redirections(p, node) < 0) {
+        return NULL;
+    }
+    node->source = parser_source(p, first);
+    return node;
+}
+
+// Helper function to parse one pipeline: `[time] [!] command [| command]...`. A compound command
+// on its own is returned as is, so it runs inside the shell.
+AstNode* parse_pipeline(Parser* p) {
+    if (parser_at_keyword(p, "time")) {
+        p->pos++;
+        AstNode* node = new_ast_node(p, NODE_TIME);
+        if (node == NULL) {
+            return NULL;
+        }
+
+        // A bare `time` times nothing; anything else must be a pipeline
+        Token* token = parser_peek(p);
+        if (token == NULL || token->kind == TOKEN_SEMI || token->kind == TOKEN_NEWLINE || token->kind == TOKEN_AMP ||
+            token->kind == TOKEN_AND || token->kind == TOKEN_OR || parser_at_list_end(p)) {
+            return node;
+        }
+        node->first = parse_pipeline(p);
+        return node->first ? node : NULL;
+    }
+    if (parser_at_keyword(p, "!")) {
+        p->pos++;
+        AstNode* node = new_ast_node(p, NODE_NOT);
+        if (node == NULL || (node->first = parse_pipeline(p)) == NULL) {
+            return NULL;
+        }
+        return node;
+    }
+
+    AstNode* node = new_ast_node(p, NODE_PIPELINE);
+    AstPipeline* pipeline = arena_alloc(p->arena, sizeof(AstPipeline));
+    if (node == NULL || pipeline == NULL) {
+        return NULL;
+    }
+    memset(pipeline, 0, sizeof(*pipeline));
+    node->pipeline = pipeline;
+    int capacity = 0;
+
+    while (1) {
+        if (pipeline->n_commands == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 2;
+            AstCommand* grown = arena_resize(p->arena, pipeline->commands, capacity * sizeof(AstCommand), new_capacity * sizeof(AstCommand));
+            if (grown == NULL) {
+                return NULL;
+            }
+            pipeline->commands = grown;
+            capacity = new_capacity;
+        }
+        AstCommand* command = &pipeline->commands[pipeline->n_commands++];
+        memset(command, 0, sizeof(*command));
+
+        command->compound = parse_compound_command(p);
+        if (command->compound == NULL && (p->failed || p->incomplete || parse_simple_command(p, command) < 0)) {
+            return NULL;
+        }
+
+        // A line break may follow each '|'
+        Token* token = parser_peek(p);
+        if (token == NULL || token->kind != TOKEN_PIPE) {
+            break;
+        }
+        p->pos++;
+        parser_skip_newlines(p);
+    }
+
+    if (pipeline->n_commands == 1 && pipeline->commands[0].compound != NULL) {
+        return pipeline->commands[0].compound;
+    }
+    return node;
+}
+
+// Helper function to parse `pipeline [&& pipeline | || pipeline]...`
+AstNode* parse_and_or(Parser* p) {
+    AstNode* left = parse_pipeline(p);
+    while (left != NULL) {
+        Token* token = parser_peek(p);
+        if (token == NULL || (token->kind != TOKEN_AND && token->kind != TOKEN_OR)) {
+            break;
+        }
+        p->pos++;
+        parser_skip_newlines(p);
+
+        AstNode* node = new_ast_node(p, token->kind == TOKEN_AND ? NODE_AND : NODE_OR);
+        if (node == NULL || (node->second = parse_pipeline(p)) == NULL) {
+            return NULL;
+        }
+        node->first = left;
+        left = node;
+    }
+    return left;
+}
+
+// Helper function to parse a list: and-or lists separated by ';', '&' or line breaks, up
+// to the end of input or a reserved word closing an enclosing construct
+AstNode* parse_list(Parser* p) {
+    AstNode* list = new_ast_node(p, NODE_LIST);
+    if (list == NULL) {
+        return NULL;
+    }
+    int capacity = 0;
+
+    while (1) {
+        parser_skip_newlines(p);
+        if (parser_at_list_end(p)) {
+            break;
+        }
+
+        int first_token = p->pos;
+        AstNode* item = parse_and_or(p);
+        if (item == NULL) {
+            return NULL;
+        }
+        if (list->n_children == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 4;
+            AstNode** grown = arena_resize(p->arena, list->children, capacity * sizeof(AstNode*), new_capacity * sizeof(AstNode*));
+            if (grown == NULL) {
+                return NULL;
+            }
+            list->children = grown;
+            capacity = new_capacity;
+        }
+        list->children[list->n_children++] = item;
+
+        Token* token = parser_peek(p);
+        if (token == NULL) {
+            break;
+        }
+        if (token->kind == TOKEN_AMP) {
+            item->is_background = 1;
+            if (item->kind != NODE_PIPELINE) {
+                // Keep the text for the job table, which shows what runs in the background
+                item->source = parser_source(p, first_token);
+            }
+            p->pos++;
+        } else if (token->kind == TOKEN_SEMI || token->kind == TOKEN_NEWLINE) {
+            p->pos++;
+        } else if (!parser_at_list_end(p)) {
+            parser_error(p);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+// Helper function to build the AST for a lexed command line. Returns NULL after reporting
+// a syntax error, or with *incomplete set when the line needs another line to finish.
+AstNode* build_ast(TokenList* tokens, Arena* arena, int* incomplete) {
+    Parser parser = {tokens, 0, arena, 0, 0};
+    AstNode* ast = parse_list(&parser);
+    if (ast != NULL && parser.pos < tokens->count) {
+        // A closing reserved word without its construct
+        parser_error(&parser);
+        ast = NULL;
+    }
+    *incomplete = parser.incomplete;
+    return ast;
+}
+
+// Helper function to get the AST for a command line, from the LRU cache when the same
+// text was parsed before. Lexer scratch space comes from scratch; the AST lives in its
+// cache entry until evicted. Returns NULL on a syntax error (which is not cached), with
+// *incomplete set instead when more lines are needed; at_eof turns that into an error.
+AstNode* get_parsed_line(const char* line, int at_eof, int* incomplete, Arena* scratch) {
+    size_t len = strlen(line);
+    unsigned int hash = hash_bytes(line, len);
+    *incomplete = 0;
+
+    AstCacheEntry* victim = &ast_cache[0];
+    for (int i = 0; i < AST_CACHE_SIZE; i++) {
+        AstCacheEntry* entry = &ast_cache[i];
+        if (entry->line != NULL && entry->hash == hash && strcmp(entry->line, line) == 0) {
+            entry->last_used = ++ast_cache_clock;
+            return entry->ast;
+        }
+
+        // Prefer an unused slot, otherwise the least recently used one
+        if (victim->line != NULL && (entry->line == NULL || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+
+    long long started = trace_start();
+    TokenList* tokens = parse_arguments(line, at_eof, incomplete, scratch);
+    if (tokens == NULL) {
+        trace_phase(TRACE_TOKENIZE, started);
+        return NULL;
+    }
+
+    // Unused slots hold an empty arena, so resetting covers both cases
+    arena_reset(&victim->arena);
+    victim->line = NULL;
+
+    AstNode* ast = build_ast(tokens, &victim->arena, incomplete);
+    trace_phase(TRACE_TOKENIZE, started);
+    if (ast == NULL && *incomplete && at_eof) {
+        fprintf(stderr, "shell: syntax error: unexpected end of file\n");
+        *incomplete = 0;
+    }
+    char* key = ast ? arena_strndup(&victim->arena, line, len) : NULL;
+    if (key == NULL) {
+        arena_reset(&victim->arena);
+        return NULL;
+    }
+    victim->line = key;
+    victim->hash = hash;
+    victim->ast = ast;
+    victim->last_used = ++ast_cache_clock;
+    return ast;
+}
+
+// Helper function to get the builtin a substitution consists of when the shell may run
+// it itself: one simple command named literally, without assignments or redirections,
+// whose builtin leaves the shell's state alone. NULL when a subshell is needed.
+const BuiltinCommand* find_substitution_builtin(const AstNode* node) {
+    if (node->kind == NODE_LIST && node->n_children == 1) {
+        node = node->children[0];
+    }
+    if (node->kind != NODE_PIPELINE || node->is_background || node->pipeline->n_commands != 1) {
+        return NULL;
+    }
+    const AstCommand* command = &node->pipeline->commands[0];
+    if (command->compound != NULL || command->n_assigns > 0 || command->n_redirs > 0 ||
+        command->n_words == 0 || command->words[0].has_params) {
+        return NULL;
+    }
+    const BuiltinCommand* builtin = find_builtin(command->words[0].text);
+    return (builtin != NULL && builtin->in_substitution) ? builtin : NULL;
+}
+
+// Helper function to drop the NUL bytes from the n bytes at data, which cannot be part of
+// a word; returns how many bytes are left
+size_t drop_nul_bytes(char* data, size_t n) {
+    char* nul = memchr(data, '\0', n);
+    if (nul == NULL) {
+        return n;
+    }
+    size_t kept = nul - data;
+    for (size_t i = kept + 1; i < n; i++) {
+        if (data[i] != '\0') {
+            data[kept++] = data[i];
+        }
+    }
+    return kept;
+}
+
+// Helper function to run a substitution's builtin inside the shell with stdout pointed at
+// a memory stream, appending what it prints to builder. Returns its status, or -1.
+int capture_builtin_output(const BuiltinCommand* builtin, const AstNode* node, ShellContext* ctx, ArgBuffer* builder) {
+    if (node->kind == NODE_LIST) {
+        node = node->children[0];
+    }
+
+    Arena* arena = builder->arena;
+    ArenaMark mark = arena_mark(arena);
+    ParseResult** segments = instantiate_ast(node->pipeline, 0, ctx, arena);
+    if (segments == NULL) {
+        arena_rewind(arena, mark);
+        return 1;
+    }
+
+    char* data = NULL;
+    size_t size = 0;
+    FILE* capture = open_memstream(&data, &size);
+    if (capture == NULL) {
+        perror("command substitution: open_memstream failed");
+        arena_rewind(arena, mark);
+        return 1;
+    }
+    flush_builtin_output();
+    FILE* saved_stdout = stdout;
+    stdout = capture;
+    int code = builtin->run(segments[0]->argv, ctx);
+    stdout = saved_stdout;
+    fclose(capture);
+
+    // The expanded words are done with, which leaves builder's buffer free to grow in place
+    arena_rewind(arena, mark);
+    size = drop_nul_bytes(data, size);
+    if (size > 0 && append_to_buffer(builder, data, size) < 0) {
+        code = -1;
+    }
+    free(data);
+    return code;
+}
+
+// Helper function to run a substitution in a forked copy of the shell, reading its output
+// through a pipe straight into builder. Returns its status, or -1.
+int capture_forked_output(const AstNode* node, ShellContext* ctx, ArgBuffer* builder) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    flush_builtin_output();
+    long long started = trace_start();
+    pid_t pid = fork();
+    trace_phase(TRACE_SPAWN, started);
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        // The copy stays in the shell's process group, so a ^C reaches it together with
+        // the shell; unlike the shell it dies of it, as its commands do
+        signal(SIGINT, SIG_DFL);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        Arena child_arena = {0};
+        job_control = 0;
+        execute_node(node, ctx, &child_arena);
+        flush_builtin_output();
+        exit(exit_requested ? exit_request_status : last_exit_status);
+    }
+    close(fds[1]);
+
+    // Read into the buffer's free space, which doubles whenever it runs low
+    int failed = 0;
+    while (1) {
+        if (reserve_arg_buffer(builder, SUBST_READ_MIN) < 0) {
+            failed = 1;
+            break;
+        }
+        ssize_t n = read(fds[0], builder->buffer + builder->length, builder->capacity - builder->length - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        builder->length += drop_nul_bytes(builder->buffer + builder->length, n);
+    }
+    builder->buffer[builder->length] = '\0';
+    close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        pipeline_interrupted = 1;
+    }
+    return failed ? -1 : status_to_exit_code(status);
+}
+
+// Helper function to append the output of a command substitution to builder, without its
+// trailing newlines. Its status becomes `$?`. Returns 0, or -1 if out of memory.
+int append_command_substitution(const AstNode* node, ShellContext* ctx, ArgBuffer* builder) {
+    size_t start = builder->length;
+    const BuiltinCommand* builtin = find_substitution_builtin(node);
+    int code = builtin != NULL ? capture_builtin_output(builtin, node, ctx, builder) : capture_forked_output(node, ctx, builder);
+    if (code < 0 || pipeline_interrupted) {
+        // An interrupted substitution abandons the whole command, which is never run
+        return -1;
+    }
+
+    // Trim in place: the bytes stay in the buffer, only its length moves back
+    while (builder->length > start && builder->buffer[builder->length - 1] == '\n') {
+        builder->length--;
+    }
+    builder->buffer[builder->length] = '\0';
+    last_exit_status = code;
+    substitution_status = code;
+    return 0;
+}
+
+// Helper function to find the text a literal or parameter part stands for; status_text
+// holds $? while the result is used
+const char* word_part_value(const WordPart* part, ShellContext* ctx, char status_text[16], size_t* len) {
+    const char* value = part->text;
+    *len = part->length;
+    if (part->kind == PART_PARAM) {
+        if (part->length == 1 && *part->text == '?') {
+            snprintf(status_text, 16, "%d", last_exit_status);
+            value = status_text;
+        } else {
+            value = lookup_variable(ctx->var_sys, part->text, part->length);
+        }
+        *len = value ? strlen(value) : 0;
+    }
+    return value;
+}
+
+// Helper function to expand an AST word into one string (parameters and command output
+// substituted, no splitting). Words without either are used as they are, without copying.
+char* expand_ast_word(const AstWord* word, ShellContext* ctx, ArgBuffer* builder) {
+    if (!word->has_params) {
+        return (char*)word->text;
+    }
+
+    for (int p = 0; p < word->n_parts; p++) {
+        const WordPart* part = &word->parts[p];
+        if (part->kind == PART_COMMAND) {
+            if (append_command_substitution(part->command, ctx, builder) < 0) {
+                return NULL;
+            }
+            continue;
+        }
+        char status_text[16];
+        size_t value_len;
+        const char* value = word_part_value(part, ctx, status_text, &value_len);
+        if (value_len > 0 && append_to_buffer(builder, value, value_len) < 0) {
+            return NULL;
+        }
+    }
+
+    char* result = take_arg_buffer(builder);
+    if (result == NULL) {
+        perror("expand_ast_word: allocation failed");
+    }
+    return result;
+}
+
+// Helper function to make room for extra more fields (and the terminating NULL)
+int reserve_fields(char*** fields, int count, int* capacity, int extra, Arena* arena) {
+    if (count + extra < *capacity) {
+        return 0;
+    }
+    int new_capacity = *capacity * 2;
+    while (count + extra >= new_capacity) {
+        new_capacity *= 2;
+    }
+    char** grown = arena_resize(arena, *fields, *capacity * sizeof(char*), new_capacity * sizeof(char*));
+    if (grown == NULL) {
+        perror("reserve_fields: allocation failed");
+        return -1;
+    }
+    *fields = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Helper function to add a pattern's matches as fields, or the word itself when nothing
+// matches
+int add_glob_fields(const GlobPattern* glob, char* word, char*** fields, int* count, int* capacity, Arena* arena) {
+    char** matches = NULL;
+    int n_matches = expand_glob(glob, arena, &matches);
+    if (n_matches <= 0) {
+        matches = &word;
+        n_matches = 1;
+    }
+    if (reserve_fields(fields, *count, capacity, n_matches, arena) < 0) {
+        return -1;
+    }
+    memcpy(*fields + *count, matches, n_matches * sizeof(char*));
+    *count += n_matches;
+    return 0;
+}
+
+// Helper function to count the bytes before the first IFS character or NUL in text;
+// short expansion values make a plain loop cheaper than strcspn here
+size_t field_char_run(const char* text, size_t length) {
+    size_t run = 0;
+    while (run < length && text[run] != ' ' && text[run] != '\t' && text[run] != '\n' && text[run] != '\0') {
+        run++;
+    }
+    return run;
+}
+
+// Helper function to split the end of builder, from offset start on, which an unquoted
+// expansion appended: each IFS run ends the open field with a NUL, and NUL bytes, which
+// no argument can hold, are dropped. Returns how many fields were ended.
+int split_unquoted_value(ArgBuffer* builder, size_t start, int* field_open) {
+    int ended = 0;
+    size_t out = start;
+    size_t in = start;
+    while (in < builder->length) {
+        char* cursor = builder->buffer + in;
+        size_t gap = strspn(cursor, IFS_CHARS);
+        if (gap > 0) {
+            if (*field_open) {
+                builder->buffer[out++] = '\0';
+                ended++;
+                *field_open = 0;
+            }
+            in += gap;
+            continue;
+        }
+        size_t run = strcspn(cursor, IFS_CHARS);
+        if (run == 0) {
+            in++; // A NUL byte
+            continue;
+        }
+        memmove(builder->buffer + out, cursor, run);
+        out += run;
+        in += run;
+        *field_open = 1;
+    }
+    builder->length = out;
+    builder->buffer[out] = '\0';
+    return ended;
+}
+
+// Helper function to add a field of a word; in a word with unquoted wildcards the field
+// is a pattern itself
+int add_word_field(const AstWord* word, char* field, char*** fields, int* count, int* capacity, Arena* arena) {
+    const GlobPattern* glob = word->has_glob ? compile_glob(field, arena) : NULL;
+    if (glob != NULL) {
+        return add_glob_fields(glob, field, fields, count, capacity, arena);
+    }
+    if (reserve_fields(fields, *count, capacity, 1, arena) < 0) {
+        return -1;
+    }
+    (*fields)[(*count)++] = field;
+    return 0;
+}
+
+// Helper function to expand a word with parameters or substitutions into fields. Only
+// the values of unquoted expansions are split on IFS; literal text and double-quoted
+// expansions join the field they are in, so "$x" is one field even when x is empty.
+// The fields are built in builder one after another, each ended by a NUL, and taken
+// from it in one piece.
+int expand_word_fields(const AstWord* word, ShellContext* ctx, ArgBuffer* builder, char*** fields, int* count, int* capacity, Arena* arena) {
+    int n_fields = 0;
+    int field_open = 0; // The last field in builder exists, even if it is still empty
+    for (int p = 0; p < word->n_parts; p++) {
+        const WordPart* part = &word->parts[p];
+        size_t start = builder->length;
+        size_t plain; // Leading bytes of the value with nothing to split
+        if (part->kind == PART_COMMAND) {
+            if (append_command_substitution(part->command, ctx, builder) < 0) {
+                return -1;
+            }
+            plain = part->quoted ? 0 : field_char_run(builder->buffer + start, builder->length - start);
+        } else {
+            char status_text[16];
+            size_t value_len;
+            const char* value = word_part_value(part, ctx, status_text, &value_len);
+            if (value_len > 0 && append_to_buffer(builder, value, value_len) < 0) {
+                return -1;
+            }
+            // Scanned at its source, which is cheaper to read than the bytes just copied
+            plain = part->kind == PART_LITERAL || part->quoted ? 0 : field_char_run(value, value_len);
+        }
+        if (part->kind == PART_LITERAL || part->quoted) {
+            field_open = 1;
+            continue;
+        }
+
+        // An unquoted value is split where it lands
+        field_open |= plain > 0;
+        if (start + plain < builder->length) {
+            n_fields += split_unquoted_value(builder, start + plain, &field_open);
+        }
+    }
+    n_fields += field_open;
+    if (n_fields == 0) {
+        builder->length = 0; // Only empty unquoted values: the word disappears
+        builder->buffer[0] = '\0';
+        return 0;
+    }
+
+    char* field = take_arg_buffer(builder);
+    if (field == NULL) {
+        perror("expand_words: allocation failed");
+        return -1;
+    }
+    for (int f = 0; f < n_fields; f++) {
+        if (add_word_field(word, field, fields, count, capacity, arena) < 0) {
+            return -1;
+        }
+        field += strlen(field) + 1;
+    }
+    return 0;
+}
+
+// Helper function to expand n words into a NULL-terminated field list in arena. The values
+// of unquoted expansions are split on IFS. Returns the field count, or -1.
+int expand_words(const AstWord* words, int n, ShellContext* ctx, ArgBuffer* builder, Arena* arena, char*** fields_out) {
+    // Splitting can only add fields, so the list starts at one slot per word and grows
+    int capacity = n + 1;
+    int count = 0;
+    char** fields = arena_alloc(arena, capacity * sizeof(char*));
+    if (fields == NULL) {
+        return -1;
+    }
+
+    for (int w = 0; w < n; w++) {
+        const AstWord* word = &words[w];
+        char* text = (char*)word->text;
+        if (!word->has_params) {
+            if (word->glob != NULL) {
+                if (add_glob_fields(word->glob, text, &fields, &count, &capacity, arena) < 0) {
+                    return -1;
+                }
+            } else {
+                if (reserve_fields(&fields, count, &capacity, 1, arena) < 0) {
+                    return -1;
+                }
+                fields[count++] = text;
+            }
+            continue;
+        }
+
+        if (expand_word_fields(word, ctx, builder, &fields, &count, &capacity, arena) < 0) {
+            return -1;
+        }
+    }
+    fields[count] = NULL;
+
+    *fields_out = fields;
+    return count;
+}
+
+// Helper function to expand redirections into fd operations; targets are never split
+RedirectionInfo* instantiate_redirections(const AstRedir* redirs, int n, ShellContext* ctx, ArgBuffer* builder, Arena* arena) {
+    RedirectionInfo* info = init_redirection_info(n, arena);
+    if (info == NULL) {
+        return NULL;
+    }
+    for (int r = 0; r < n; r++) {
+        const AstRedir* redir = &redirs[r];
+        char* target = expand_ast_word(redir->kind == TOKEN_HEREDOC ? &redir->body : &redir->target, ctx, builder);
+        if (target == NULL || add_redirection(info, redir, target, arena) < 0) {
+            return NULL;
+        }
+    }
+    return info;
+}
+
+// Helper function to expand a parsed pipeline into segments ready to execute. All
+// results live in arena.
+ParseResult** instantiate_ast(const AstPipeline* pipeline, int is_background_process, ShellContext* ctx, Arena* arena) {
+    ParseResult** segments = arena_alloc(arena, pipeline->n_commands * sizeof(ParseResult*));
+    ArgBuffer* builder = init_arg_buffer(arena);
+    if (segments == NULL || builder == NULL) {
+        return NULL;
+    }
+
+    for (int c = 0; c < pipeline->n_commands; c++) {
+        const AstCommand* command = &pipeline->commands[c];
+        ParseResult* segment = arena_alloc(arena, sizeof(ParseResult));
+        if (segment == NULL) {
+            return NULL;
+        }
+        segment->is_background_process = is_background_process;
+        segment->compound = command->compound;
+        segment->assigns = NULL;
+        segment->n_assigns = 0;
+        if (command->compound != NULL) {
+            // The forked stage expands its own words; argv only names it in `jobs`
+            segment->argv = arena_alloc(arena, 2 * sizeof(char*));
+            segment->redir_info = init_redirection_info(0, arena);
+            if (segment->argv == NULL || segment->redir_info == NULL) {
+                return NULL;
+            }
+            segment->argv[0] = (char*)command->compound->source;
+            segment->argv[1] = NULL;
+            segments[c] = segment;
+            continue;
+        }
+        if (command->n_assigns > 0) {
+            // Assigned values are expanded but never split into fields
+            segment->assigns = arena_alloc(arena, (command->n_assigns + 1) * sizeof(char*));
+            if (segment->assigns == NULL) {
+                return NULL;
+            }
+            for (int a = 0; a < command->n_assigns; a++) {
+                segment->assigns[a] = expand_ast_word(&command->words[a], ctx, builder);
+                if (segment->assigns[a] == NULL) {
+                    return NULL;
+                }
+            }
+            segment->assigns[command->n_assigns] = NULL;
+            segment->n_assigns = command->n_assigns;
+        }
+        if (expand_words(command->words + command->n_assigns, command->n_words - command->n_assigns, ctx, builder, arena, &segment->argv) < 0) {
+            return NULL;
+        }
+        segment->redir_info = instantiate_redirections(command->redirs, command->n_redirs, ctx, builder, arena);
+        if (segment->redir_info == NULL) {
+            return NULL;
+        }
+        segments[c] = segment;
+    }
+
+    return segments;
+}
+
+// Helper function to pick the pipeline stage a builtin may run in inside the shell:
+// the last stage if eligible, otherwise the first eligible one, -1 if none
+int find_in_process_stage(ParseResult** segments, int n_segments, int is_background_process) {
+    // Background pipelines must not block the shell, so all their stages are children
+    if (is_background_process) {
+        return -1;
+    }
+
+    const BuiltinCommand* last = segments[n_segments - 1]->compound ? NULL : find_builtin(segments[n_segments - 1]->argv[0]);
+    if (last != NULL && last->in_process) {
+        return n_segments - 1;
+    }
+
+    for (int i = 0; i < n_segments - 1; i++) {
+        const BuiltinCommand* builtin = segments[i]->compound ? NULL : find_builtin(segments[i]->argv[0]);
+        if (builtin != NULL && builtin->in_process) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Helper function to read the pipe buffer size asked for in SHELL_PIPE_SIZE (bytes), or 0
+// to keep the kernel default
+int pipeline_pipe_size(void) {
+    const char* value = shell_getenv("SHELL_PIPE_SIZE");
+    if (value == NULL || *value == '\0') {
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long size = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || size <= 0 || size > INT_MAX) {
+        return 0;
+    }
+    return (int)size;
+}
+
+// Helper function to create the n_pipes pipes of a pipeline in one pass, read end at
+// fds[2 * k] and write end at fds[2 * k + 1]. Every end is close-on-exec, so a spawned
+// stage keeps only the ends dup'ed onto its stdin and stdout.
+int create_pipeline_pipes(int* fds, int n_pipes) {
+    int pipe_size = pipeline_pipe_size();
+    for (int k = 0; k < n_pipes; k++) {
+        if (pipe2(&fds[2 * k], O_CLOEXEC) != 0) {
+            perror("pipe");
+            for (int j = 0; j < 2 * k; j++) {
+                close(fds[j]);
+            }
+            return -1;
+        }
+        // A size above /proc/sys/fs/pipe-max-size is refused for unprivileged users; the
+        // pipe then just keeps its default buffer
+        if (pipe_size > 0) {
+            fcntl(fds[2 * k + 1], F_SETPIPE_SZ, pipe_size);
+        }
+    }
+    return 0;
+}
+
+// Helper function to close the pipeline pipe ends still open, marking each one closed
+void close_pipeline_fds(int* fds, int n_fds) {
+    for (int k = 0; k < n_fds; k++) {
+        if (fds[k] != -1) {
+            close(fds[k]);
+            fds[k] = -1;
+        }
+    }
+}
+
+// Helper function to close the parent's copies of stage i's pipe ends once it has been
+// launched, keeping the ends reserved for the in-process stage open
+void release_stage_pipes(int* fds, int i, int n_segments, int keep_in, int keep_out) {
+    if (i > 0 && fds[2 * (i - 1)] != keep_in) {
+        close(fds[2 * (i - 1)]);
+        fds[2 * (i - 1)] = -1;
+    }
+    if (i < n_segments - 1 && fds[2 * i + 1] != keep_out) {
+        close(fds[2 * i + 1]);
+        fds[2 * i + 1] = -1;
+    }
+}
+
+// Helper function to resolve every external stage's executable before any stage starts,
+// so the PATH scans (or command hash hits) happen once in the shell rather than in each
+// child. Builtin, compound and assignment-only stages get NULL, as do unknown commands.
+char** resolve_pipeline_stages(ParseResult** segments, int n_segments, int inproc_stage, Arena* arena) {
+    char** paths = arena_alloc(arena, n_segments * sizeof(char*));
+    if (paths == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < n_segments; i++) {
+        const char* command = segments[i]->argv[0];
+        paths[i] = NULL;
+        if (i == inproc_stage || segments[i]->compound != NULL || command == NULL || is_builtin_command(command)) {
+            continue;
+        }
+        paths[i] = find_exe_in_path(command);
+    }
+    return paths;
+}
+
+// Helper function to run a builtin pipeline stage inside the shell with its stdin and stdout
+// on the pipes (or its own redirections). Closing in_fd afterwards lets the upstream stage
+// see EPIPE like it would with a real reader that stopped early.
+int run_in_process_stage(ParseResult* segment, int in_fd, int out_fd, ShellContext* ctx) {
+    const BuiltinCommand* builtin = find_builtin(segment->argv[0]);
+    int saved_stdout = -1;
+    int saved_stdin = -1;
+
+    flush_builtin_output();
+    if (in_fd != -1) {
+        saved_stdin = dup(STDIN_FILENO);
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        saved_stdout = dup(STDOUT_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+
+    // A reader that exits early must not take the shell down with SIGPIPE
+    struct sigaction ignore;
+    struct sigaction saved_pipe;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved_pipe);
+
+    int code = run_builtin_with_redirections(builtin, segment, ctx);
+
+    if (saved_stdout != -1) {
+        restore_stdout(saved_stdout);
+    } else {
+        flush_builtin_output();
+    }
+    clearerr(stdout);
+    sigaction(SIGPIPE, &saved_pipe, NULL);
+
+    if (saved_stdin != -1) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    }
+    return code;
+}
+
+int execute_node(const struct AstNode* node, ShellContext* ctx, Arena* arena);
+
+// Execute a pipeline of commands
+void execute_pipeline(ParseResult** segments, int n_segments, int is_background_process, ShellContext* ctx, Arena* arena) {
+    JobSystem* job_sys = ctx->job_sys;
+    pid_t* pids = malloc(n_segments * sizeof(pid_t));
+    if (pids == NULL) {
+        perror("execute_pipeline: malloc failed");
+        return;
+    }
+
+    // Every pipeline becomes one process group, led by the first member that starts
+    pid_t pgid = (is_background_process || job_control) ? 0 : -1;
+
+    // At most one builtin stage runs inside the shell: the last stage if it can, else the
+    // first stage that can. It runs after every other stage has been launched.
+    int inproc_stage = find_in_process_stage(segments, n_segments, is_background_process);
+    int inproc_out = -1;
+    int inproc_in = -1;
+
+    // Look up every executable and create every pipe before the first stage starts
+    char** exe_paths = resolve_pipeline_stages(segments, n_segments, inproc_stage, arena);
+    int n_pipe_fds = 2 * (n_segments - 1);
+    int* pipe_fds = arena_alloc(arena, (n_pipe_fds + 1) * sizeof(int));
+    if (exe_paths == NULL || pipe_fds == NULL || create_pipeline_pipes(pipe_fds, n_segments - 1) != 0) {
+        free(pids);
+        return;
+    }
+    if (inproc_stage > 0) {
+        inproc_in = pipe_fds[2 * (inproc_stage - 1)];
+    }
+    if (inproc_stage != -1 && inproc_stage < n_segments - 1) {
+        inproc_out = pipe_fds[2 * inproc_stage + 1];
+    }
+
+    for (int i = 0; i < n_segments; i++) {
+        int in_fd = (i > 0) ? pipe_fds[2 * (i - 1)] : -1;
+        int out_fd = (i < n_segments - 1) ? pipe_fds[2 * i + 1] : -1;
+
+        // This stage's pipe ends stay open for it; nothing exec'ed can inherit them
+        if (i == inproc_stage) {
+            pids[i] = -1;
+            continue;
+        }
+
+        // Files are opened by the shell so a failing redirection is reported once; the
+        // stage is then skipped and counts as exiting with status 1 (pid 0)
+        if (prepare_redirections(segments[i]->redir_info) != 0) {
+            pids[i] = 0;
+            release_stage_pipes(pipe_fds, i, n_segments, inproc_in, inproc_out);
+            continue;
+        }
+
+        pid_t pid;
+        int spawned = 0;
+        int take_terminal = !is_background_process && pgid == 0;
+        if (segments[i]->compound == NULL && segments[i]->argv[0] != NULL && exe_paths[i] == NULL && !is_builtin_command(segments[i]->argv[0])) {
+            fprintf(stderr, "%s: command not found\n", segments[i]->argv[0]);
+            spawned = 1;
+            pid = -1;
+        } else if (use_posix_spawn && exe_paths[i] != NULL) {
+            // External stages skip fork entirely; only builtins still need a forked child
+            char** envp = environment_with_assignments(ctx->var_sys, segments[i]->assigns, segments[i]->n_assigns, arena);
+            spawned = 1;
+            pid = spawn_external_exe(exe_paths[i], segments[i]->argv, envp, segments[i]->redir_info, in_fd, out_fd, NULL, 0, pgid, take_terminal);
+            if (pid < 0) {
+                fprintf(stderr, "%s: %s\n", segments[i]->argv[0], strerror(errno));
+            }
+        } else {
+            flush_builtin_output();
+            long long started = trace_start();
+            pid = fork();
+            trace_phase(TRACE_SPAWN, started);
+        }
+
+        if (pid == 0) { // Child process
+            if (pgid != -1) {
+                prepare_job_child(pgid, take_terminal);
+            }
+
+            // Connect to the neighbouring pipes, then drop every other pipe end: a child
+            // that never execs would otherwise hold them open and keep readers from EOF
+            if (in_fd != -1) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            if (out_fd != -1) {
+                dup2(out_fd, STDOUT_FILENO);
+            }
+            close_pipeline_fds(pipe_fds, n_pipe_fds);
+            
+            // Handle redirection for this command
+            if (apply_redirections(segments[i]->redir_info, 0) != 0) {
+                exit(1);
+            }
+
+            // A compound stage runs in this copy of the shell, which never owns the terminal
+            if (segments[i]->compound != NULL) {
+                Arena stage_arena = {0};
+                job_control = 0;
+                execute_node(segments[i]->compound, ctx, &stage_arena);
+                flush_builtin_output();
+                exit(exit_requested ? exit_request_status : last_exit_status);
+            }
+
+            // Execute built-in or external command; a stage of bare assignments only sets them
+            const char* command = segments[i]->argv[0];
+            const BuiltinCommand* builtin = find_builtin(command);
+            if (command == NULL) {
+                apply_assignments(ctx->var_sys, segments[i]->assigns, segments[i]->n_assigns);
+                exit(0);
+            }
+            else if (builtin != NULL && (strcmp(command, "fg") == 0 || strcmp(command, "bg") == 0)) {
+                // A pipeline member is not the shell, so it cannot move jobs around
+                fprintf(stderr, "%s: no job control\n", command);
+                exit(1);
+            }
+            else if (builtin != NULL) {
+                apply_assignments(ctx->var_sys, segments[i]->assigns, segments[i]->n_assigns);
+                exit(builtin->run(segments[i]->argv, ctx));
+            }
+            else {
+                char** envp = environment_with_assignments(ctx->var_sys, segments[i]->assigns, segments[i]->n_assigns, arena);
+                if (check_exec_size(segments[i]->argv, envp) != 0) {
+                    fprintf(stderr, "%s: %s\n", command, strerror(errno));
+                    exit(126);
+                }
+                execve(exe_paths[i], segments[i]->argv, envp);
+                perror("execv failed");
+                exit(1);
+            }
+        } else if (pid < 0 && !spawned) {
+            release_redirections(segments[i]->redir_info);
+            perror("fork");
+            close_pipeline_fds(pipe_fds, n_pipe_fds);
+            for (int s = 0; s < n_segments; s++) {
+                free(exe_paths[s]);
+            }
+            free(pids);
+            return;
+        } else {
+            release_redirections(segments[i]->redir_info);
+            pids[i] = pid; // -1 when the stage could not be spawned
+            if (pid > 0 && pgid != -1) {
+                // Set the group from both sides so neither order of execution can race
+                setpgid(pid, pgid == 0 ? pid : pgid);
+                if (pgid == 0) {
+                    pgid = pid;
+                    if (!is_background_process) {
+                        give_terminal_to(pgid);
+                    }
+                }
+            }
+            release_stage_pipes(pipe_fds, i, n_segments, inproc_in, inproc_out);
+        }
+    }
+
+    for (int i = 0; i < n_segments; i++) {
+        free(exe_paths[i]);
+    }
+
+    // Every other stage is running, so the in-process stage can write into its pipe freely
+    int inproc_code = 0;
+    if (inproc_stage != -1) {
+        inproc_code = run_in_process_stage(segments[inproc_stage], inproc_in, inproc_out, ctx);
+    }
+
+    // Stage word lists, used to build the job's display text when it is needed
+    char*** stage_argvs = malloc(n_segments * sizeof(char**));
+    if (stage_argvs == NULL) {
+        perror("execute_pipeline: malloc failed");
+        free(pids);
+        return;
+    }
+    for (int s = 0; s < n_segments; s++) {
+        stage_argvs[s] = segments[s]->argv;
+    }
+
+    // Wait for all child processes, keeping every stage's exit code
+    if (!is_background_process) {
+        int* codes = malloc(n_segments * sizeof(int));
+        if (codes != NULL) {
+            for (int i = 0; i < n_segments; i++) {
+                codes[i] = pids[i] > 0 ? -1 : (pids[i] == 0 ? 1 : 127);
+            }
+            if (inproc_stage != -1) {
+                codes[inproc_stage] = inproc_code;
+            }
+            wait_for_foreground(job_sys, pids, codes, n_segments, stage_argvs);
+            free(codes);
+        }
+    } else {
+        // Every member is tracked, so the job is Done only once the last stage exits
+        register_background_job(job_sys, pids, n_segments, build_job_command(stage_argvs, n_segments));
+        set_single_status(0);
+    }
+
+    free(stage_argvs);
+    free(pids);
+}
+
+// Helper function to automatically display and clear completed background jobs
+void flush_done_jobs(JobSystem* sys) {
+    if (sys->n_done == 0) {
+        return;
+    }
+
+    int max_id;
+    int second_max_id;
+    find_latest_job_ids(sys, &max_id, &second_max_id);
+
+    // Only print and remove jobs which are DONE, in ID order
+    for (int w = 0; w < sys->capacity / 64 && sys->n_done > 0; w++) {
+        unsigned long bits = sys->id_bitmap[w];
+        while (bits != 0) {
+            int bit = __builtin_ctzl(bits);
+            bits &= bits - 1;
+            Job* job = &sys->list[w * 64 + bit];
+            if (!job->is_done) {
+                continue;
+            }
+
+            char marker = ' ';
+            if (job->job_id == max_id) {
+                marker = '+';
+            } else if (job->job_id == second_max_id) {
+                marker = '-';
+            }
+
+            // Print the "Done" line matching your formatting requirements
+            if (job_notices_shown()) {
+                printf("[%d]%c %-24s%s\n", job->job_id, marker, "Done", job->command);
+            }
+
+            // Remove it from records immediately
+            release_job(sys, job);
+        }
+    }
+}
+
+// Helper function to collect a completer co-process with a pending state change; returns
+// 0 when pid is no co-process
+int reap_completion_coprocess(pid_t pid) {
+    CompletionSystem* comp_sys = get_set_completion_context(NULL);
+    if (comp_sys == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < comp_sys->count; i++) {
+        if (comp_sys->list[i].coproc_pid != pid) {
+            continue;
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED) == pid && !WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+            // Already reaped, so it must not be signalled or waited for again
+            comp_sys->list[i].coproc_pid = -1;
+            stop_completion_coprocess(&comp_sys->list[i]);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Helper function reaps finished child processes to prevent zombies. Each pending child is
+// peeked at first and only collected when it is a recorded job member or a completer
+// co-process: a foreground pipeline that is still being waited for must keep its children,
+// or their exit codes would be lost. Reaping stops at such a child; its waiter collects it
+// and the next wake-up picks up whatever is queued behind it.
+void reap_background_jobs(JobSystem* sys) {
+    // Drain SIGCHLD wake-ups; everything they announced is collected below
+    char drain[64];
+    while (sigchld_pipe[0] != -1 && read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    while (1) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0) {
+            break;
+        }
+
+        pid_t pid = info.si_pid;
+        int bucket = job_index_find(sys, pid);
+        if (bucket == -1) {
+            if (reap_completion_coprocess(pid)) {
+                continue;
+            }
+            break; // A foreground child, left to its waiter
+        }
+
+        int status;
+        if (waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED) != pid) {
+            break;
+        }
+        Job* job = &sys->list[sys->index_slots[bucket]];
+        if (WIFSTOPPED(status)) {
+            job->is_stopped = 1;
+        } else if (WIFCONTINUED(status)) {
+            job->is_stopped = 0;
+        } else {
+            for (int i = 0; i < job->n_pids; i++) {
+                if (job->pids[i] == pid) {
+                    job_member_exited(sys, job, i, status_to_exit_code(status));
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Helper function run on SIGCHLD: only pokes the self-pipe, reaping happens outside the handler
+void handle_sigchld(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    if (sigchld_pipe[1] != -1) {
+        ssize_t ignored = write(sigchld_pipe[1], "x", 1);
+        (void)ignored;
+    }
+    errno = saved_errno;
+}
+
+// Helper function run on SIGINT in an interactive shell: marks the running command line
+// interrupted, so loops and lists unwind at their next check
+void handle_sigint(int sig) {
+    (void)sig;
+    pipeline_interrupted = 1;
+    sigint_received = 1;
+}
+
+// Helper function to create the SIGCHLD self-pipe and install the handler
+void init_sigchld_handling(void) {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("init_sigchld_handling: pipe failed");
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+        return;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigchld;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // Stops are reported too, so stopped background jobs show up
+    if (sigaction(SIGCHLD, &action, NULL) == -1) {
+        perror("init_sigchld_handling: sigaction failed");
+    }
+}
+
+// Readline input hook: waits for a key and for SIGCHLD at the same time, so background
+// jobs are reaped as soon as they exit even while the shell sits at the prompt
+int shell_getc(FILE* stream) {
+    int input_fd = fileno(stream);
+
+    while (1) {
+        struct pollfd pfds[2] = {{input_fd, POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}};
+        int ready = poll(pfds, sigchld_pipe[0] != -1 ? 2 : 1, -1);
+        if (ready == -1) {
+            if (errno == EINTR && pipeline_interrupted) {
+                // ^C at the prompt throws the typed text away and starts a fresh line
+                pipeline_interrupted = 0;
+                sigint_received = 0;
+                rl_replace_line("", 0);
+                rl_crlf();
+                rl_on_new_line();
+                rl_redisplay();
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return rl_getc(stream);
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            JobSystem* job_sys = get_set_job_context(NULL);
+            if (job_sys != NULL) {
+                reap_background_jobs(job_sys);
+            }
+        }
+        if (pfds[0].revents != 0) {
+            return rl_getc(stream);
+        }
+    }
+}
+
+// Helper functions adapting each builtin handler to the dispatch table signature
+int run_echo_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    handle_echo_cmd(argv);
+    return 0;
+}
+
+int run_exit_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_exit_cmd(argv);
+}
+
+int run_true_builtin(char** argv, ShellContext* ctx) {
+    (void)argv;
+    (void)ctx;
+    return 0;
+}
+
+int run_false_builtin(char** argv, ShellContext* ctx) {
+    (void)argv;
+    (void)ctx;
+    return 1;
+}
+
+int run_times_builtin(char** argv, ShellContext* ctx) {
+    (void)argv;
+    (void)ctx;
+    handle_times_cmd();
+    return 0;
+}
+
+int run_trace_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_trace_cmd(argv);
+}
+
+int run_break_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_loop_jump_cmd(argv, 0);
+}
+
+int run_continue_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_loop_jump_cmd(argv, 1);
+}
+
+int run_type_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_type_cmd(argv);
+}
+
+int run_pwd_builtin(char** argv, ShellContext* ctx) {
+    (void)argv;
+    (void)ctx;
+    char* pwd = handle_pwd_cmd();
+    if (pwd == NULL) {
+        return 1;
+    }
+    printf("%s\n", pwd);
+    free(pwd);
+    return 0;
+}
+
+int run_cd_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_cd_cmd(argv);
+}
+
+int run_history_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_history_cmd(argv);
+}
+
+int run_jobs_builtin(char** argv, ShellContext* ctx) {
+    reap_background_jobs(ctx->job_sys);
+    handle_jobs_cmd(argv, ctx->job_sys);
+    return 0;
+}
+
+int run_complete_builtin(char** argv, ShellContext* ctx) {
+    return handle_complete_cmd(argv, ctx->comp_sys);
+}
+
+int run_declare_builtin(char** argv, ShellContext* ctx) {
+    return handle_declare_cmd(argv, ctx->var_sys);
+}
+
+int run_export_builtin(char** argv, ShellContext* ctx) {
+    return handle_export_cmd(argv, ctx->var_sys);
+}
+
+int run_hash_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_hash_cmd(argv);
+}
+
+int run_fg_builtin(char** argv, ShellContext* ctx) {
+    reap_background_jobs(ctx->job_sys);
+    return handle_fg_cmd(argv, ctx->job_sys);
+}
+
+int run_bg_builtin(char** argv, ShellContext* ctx) {
+    reap_background_jobs(ctx->job_sys);
+    return handle_bg_cmd(argv, ctx->job_sys);
+}
+
+int run_wait_builtin(char** argv, ShellContext* ctx) {
+    reap_background_jobs(ctx->job_sys);
+    return handle_wait_cmd(argv, ctx->job_sys);
+}
+
+int run_kill_builtin(char** argv, ShellContext* ctx) {
+    return handle_kill_cmd(argv, ctx->job_sys);
+}
+
+int run_tee_builtin(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    return handle_tee_cmd(argv);
+}
+
+// Helper function standing in for a command found nowhere, so the message honours the
+// command's own redirections
+int run_command_not_found(char** argv, ShellContext* ctx) {
+    (void)ctx;
+    fprintf(stderr, "%s: command not found\n", argv[0]);
+    return 127;
+}
+
+// Global pseudo-builtin run in place of a command that is not found
+static const BuiltinCommand command_not_found = {"", run_command_not_found, 1, 1};
+
+// Builtins that wait for or hand over the terminal (fg, bg, wait) and exit stay out of
+// the shell process when they appear inside a pipeline. Only builtins that just print
+// run inside the shell for a command substitution; the rest get a subshell there.
+const BuiltinCommand builtin_table[] = {
+    {"echo", run_echo_builtin, 1, 1},
+    {"exit", run_exit_builtin, 0, 0},
+    {"type", run_type_builtin, 1, 1},
+    {"pwd", run_pwd_builtin, 1, 1},
+    {"cd", run_cd_builtin, 1, 0},
+    {"history", run_history_builtin, 1, 0},
+    {"jobs", run_jobs_builtin, 1, 0},
+    {"complete", run_complete_builtin, 1, 0},
+    {"declare", run_declare_builtin, 1, 0},
+    {"export", run_export_builtin, 1, 0},
+    {"hash", run_hash_builtin, 1, 0},
+    {"fg", run_fg_builtin, 0, 0},
+    {"bg", run_bg_builtin, 0, 0},
+    {"wait", run_wait_builtin, 0, 0},
+    {"kill", run_kill_builtin, 1, 0},
+    {"tee", run_tee_builtin, 1, 0},
+    {"true", run_true_builtin, 1, 1},
+    {"false", run_false_builtin, 1, 1},
+    {":", run_true_builtin, 1, 1},
+    {"break", run_break_builtin, 1, 0},
+    {"continue", run_continue_builtin, 1, 0},
+    {"times", run_times_builtin, 1, 1},
+    {"trace", run_trace_builtin, 1, 1},
+    {NULL, NULL, 0, 0}
+};
+
+// Helper function to expose the last pipeline's exit codes as PIPESTATUS ("0 1 0")
+void publish_pipestatus(VariableSystem* var_sys) {
+    // Room for every code at its widest, so long pipelines are never cut short
+    char small_text[64];
+    size_t size = (size_t)n_last_pipestatus * 12 + 1;
+    char* text = size <= sizeof(small_text) ? small_text : malloc(size);
+    if (text == NULL) {
+        perror("publish_pipestatus: malloc failed");
+        return;
+    }
+
+    size_t used = 0;
+    text[0] = '\0';
+    for (int i = 0; i < n_last_pipestatus; i++) {
+        used += snprintf(text + used, size - used, i == 0 ? "%d" : " %d", last_pipestatus[i]);
+    }
+    set_variable(var_sys, "PIPESTATUS", text);
+    if (text != small_text) {
+        free(text);
+    }
+}
+
+// Helper function to check whether the commands after the current one must be skipped:
+// after `exit`, a pending break/continue or a pipeline killed by SIGINT
+int should_unwind(void) {
+    return exit_requested || loop_jump > 0 || pipeline_interrupted;
+}
+
+// Helper function to run one pipeline node. Its expansion is released from arena once the
+// pipeline has finished, so loops do not grow the line arena per iteration.
+int execute_pipeline_node(const AstPipeline* pipeline, int is_background_process, ShellContext* ctx, Arena* arena) {
+    ArenaMark mark = arena_mark(arena);
+    long long started = trace_start();
+    substitution_status = 0;
+    ParseResult** segments = instantiate_ast(pipeline, is_background_process, ctx, arena);
+    trace_phase(TRACE_EXPAND, started);
+    int n_segments = pipeline->n_commands;
+
+    if (segments == NULL) {
+        set_single_status(pipeline_interrupted ? 128 + SIGINT : 1);
+    } else if (n_segments > 1) {
+        // Execute the pipeline
+        execute_pipeline(segments, n_segments, is_background_process, ctx, arena);
+    } else if (segments[0]->argv[0] != NULL) {
+        // Non-pipeline command
+        ParseResult* parsed_result = segments[0];
+        const char* command = parsed_result->argv[0];
+        const BuiltinCommand* builtin = find_builtin(command);
+        if (strcmp(command, "exit") == 0) {
+            exit_request_status = handle_exit_cmd(parsed_result->argv);
+            exit_requested = 1;
+        } else if (builtin != NULL) {
+            apply_assignments(ctx->var_sys, parsed_result->assigns, parsed_result->n_assigns);
+            set_single_status(run_builtin_with_redirections(builtin, parsed_result, ctx));
+        } else {
+            char* exePath = find_exe_in_path(command);
+            if (exePath != NULL) {
+                char** envp = environment_with_assignments(ctx->var_sys, parsed_result->assigns, parsed_result->n_assigns, arena);
+                execute_external_exe_with_redirection(exePath, parsed_result->argv, envp, parsed_result->redir_info, is_background_process, ctx->job_sys);
+                free(exePath);
+            } else {
+                int code = run_builtin_with_redirections(&command_not_found, parsed_result, ctx);
+                if (is_background_process) {
+                    // The job is still recorded, so `wait` can report the stage that never started
+                    pid_t never_started = -1;
+                    char** stage_argvs[] = {parsed_result->argv};
+                    register_background_job(ctx->job_sys, &never_started, 1, build_job_command(stage_argvs, 1));
+                    code = 0;
+                }
+                set_single_status(code);
+            }
+        }
+    } else if (segments[0]->n_assigns > 0) {
+        // Bare assignments set shell variables (exported ones reach the environment too);
+        // the status is that of the last command substitution in them, if any
+        apply_assignments(ctx->var_sys, segments[0]->assigns, segments[0]->n_assigns);
+        set_single_status(substitution_status);
+    }
+
+    publish_pipestatus(ctx->var_sys);
+    arena_rewind(arena, mark);
+    return last_exit_status;
+}
+
+// Helper function to consume a pending break or continue at a loop; returns 1 if the loop
+// must stop
+int loop_should_stop(void) {
+    if (exit_requested || pipeline_interrupted) {
+        return 1;
+    }
+    if (loop_jump == 0) {
+        return 0;
+    }
+    loop_jump--;
+    // Only the innermost loop reached by `continue n` keeps going
+    return loop_jump > 0 || !loop_jump_continue;
+}
+
+// Helper function to run a compound command in the background: a forked copy of the
+// shell runs it in its own process group and the parent records it as a job
+int run_background_node(const AstNode* node, ShellContext* ctx, Arena* arena) {
+    flush_builtin_output();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        set_single_status(1);
+        return 1;
+    }
+
+    if (pid == 0) {
+        prepare_job_child(0, 0);
+        // The copy never owns the terminal; its jobs stay in its own group
+        job_control = 0;
+        AstNode foreground = *node;
+        foreground.is_background = 0;
+        execute_node(&foreground, ctx, arena);
+        flush_builtin_output();
+        exit(exit_requested ? exit_request_status : last_exit_status);
+    }
+
+    setpgid(pid, pid);
+    register_background_job(ctx->job_sys, &pid, 1, strdup(node->source ? node->source : ""));
+    set_single_status(0);
+    return 0;
+}
+
+// Helper function to run a parsed node inside the shell. Loop bodies and conditions are
+// executed from the same AST every iteration; only their words are expanded again.
+int execute_node(const AstNode* node, ShellContext* ctx, Arena* arena) {
+    if (node->kind == NODE_PIPELINE) {
+        return execute_pipeline_node(node->pipeline, node->is_background, ctx, arena);
+    }
+    if (node->is_background) {
+        return run_background_node(node, ctx, arena);
+    }
+
+    // Redirections of a compound command cover everything it runs
+    RedirectionInfo* redir = NULL;
+    ArenaMark mark = arena_mark(arena);
+    if (node->n_redirs > 0) {
+        ArgBuffer* builder = init_arg_buffer(arena);
+        redir = builder ? instantiate_redirections(node->redirs, node->n_redirs, ctx, builder, arena) : NULL;
+        if (redir == NULL || prepare_redirections(redir) != 0) {
+            arena_rewind(arena, mark);
+            set_single_status(1);
+            return 1;
+        }
+        flush_builtin_output();
+        int applied = apply_redirections(redir, 1);
+        release_redirections(redir);
+        if (applied != 0) {
+            restore_redirections(redir);
+            arena_rewind(arena, mark);
+            set_single_status(1);
+            return 1;
+        }
+    }
+
+    int status = 0;
+    switch (node->kind) {
+        case NODE_LIST:
+            for (int i = 0; i < node->n_children && !should_unwind(); i++) {
+                status = execute_node(node->children[i], ctx, arena);
+            }
+            status = last_exit_status;
+            break;
+        case NODE_AND:
+        case NODE_OR:
+            status = execute_node(node->first, ctx, arena);
+            if (!should_unwind() && ((status == 0) == (node->kind == NODE_AND))) {
+                status = execute_node(node->second, ctx, arena);
+            }
+            break;
+        case NODE_NOT:
+            status = execute_node(node->first, ctx, arena) == 0 ? 1 : 0;
+            set_single_status(status);
+            break;
+        case NODE_IF: {
+            // With no branch taken the status of an if is 0
+            const AstNode* branch = NULL;
+            int cond = execute_node(node->first, ctx, arena);
+            if (!should_unwind()) {
+                branch = cond == 0 ? node->second : node->third;
+            }
+            if (branch != NULL) {
+                status = execute_node(branch, ctx, arena);
+            } else if (!should_unwind()) {
+                set_single_status(0);
+            }
+            status = last_exit_status;
+            break;
+        }
+        case NODE_WHILE: {
+            int body_status = 0;
+            loop_depth++;
+            while (1) {
+                int cond = execute_node(node->first, ctx, arena);
+                if (loop_should_stop() || ((cond == 0) == node->until)) {
+                    break;
+                }
+                body_status = execute_node(node->second, ctx, arena);
+                if (loop_should_stop()) {
+                    break;
+                }
+            }
+            loop_depth--;
+            if (!exit_requested) {
+                set_single_status(body_status);
+            }
+            status = last_exit_status;
+            break;
+        }
+        case NODE_FOR: {
+            // The item list is expanded once, before the first iteration
+            ArenaMark items_mark = arena_mark(arena);
+            char** items = NULL;
+            int n_items = 0;
+            if (node->for_has_in) {
+                ArgBuffer* builder = init_arg_buffer(arena);
+                n_items = builder ? expand_words(node->for_items, node->n_for_items, ctx, builder, arena, &items) : -1;
+            } else {
+                // Without `in`, iterate over the positional parameters
+                char param_name[16];
+                for (n_items = 0;; n_items++) {
+                    int len = snprintf(param_name, sizeof(param_name), "%d", n_items + 1);
+                    if (lookup_variable(ctx->var_sys, param_name, len) == NULL) {
+                        break;
+                    }
+                }
+                items = arena_alloc(arena, (n_items + 1) * sizeof(char*));
+                for (int i = 0; items != NULL && i < n_items; i++) {
+                    int len = snprintf(param_name, sizeof(param_name), "%d", i + 1);
+                    items[i] = arena_strdup(arena, lookup_variable(ctx->var_sys, param_name, len));
+                }
+                if (items == NULL) {
+                    n_items = -1;
+                }
+            }
+            if (n_items < 0) {
+                set_single_status(1);
+                status = 1;
+                break;
+            }
+
+            int body_status = 0;
+            loop_depth++;
+            for (int i = 0; i < n_items; i++) {
+                set_variable(ctx->var_sys, node->for_var, items[i]);
+                body_status = execute_node(node->second, ctx, arena);
+                if (loop_should_stop()) {
+                    break;
+                }
+            }
+            loop_depth--;
+            arena_rewind(arena, items_mark);
+            if (!exit_requested) {
+                set_single_status(body_status);
+            }
+            status = last_exit_status;
+            break;
+        }
+        case NODE_TIME: {
+            long long started = monotonic_ns();
+            struct rusage self_before;
+            getrusage(RUSAGE_SELF, &self_before);
+            struct timeval child_utime = waited_utime;
+            struct timeval child_stime = waited_stime;
+
+            if (node->first != NULL) {
+                status = execute_node(node->first, ctx, arena);
+            } else {
+                set_single_status(0);
+            }
+
+            // CPU time is the shell's own (builtins run in-process) plus its waited children's
+            struct rusage self_after;
+            getrusage(RUSAGE_SELF, &self_after);
+            struct timeval user, sys, delta;
+            timersub(&self_after.ru_utime, &self_before.ru_utime, &user);
+            timersub(&waited_utime, &child_utime, &delta);
+            timeradd(&user, &delta, &user);
+            timersub(&self_after.ru_stime, &self_before.ru_stime, &sys);
+            timersub(&waited_stime, &child_stime, &delta);
+            timeradd(&sys, &delta, &sys);
+
+            const char* format = lookup_variable(ctx->var_sys, "TIMEFORMAT", 10);
+            flush_builtin_output();
+            print_time_report(format ? format : TIME_DEFAULT_FORMAT, (monotonic_ns() - started) / 1000,
+                              user.tv_sec * 1000000LL + user.tv_usec, sys.tv_sec * 1000000LL + sys.tv_usec);
+            status = last_exit_status;
+            break;
+        }
+        case NODE_PIPELINE:
+            break;
+    }
+
+    if (redir != NULL) {
+        flush_builtin_output();
+        restore_redirections(redir);
+        clearerr(stdout);
+    }
+    arena_rewind(arena, mark);
+    return status;
+}
+
+// Helper function to enable job control when the shell runs on an interactive terminal:
+// move into its own process group, take the terminal and ignore the job-control stops
+void init_job_control(void) {
+    if (!isatty(STDIN_FILENO)) {
+        return;
+    }
+
+    // Wait until started in the foreground rather than fighting over the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    // Ctrl-C interrupts the command line being run (or typed) rather than the shell.
+    // Readline is kept out of it so the prompt hook alone decides what a ^C discards.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigint;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    rl_catch_signals = 0;
+
+    // A session leader already leads its own group, so EPERM is fine here
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) == -1) {
+        perror("init_job_control: tcsetpgrp failed");
+        return;
+    }
+    job_control = 1;
+}
+
+// Helper function run by readline once the first prompt is on screen: note the startup
+// time and only then load HISTFILE, before the first keystroke is read. Readline gets the
+// newest HISTSIZE entries; new ones are appended to HISTFILE as entered.
+int load_history_after_first_prompt(void) {
+    rl_pre_input_hook = NULL;
+    trace_startup();
+
+    const char* histsize = shell_getenv("HISTSIZE");
+    int max_entries = histsize ? atoi(histsize) : HISTORY_DEFAULT_SIZE;
+    if (max_entries <= 0) {
+        max_entries = HISTORY_DEFAULT_SIZE;
+    }
+
+    // Load history from HISTFILE if set
+    const char* histfile = shell_getenv("HISTFILE");
+    if (histfile != NULL) {
+        open_history_store(histfile, max_entries);
+        last_history_written_idx = history_base + history_length;
+
+        // Readline has already positioned itself in the (then empty) history list
+        using_history();
+    }
+    return 0;
+}
+
+// Helper function to configure readline and completion, on the first interactive read
+void init_interactive_input(void) {
+    // Initialize readline
+    rl_readline_name = "myshell";
+    rl_basic_word_break_characters = " \t\n\"\'`@$><=;|&{(";
+
+    // Set up completion function
+    rl_attempted_completion_function = builtin_completion;
+    rl_getc_function = shell_getc;
+    rl_completion_append_character = ' ';
+    rl_bind_keyseq("\\C-r", reverse_search_history_key);
+    rl_pre_input_hook = load_history_after_first_prompt;
+}
+
+// Helper function to pick the input source from the command line: `-c string [name args]`,
+// `script [args]`, or stdin (interactive only on a terminal). Positional parameters are
+// set from the remaining arguments. Returns 0, or the exit status to fail with.
+int open_shell_input(InputSource* in, int argc, char** argv, VariableSystem* var_sys) {
+    int first_param = argc;
+    const char* name = argv[0];
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            return 2;
+        }
+        init_string_input(in, argv[2]);
+        if (argc > 3) {
+            name = argv[3];
+            first_param = 4;
+        }
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return 127;
+        }
+        init_fd_input(in, fd);
+        if (in->fd == -1) {
+            close(fd); // Fully mapped, the descriptor is no longer needed
+        } else {
+            // Streamed scripts keep their descriptor out of the way of children
+            in->fd = move_fd_high(fd);
+        }
+        name = argv[1];
+        first_param = 2;
+    } else if (isatty(STDIN_FILENO)) {
+        memset(in, 0, sizeof(*in));
+        in->interactive = 1;
+        in->fd = -1;
+        in->sync_fd = -1;
+    } else {
+        init_fd_input(in, STDIN_FILENO);
+        if (in->map != NULL) {
+            in->sync_fd = STDIN_FILENO;
+        }
+    }
+
+    // $0, $1, ... for the script
+    char param_name[16];
+    set_variable(var_sys, "0", name);
+    for (int i = first_param; i < argc; i++) {
+        snprintf(param_name, sizeof(param_name), "%d", i - first_param + 1);
+        set_variable(var_sys, param_name, argv[i]);
+    }
+    return 0;
+}
+
+// Helper function to run the shell: set up its state, read and execute commands until
+// end of input or `exit`, then clean up. Returns the shell's exit status.
+int shell_main(int argc, char** argv) {
+    // SHELL_TRACE=1 records per-phase timings of every line for the `trace` builtin
+    const char* trace_mode = getenv("SHELL_TRACE");
+    trace_enabled = trace_mode != NULL && strcmp(trace_mode, "1") == 0;
+    shell_start_ns = trace_enabled ? monotonic_ns() : 0;
+
+    // Initialize shell variable tracking system
+    VariableSystem var_sys;
+    init_variable_system(&var_sys);
+    import_environment(&var_sys);
+    shell_variables = &var_sys;
+
+    // Choose where commands come from before paying for any interactive setup
+    InputSource shell_input;
+    int open_status = open_shell_input(&shell_input, argc, argv, &var_sys);
+    if (open_status != 0) {
+        return open_status;
+    }
+    active_input = &shell_input;
+
+    // Initialize jobs tracking system and SIGCHLD-driven reaping
+    JobSystem job_sys;
+    init_jobs_system(&job_sys);
+    get_set_job_context(&job_sys);
+    init_sigchld_handling();
+    if (shell_input.interactive) {
+        init_job_control();
+    }
+
+    // Initialize completion tracking system; readline is told about it on the first prompt
+    CompletionSystem comp_sys;
+    init_completion_system(&comp_sys);
+    get_set_completion_context(&comp_sys);
+
+    // State handed to builtins through the dispatch table
+    ShellContext shell_ctx = {&job_sys, &comp_sys, &var_sys};
+
+    // SHELL_SPAWN=fork selects the classic fork+exec launch path for comparison
+    const char* spawn_mode = getenv("SHELL_SPAWN");
+    if (spawn_mode != NULL && strcmp(spawn_mode, "fork") == 0) {
+        use_posix_spawn = 0;
+    }
+
+    // Buffer builtin output; it is flushed before each prompt and child launch
+    init_builtin_output();
+    int status = 0;
+
+    // Per-line arena owning tokens, parse results and segment arrays
+    Arena line_arena;
+    arena_init(&line_arena);
+
+    while (1) {
+        // Release everything the previous line allocated in one shot
+        arena_reset(&line_arena);
+
+        reap_background_jobs(&job_sys);
+        flush_done_jobs(&job_sys);
+        flush_builtin_output();
+        publish_pipestatus(&var_sys);
+
+        // Interactive shells note their startup time once the first prompt is drawn
+        if (!shell_input.interactive) {
+            trace_startup();
+        }
+        char* input = read_input_line(&shell_input, "$ ");
+        if (input == NULL) {
+            if (active_input->interactive) {
+                printf("\n");
+            }
+            status = last_exit_status;
+            break;
+        }
+
+        char* processedInput = input;
+        while (isspace((unsigned char)*processedInput)) {
+            processedInput++;
+        }
+
+        // Skip empty commands
+        if (*processedInput == '\0') {
+            free(input);
+            continue;
+        }
+
+        trace_begin_line(processedInput);
+
+        // Parse the line (or reuse the cached parse of the same text). Unfinished
+        // constructs and here-documents pull in more lines until the command is complete.
+        int incomplete = 0;
+        AstNode* ast = get_parsed_line(processedInput, 0, &incomplete, &line_arena);
+        while (ast == NULL && incomplete) {
+            char* more = read_input_line(&shell_input, "> ");
+            if (more == NULL) {
+                ast = get_parsed_line(processedInput, 1, &incomplete, &line_arena);
+                break;
+            }
+
+            size_t used = strlen(input);
+            size_t offset = processedInput - input;
+            char* joined = realloc(input, used + strlen(more) + 2);
+            if (joined == NULL) {
+                perror("realloc failed");
+                free(more);
+                break;
+            }
+            input = joined;
+            processedInput = input + offset;
+            input[used] = '\n';
+            strcpy(input + used + 1, more);
+            free(more);
+            ast = get_parsed_line(processedInput, 0, &incomplete, &line_arena);
+        }
+
+        // Add non-empty commands to history
+        if (active_input->interactive) {
+            record_history_entry(input);
+        }
+        free(input);
+
+        if (ast == NULL) {
+            // Syntax errors fail the command like other shells do
+            set_single_status(2);
+            trace_end_line();
+            continue;
+        }
+
+        // SIGINT and loop jumps only unwind the command they happened in
+        pipeline_interrupted = 0;
+        sigint_received = 0;
+        loop_jump = 0;
+        execute_node(ast, &shell_ctx, &line_arena);
+        if (sigint_received) {
+            // The shell caught the ^C itself, so no child reported it: fail like one would
+            printf("\n");
+            set_single_status(128 + SIGINT);
+        }
+        trace_end_line();
+        if (exit_requested) {
+            status = exit_request_status;
+            break;
+        }
+    }
+
+    arena_free(&line_arena);
+    free_input_source(&shell_input);
+
+    // Persistent completers are stopped and reaped before the shell exits
+    for (int i = 0; i < comp_sys.count; i++) {
+        stop_completion_coprocess(&comp_sys.list[i]);
+    }
+
+    // Entries were appended to HISTFILE as they were entered
+    free_history_index();
+    close_history_store();
+
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,598 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include <dirent.h>
+#include <strings.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#define ARG_BUFFER_INITIAL_SIZE 64
+#define JOB_TABLE_INITIAL_SIZE 64
+#define JOB_INDEX_INITIAL_SIZE 128
+#define COMPLETION_TABLE_INITIAL_SIZE 8
+#define VAR_INDEX_INITIAL_SIZE 64
+#define IFS_CHARS " \t\n"
+#define WORD_SPECIAL_CHARS " \t\n\v\f\r|&;<>\\'\"$`" // Characters ending an unquoted run in the lexer
+#define DQUOTE_SPECIAL_CHARS "\"\\$`" // Characters ending a double-quoted run in the lexer
+#define HASH_BUCKETS 64
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN sizeof(void*)
+#define DIR_CACHE_SIZE 8
+#define AST_CACHE_SIZE 32
+#define COMPLETER_TIMEOUT_MS 1000
+#define OUT_BUF_SIZE 65536
+#define IO_CHUNK_SIZE 65536
+#define SUBST_READ_MIN 4096
+#define COMPLETER_READ_MIN 512
+#define HISTORY_DEFAULT_SIZE 1000
+#define HISTORY_IOV_BATCH 512
+#define TRIGRAM_BUCKETS 65536
+#define TRACE_RING_SIZE 64
+#define TRACE_COMMAND_SIZE 48
+#define TIME_DEFAULT_FORMAT "\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS"
+
+// Structure to hold parsing state (quoting)
+typedef struct {
+    int in_single_quote;
+    int in_double_quote;
+} ParseState;
+
+// Structure for one chunk of arena memory
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Structure for a bump allocator whose allocations are all released in one shot
+typedef struct {
+    ArenaBlock* head; // Block new allocations are carved from
+    void* last_alloc; // Most recent allocation, which can be resized in place
+} Arena;
+
+// Structure for an arena fill level to rewind to
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+// Structure for dynamic argument buffer
+typedef struct {
+    char* buffer;
+    size_t capacity;
+    size_t length;
+    Arena* arena; // When set, the buffer lives (and grows) inside this arena
+} ArgBuffer;
+
+// Kinds of tokens produced by the lexer
+typedef enum {
+    TOKEN_WORD,
+    TOKEN_PIPE,         // |
+    TOKEN_REDIR_OUT,    // [n]>
+    TOKEN_REDIR_APPEND, // [n]>>
+    TOKEN_REDIR_IN,     // [n]<
+    TOKEN_REDIR_DUP,    // [n]>& or [n]<&
+    TOKEN_HEREDOC,      // [n]<< or [n]<<-
+    TOKEN_HERESTRING,   // [n]<<<
+    TOKEN_AMP,          // &
+    TOKEN_SEMI,         // ;
+    TOKEN_AND,          // &&
+    TOKEN_OR,           // ||
+    TOKEN_NEWLINE       // Unquoted line break
+} TokenKind;
+
+// Structure for one command substitution in a word's resolved text: where its $(...) or
+// `...` characters are and the command source between the delimiters
+typedef struct {
+    size_t start;
+    size_t length;
+    const char* command;
+    int quoted;     // Inside double quotes: the output is not split into fields
+} WordSubst;
+
+// Structure for one $NAME, ${NAME} or $? reference in a word's resolved text: where its
+// characters are, so quotes right after it end the name
+typedef struct {
+    size_t start;
+    size_t length;
+    int quoted;     // Inside double quotes: the value is not split into fields
+} WordParam;
+
+// Structure for one lexed token. WORD text has quotes and escapes resolved and HEREDOC
+// text holds the here-document body; start/length always span the token's raw characters.
+typedef struct {
+    TokenKind kind;
+    int fd;            // File descriptor a redirection applies to, -1 otherwise
+    char* text;        // Resolved word text (NULL for operators)
+    const char* glob;  // WORD text as a glob pattern (quoted *?[ escaped), NULL without unquoted *?[
+    const WordSubst* substs; // Command substitutions in WORD text, in order
+    int n_substs;
+    const WordParam* params; // Parameter references in WORD text, in order; other '$'s are literal
+    int n_params;
+    const char* start;
+    size_t length;
+} Token;
+
+// Structure for the parts of the word being lexed that came from quotes or escapes, so
+// the glob pattern built for it keeps their *, ? and [ literal, and for its parameter
+// references and substitutions
+typedef struct {
+    size_t* spans;  // (start, end) offset pairs into the word's resolved text
+    int n_spans;
+    int capacity;
+    int has_glob;   // An unquoted *, ? or [ appeared in the word
+    WordParam* params;
+    int n_params;
+    int param_capacity;
+    WordSubst* substs;
+    int n_substs;
+    int subst_capacity;
+} WordQuoting;
+
+// Structure for the token stream of one input line
+typedef struct {
+    Token* tokens;
+    int count;
+    int capacity;
+} TokenList;
+
+// Kinds of descriptor operations a redirection performs
+typedef enum {
+    REDIR_OPEN,    // Open a file onto fd
+    REDIR_DUP,     // Make fd a copy of source_fd
+    REDIR_CLOSE,   // Close fd
+    REDIR_HEREDOC  // Feed body to fd through an in-memory file
+} RedirKind;
+
+// Structure for one redirection operation, applied in command-line order
+typedef struct {
+    RedirKind kind;
+    int fd;          // Descriptor the operation targets
+    int open_flags;  // REDIR_OPEN flags
+    int source_fd;   // REDIR_DUP source descriptor
+    char* word;      // REDIR_OPEN path
+    char* body;      // REDIR_HEREDOC text
+    size_t body_len;
+    int ready_fd;    // Descriptor opened by prepare_redirections, -1 otherwise
+    int saved_fd;    // Previous fd saved while a builtin runs, -1 if fd was closed, -2 if unsaved
+} RedirOp;
+
+// Structure to keep information regarding redirection: an ordered list of fd operations
+typedef struct {
+    RedirOp* ops;
+    int count;
+} RedirectionInfo;
+
+// Structure to modify parsed arguments to handle redirection
+typedef struct {
+    char** argv;                    // For a compound stage, just its source text for `jobs`
+    RedirectionInfo* redir_info;
+    int is_background_process;
+    const struct AstNode* compound; // Compound stage, or NULL
+    char** assigns;                 // Expanded `NAME=value` prefix words
+    int n_assigns;
+} ParseResult;
+
+// Kinds of pieces a word is made of before expansion
+typedef enum {
+    PART_LITERAL, // Text used as is
+    PART_PARAM,   // $NAME, ${NAME} or $? reference; text holds the name
+    PART_COMMAND  // $(...) or `...` substitution; command holds the parsed command
+} WordPartKind;
+
+// Structure for one piece of an unexpanded word
+typedef struct {
+    WordPartKind kind;
+    const char* text;
+    size_t length;
+    const struct AstNode* command;
+    int quoted;     // A reference or substitution inside double quotes: never split
+} WordPart;
+
+// Structure for a word with quotes resolved and parameter references left unexpanded
+typedef struct {
+    const char* text; // Whole resolved text, used directly when has_params is 0
+    WordPart* parts;
+    int n_parts;
+    int has_params;   // Expansion and word splitting are needed
+    int has_glob;     // Unquoted *, ? or [ present: fields are matched against pathnames
+    const struct GlobPattern* glob; // Compiled once for words without parameters, NULL if literal
+} AstWord;
+
+// Structure for one redirection as written: the operator and its target word
+typedef struct {
+    TokenKind kind;
+    int fd;
+    AstWord target;
+    AstWord body;   // TOKEN_HEREDOC body; kept literal when the delimiter was quoted
+} AstRedir;
+
+// Structure for one stage of a pipeline: a simple command or a compound command
+typedef struct {
+    AstWord* words;
+    int n_words;
+    int n_assigns;            // Leading words that are `NAME=value` assignments
+    AstRedir* redirs;
+    int n_redirs;
+    struct AstNode* compound; // if/while/until/for stage, run by a forked copy of the shell
+} AstCommand;
+
+// Structure for a pipeline of simple commands
+typedef struct {
+    AstCommand* commands;
+    int n_commands;
+} AstPipeline;
+
+// Kinds of nodes in a parsed command line
+typedef enum {
+    NODE_PIPELINE, // pipeline runs as one job
+    NODE_LIST,     // children run in order (';', '&' and newlines)
+    NODE_AND,      // second runs only if first succeeded
+    NODE_OR,       // second runs only if first failed
+    NODE_NOT,      // '!' inverts first's status
+    NODE_IF,       // first is the condition, second the then-part, third the else-part or NULL
+    NODE_WHILE,    // first is the condition, second the body; until loops while it fails
+    NODE_FOR,      // for_var takes each of for_items (positional parameters without `in`)
+    NODE_TIME      // first (NULL for a bare `time`) is timed and reported using TIMEFORMAT
+} AstNodeKind;
+
+// Structure for one node of a parsed command line
+typedef struct AstNode {
+    AstNodeKind kind;
+    AstPipeline* pipeline;
+    struct AstNode** children;
+    int n_children;
+    struct AstNode* first;
+    struct AstNode* second;
+    struct AstNode* third;
+    int until;
+    const char* for_var;
+    AstWord* for_items;
+    int n_for_items;
+    int for_has_in;
+    AstRedir* redirs;     // Redirections of a compound command
+    int n_redirs;
+    int is_background;    // Followed by '&'
+    const char* source;   // Source text of a compound run in the background, for `jobs`
+} AstNode;
+
+// Structure for the recursive-descent parser's position in a token stream
+typedef struct {
+    TokenList* tokens;
+    int pos;
+    Arena* arena;
+    int incomplete; // Ran out of tokens inside an unfinished construct
+    int failed;     // A syntax error was reported
+} Parser;
+
+// Structure for one cached parse, keyed by the raw line text
+typedef struct {
+    char* line;              // NULL if the slot is unused
+    unsigned int hash;
+    AstNode* ast;
+    unsigned long last_used; // LRU clock value of the latest lookup
+    Arena arena;             // Owns the key and the whole AST
+} AstCacheEntry;
+
+// Structure to maintain record of running background processes
+typedef struct {
+    int job_id;
+    pid_t pid;         // Process group ID, equal to the first member's pid
+    pid_t* pids;       // Every pipeline member, in pipeline order
+    int* statuses;     // Exit code per member, -1 while the member is still running
+    int n_pids;
+    int n_running;
+    char* command;     // Display text, built once when the job is recorded
+    int is_active;
+    int is_done;
+    int is_stopped;
+} Job;
+
+// Structure owning all jobs. A job with ID n lives in slot n - 1, so the ID bitmap doubles
+// as the slot free-list; the pid index maps a running job's pid to its slot. The table and
+// the index both grow on demand.
+typedef struct {
+    Job* list;
+    int capacity;               // Slots in list, always a multiple of 64
+    unsigned long* id_bitmap;   // capacity / 64 words, bit n - 1 set while job ID n is in use
+    pid_t* index_pids;          // Open-addressed pid keys, 0 marks an empty bucket
+    int* index_slots;
+    int index_size;             // Power of two
+    int index_count;
+    int n_done;                 // Finished jobs not yet reported
+} JobSystem;
+
+// Structure to keep mappings of command to completer script
+typedef struct {
+    char* command;
+    char* completer;
+    int persistent;     // Registered with -P: completer stays running as a co-process
+    pid_t coproc_pid;   // -1 while no co-process is running
+    int to_coproc;      // Write end of the co-process stdin
+    int from_coproc;    // Read end of the co-process stdout
+    char* cache_word;   // Word and previous word of the cached reply, NULL if none
+    char* cache_prev;
+    char* reply;        // Raw reply text, result strings point into it
+    char** results;
+    int n_results;
+} CompletionRegister;
+
+// Structure grouping registrations with count tracking variable
+typedef struct {
+    CompletionRegister* list;
+    int count;
+    int capacity;
+} CompletionSystem;
+
+// Structure defining shell variables
+typedef struct {
+    const char* name; // Interned in the variable system's name pool
+    size_t name_len;
+    unsigned int hash;
+    char* value;
+    int exported;     // Passed to the environment of external commands
+} ShellVariable;
+
+// Structure tracking current shell variables: a declaration-ordered list plus an
+// open-addressed hash index over it, both growing on demand
+typedef struct {
+    ShellVariable* list;
+    int count;
+    int capacity;
+    int* index;      // Slots hold positions in list, -1 marks an empty slot
+    int index_size;  // Always a power of two
+    Arena name_pool; // Interned variable names, never reset
+    unsigned long env_generation;  // Bumped whenever an exported variable changes
+    char** envp;                   // Cached NAME=value array handed to exec
+    int envp_count;
+    unsigned long envp_generation; // env_generation the cached envp was built at
+} VariableSystem;
+
+// Structure remembering where a command name was found in PATH
+typedef struct HashedCommand {
+    char* name;
+    char* path;
+    int hits;
+    struct HashedCommand* next;
+} HashedCommand;
+
+// Structure for the command hash table (chained buckets keyed by command name)
+typedef struct {
+    HashedCommand* buckets[HASH_BUCKETS];
+    char* path_snapshot; // Value of PATH the cached entries were resolved against
+    int count;
+} CommandHash;
+
+// Structure bundling the shell state builtins may need
+typedef struct {
+    JobSystem* job_sys;
+    CompletionSystem* comp_sys;
+    VariableSystem* var_sys;
+} ShellContext;
+
+// Structure describing one builtin: its handler, whether a pipeline may run it inside
+// the shell process (so its side effects persist and no fork is needed), and whether a
+// command substitution may, which needs it to leave the shell's state alone
+typedef struct {
+    const char* name;
+    int (*run)(char** argv, ShellContext* ctx);
+    int in_process;
+    int in_substitution;
+} BuiltinCommand;
+
+// Structure for where command lines come from: readline on a terminal, otherwise a
+// memory image of the whole input (mmap'd file or -c string) or block reads from a pipe
+typedef struct {
+    int interactive;   // Read with readline, prompts and history
+    const char* data;  // Input bytes not owned by buffer (mmap'd or -c string)
+    size_t length;
+    size_t offset;     // Next unread byte in data or buffer
+    void* map;         // mmap'd region to unmap, NULL if none
+    size_t map_length;
+    int fd;            // Descriptor read in blocks (pipes), -1 when data holds everything
+    int sync_fd;       // Seekable stdin kept at the next unread byte for children, -1 if none
+    off_t sync_base;   // File offset of data[0] for sync_fd
+    char* buffer;      // Block-read bytes
+    size_t buffer_length;
+    size_t buffer_capacity;
+    int at_eof;
+    int readline_ready; // Readline has been configured (on the first interactive read)
+} InputSource;
+
+// Structure for the HISTFILE store: new entries are appended as they are entered, and the
+// file as it was at startup stays mapped. Readline only holds the newest entries; the line
+// offsets of the older ones are indexed on first use.
+typedef struct {
+    char* path;          // HISTFILE, NULL when history is not persisted
+    int append_fd;       // O_APPEND descriptor, opened on the first append
+    const char* map;     // File contents at startup, NULL if empty or missing
+    size_t map_length;
+    size_t window_start; // Offset of the first entry handed to readline
+    size_t* offsets;     // Starts of the entries before window_start, once indexed
+    int n_offsets;
+    int indexed;
+} HistoryStore;
+
+// Structure for one trigram bucket: ascending ids of the entries containing its trigrams
+typedef struct {
+    int* ids;
+    int count;
+    int capacity;
+} TrigramBucket;
+
+// Structure for the history search index. Entry ids number the mapped HISTFILE entries
+// older than readline's first, then readline's entries; the index is built on the first
+// search and extended with the entries added since on later ones.
+typedef struct {
+    TrigramBucket* buckets; // TRIGRAM_BUCKETS buckets, NULL until the first search
+    int n_indexed;
+} HistoryIndex;
+
+// Phases of running a command line that SHELL_TRACE=1 times
+typedef enum {
+    TRACE_TOKENIZE, // Lexing and parsing (near zero on an AST cache hit)
+    TRACE_EXPAND,   // Turning AST words into argv and redirections
+    TRACE_LOOKUP,   // PATH search and command hash
+    TRACE_SPAWN,    // posix_spawn or fork, in the parent
+    TRACE_WAIT,     // Waiting for foreground children
+    TRACE_PHASE_COUNT
+} TracePhase;
+
+// Structure for the phase timings of one command line, in nanoseconds
+typedef struct {
+    char command[TRACE_COMMAND_SIZE]; // Start of the line, truncated
+    long long phase_ns[TRACE_PHASE_COUNT];
+    long long total_ns;
+} TraceRecord;
+
+// Structure for one PATH directory tracked by the executable index
+typedef struct {
+    char* path;
+    struct timespec mtime; // Modification time when the directory was last read
+    int exists;
+    char** names;          // Sorted executable names, strings live in name_pool
+    int n_names;
+    Arena name_pool;
+} IndexedDir;
+
+// Structure for one completable command name
+typedef struct {
+    const char* name;
+    int dir_idx;    // First PATH directory providing the name, -1 if none
+    int is_builtin;
+} ExeIndexEntry;
+
+// Structure for the sorted index of builtins and PATH executables used by completion
+typedef struct {
+    char* path_snapshot; // Value of PATH the directory list was split from
+    IndexedDir* dirs;
+    int n_dirs;
+    ExeIndexEntry* entries;
+    int count;
+    int is_built;
+} ExeIndex;
+
+// Structure for one entry of a cached directory listing
+typedef struct {
+    const char* name;
+    int is_dir;
+    int is_link;
+} DirSnapshotEntry;
+
+// Structure for a sorted directory listing, valid while the directory is unchanged
+typedef struct {
+    char* path;              // Directory as given to opendir, NULL if the slot is unused
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    DirSnapshotEntry* entries;
+    int count;
+    unsigned long last_used; // LRU clock value of the latest lookup
+    Arena name_pool;
+} DirSnapshot;
+
+// Kinds of elements a glob path component is compiled into
+typedef enum {
+    GLOB_LITERAL, // Run of characters matched exactly
+    GLOB_ANY,     // ?
+    GLOB_STAR,    // *
+    GLOB_CLASS    // [...], as a 256-bit membership set
+} GlobTokenKind;
+
+// Structure for one compiled element of a glob path component
+typedef struct {
+    GlobTokenKind kind;
+    const char* text;     // GLOB_LITERAL characters, escapes removed
+    size_t length;
+    unsigned char* members; // GLOB_CLASS bitmap of accepted bytes
+} GlobToken;
+
+// Structure for one '/'-separated component of a glob pattern
+typedef struct {
+    GlobToken* tokens;
+    int n_tokens;
+    const char* literal; // Component without wildcards (escapes removed), else NULL
+    int is_globstar;     // The component is exactly **
+    int matches_dot;     // Starts with a literal '.', so hidden names may match
+} GlobSegment;
+
+// Structure for a glob pattern compiled once, matched against cached directory listings
+typedef struct GlobPattern {
+    GlobSegment* segments;
+    int n_segments;
+    int is_absolute;
+    int dirs_only;       // Pattern ends in '/': only directories match, shown with the '/'
+} GlobPattern;
+
+// Structure carrying one glob expansion through the directory walk
+typedef struct {
+    const GlobPattern* pattern;
+    Arena* arena;          // Receives the matches
+    char path[PATH_MAX];   // Directory prefix being walked, '/'-terminated unless empty
+    char** matches;
+    int count;
+    int capacity;
+} GlobWalk;
+
+// Library interface used by the shell's entry point and by the benchmarks
+
+// Per-line arena
+void arena_init(Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+
+// Lexing, parsing and expansion
+TokenList* parse_arguments(const char* input_line, int at_eof, int* incomplete, Arena* arena);
+AstNode* build_ast(TokenList* tokens, Arena* arena, int* incomplete);
+AstNode* get_parsed_line(const char* line, int at_eof, int* incomplete, Arena* scratch);
+ParseResult** instantiate_ast(const AstPipeline* pipeline, int is_background_process, ShellContext* ctx, Arena* arena);
+
+// Shell state
+void init_variable_system(VariableSystem* sys);
+int set_variable(VariableSystem* var_sys, const char* name, const char* value);
+const char* lookup_variable(VariableSystem* var_sys, const char* name, size_t len);
+int export_variable(VariableSystem* var_sys, const char* name, int exported);
+void import_environment(VariableSystem* var_sys);
+char** get_environment(VariableSystem* var_sys);
+void init_jobs_system(JobSystem* sys);
+JobSystem* get_set_job_context(JobSystem* new_sys);
+void init_completion_system(CompletionSystem* sys);
+void init_builtin_output(void);
+void flush_builtin_output(void);
+
+// Command lookup, completion and execution
+char* find_exe_in_path(const char* exe);
+char* command_generator(const char* text, int state);
+char* filename_generator(const char* text, int state);
+GlobPattern* compile_glob(const char* pattern, Arena* arena);
+int expand_glob(const GlobPattern* pattern, Arena* arena, char*** matches_out);
+void execute_pipeline(ParseResult** segments, int n_segments, int is_background_process, ShellContext* ctx, Arena* arena);
+int execute_node(const AstNode* node, ShellContext* ctx, Arena* arena);
+
+// Runs the shell as invoked with argc/argv and returns its exit status
+int shell_main(int argc, char** argv);
+
+#endif